@@ -20,25 +20,176 @@ $       Matches the ending position.  MUST USE if want to match whole string.
 {m,n}   Matches the preceding element at least m and not more than n times.
 {m}     Matches the preceding element exactly m times.
  */
+#define _GNU_SOURCE             /* recvmmsg, sendmmsg */
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <regex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SIMD_X86 1              /* kernels built per target, picked at run time */
+#endif
 
 #define clean_errno() (errno == 0 ? "None" : strerror(errno))
 #define log_err(M, ...) fprintf(stderr, "[ERROR] (%s:%d: errno: %s) " M "\n", __FILE__, __LINE__, clean_errno(), ##__VA_ARGS__)
 #define check(A, M, ...) if(!(A)) { log_err(M, ##__VA_ARGS__); errno=0; goto error; }
 #define check_mem(A) check((A), "Out of memory.")
 
-#define LINE_BUF_SIZE 1024
+#define MAX_REPEAT 255          /* larger {m,n} bounds are left to regexec */
+#define MAX_NFA_STATES 100000
+#define MAX_DFA_STATES 10000
 
-struct TestCase {
-    int regex_idx;
-    char *str;
-    int isMatch;
+#define bit_set(B, I) ((B)[(I) >> 6] |= 1ULL << ((I) & 63))
+#define bit_test(B, I) (((B)[(I) >> 6] >> ((I) & 63)) & 1)
+
+/* Recorded (rule, name, expected) triples stored by column, so a batch
+ * replay walks flat arrays: names are packed end to end in one blob and
+ * name i is blob[off[i], off[i + 1]). */
+struct TestBatch {
+    size_t n;
+    int *regex_idx;
+    uint64_t *expect;       /* bit i set if case i should match */
+    char *blob;
+    size_t *off;            /* n + 1 entries */
+};
+
+/* A line of a mapped file, without its newline. */
+struct Line {
+    const char *ptr;
+    size_t len;
+};
+
+/* A file mapped read-only with an index of its lines. */
+struct LineFile {
+    char *data;
+    size_t size;
+    struct Line *lines;
+    size_t n, cap;
+};
+
+/* Bump allocator for data that lives and dies with one load phase, such
+ * as a test file's parsed cases or a compiled rule set: blocks double in
+ * size, so n allocations cost O(log n) mallocs, and free_arena releases
+ * them all at once.  Requests of a quarter block or more get a block of
+ * their own behind the current one. */
+#define ARENA_BLOCK (64 << 10)
+#define ARENA_MAX_BLOCK (16 << 20)
+#define ARENA_ALIGN 16
+
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;            /* data follows, ARENA_ALIGN aligned */
 };
 
+struct Arena {
+    struct ArenaBlock *head;
+    char *ptr, *end;        /* free part of head */
+    size_t bytes;           /* handed out */
+    int blocks;
+};
+
+#define ARENA_HDR ((sizeof(struct ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void *arena_alloc(struct Arena *a, size_t n) {
+    struct ArenaBlock *b;
+    char *p;
+
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (n > (size_t)(a->end - a->ptr)) {
+        size_t size = a->head ? a->head->size * 2 : ARENA_BLOCK;
+        if (size > ARENA_MAX_BLOCK) size = ARENA_MAX_BLOCK;
+        if (a->head && n >= size / 4) {
+            b = (struct ArenaBlock *)malloc(ARENA_HDR + n);
+            if (!b) return NULL;
+            b->size = n;
+            b->next = a->head->next;
+            a->head->next = b;
+            a->blocks++;
+            a->bytes += n;
+            return (char *)b + ARENA_HDR;
+        }
+        if (size < n) size = n;
+        b = (struct ArenaBlock *)malloc(ARENA_HDR + size);
+        if (!b) return NULL;
+        b->size = size;
+        b->next = a->head;
+        a->head = b;
+        a->ptr = (char *)b + ARENA_HDR;
+        a->end = a->ptr + size;
+        a->blocks++;
+    }
+    p = a->ptr;
+    a->ptr += n;
+    a->bytes += n;
+    return p;
+}
+
+void *arena_calloc(struct Arena *a, size_t n) {
+    void *p = arena_alloc(a, n);
+    if (p) memset(p, 0, n);
+    return p;
+}
+
+char *arena_strndup(struct Arena *a, const char *s, size_t n) {
+    char *p = (char *)arena_alloc(a, n + 1);
+    if (!p) return NULL;
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+void free_arena(struct Arena *a) {
+    while (a->head) {
+        struct ArenaBlock *b = a->head;
+        a->head = b->next;
+        free(b);
+    }
+    memset(a, 0, sizeof(*a));
+}
+
+#ifdef COUNT_ALLOCS
+/* Counts heap allocations for bench, replacing glibc's malloc entry points
+ * with counting wrappers around its own. */
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t n);
+
+unsigned long heap_allocs;
+
+void *malloc(size_t n) {
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size) {
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n) {
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, n);
+}
+#endif
+
 void free_lines(char **lines, int n) {
     if (lines) {
         for (int i = 0; i < n; i++)
@@ -47,145 +198,7666 @@ void free_lines(char **lines, int n) {
     }
 }
 
-char **read_lines(char *filepath, int *size) {
-    int i = 0;
-    char **lines = NULL;
+void unmap_lines(struct LineFile *lf) {
+    if (lf->data) munmap(lf->data, lf->size);
+    free(lf->lines);
+    memset(lf, 0, sizeof(*lf));
+}
+
+int write_all(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t k = write(fd, p, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return -1;
+        p += k;
+        n -= k;
+    }
+    return 0;
+}
+
+int push_line(struct LineFile *lf, size_t start, size_t end) {
+    if (lf->n == lf->cap) {
+        size_t new_cap = lf->cap ? lf->cap * 2 : 1024;
+        struct Line *tmp = (struct Line *)realloc(lf->lines, sizeof(struct Line) * new_cap);
+        check_mem(tmp);
+        lf->lines = tmp;
+        lf->cap = new_cap;
+    }
+    lf->lines[lf->n].ptr = lf->data + start;
+    lf->lines[lf->n++].len = end - start;
+    return 0;
+error:
+    return -1;
+}
 
-    FILE *f;
-    f = fopen(filepath, "r");
-    check(f != NULL, "File open error: %s", filepath);
+/* Maps filepath and indexes its lines.  Lines are views into the mapping,
+ * so there is no per-line allocation and no length limit. */
+int map_lines(const char *filepath, struct LineFile *lf) {
+    struct stat st;
+    size_t i = 0, start = 0;
+    int fd;
 
-    int len;
-    char buf[LINE_BUF_SIZE];
-    int cap = 10;
-    lines = (char **)malloc(cap * sizeof(char *));
-    check_mem(lines);
+    memset(lf, 0, sizeof(*lf));
+    fd = open(filepath, O_RDONLY);
+    check(fd >= 0, "File open error: %s", filepath);
+    check(fstat(fd, &st) == 0, "File stat error: %s", filepath);
+    lf->size = st.st_size;
+    if (lf->size > 0) {
+        lf->data = (char *)mmap(NULL, lf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (lf->data == MAP_FAILED) lf->data = NULL;
+        check(lf->data != NULL, "File map error: %s", filepath);
+        madvise(lf->data, lf->size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    fd = -1;
 
-    while (fgets(buf, LINE_BUF_SIZE, f) != NULL) {
-        if (i == cap) {
-            int new_cap = cap * 2;
-            char **tmp= (char **)realloc(lines, sizeof(char *) * new_cap);
-            check_mem(tmp);
-            lines = tmp;
-            cap = new_cap;
-        }
-        len = strlen(buf);
-        lines[i] = (char *)malloc(sizeof(char) * (len + 1));
-        check_mem(lines[i]);
-        strncpy(lines[i], buf, len-1);
-        lines[i][len-1] = '\0';
-        i++;
-    }
-    if (f) fclose(f);
-    *size = i;
-    return lines;
+#ifdef __SSE2__
+    /* 16 bytes per step: compare against '\n' and walk the hit mask */
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= lf->size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(lf->data + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        for (; mask; mask &= mask - 1) {
+            size_t end = i + __builtin_ctz(mask);
+            if (push_line(lf, start, end)) goto error;
+            start = end + 1;
+        }
+    }
+#endif
+    for (; i < lf->size; i++) {
+        if (lf->data[i] != '\n') continue;
+        if (push_line(lf, start, i)) goto error;
+        start = i + 1;
+    }
+    if (start < lf->size && push_line(lf, start, lf->size)) goto error;
+    return 0;
 
 error:
-    free_lines(lines, i);
-    if (f) fclose(f);
-    *size = 0;
-    return NULL;
+    if (fd >= 0) close(fd);
+    unmap_lines(lf);
+    return -1;
+}
+
+/* Splits off the next space-separated field of *line. */
+struct Line next_field(struct Line *line) {
+    struct Line f;
+    while (line->len && *line->ptr == ' ') {
+        line->ptr++;
+        line->len--;
+    }
+    f.ptr = line->ptr;
+    while (line->len && *line->ptr != ' ') {
+        line->ptr++;
+        line->len--;
+    }
+    f.len = line->ptr - f.ptr;
+    return f;
+}
+
+/* Parses size test cases into a; they go with the arena. */
+int parse_test_cases(const struct Line *lines, int size, struct TestBatch *tb, struct Arena *a) {
+    size_t bytes = 0;
+
+    for (int i = 0; i < size; i++) {
+        struct Line line = lines[i];
+        struct Line idx = next_field(&line);
+        struct Line str = next_field(&line);
+        struct Line expect = next_field(&line);
+        check(idx.len && str.len && expect.len, "Malformed test case on line %d", i + 1);
+        bytes += str.len;
+    }
+
+    tb->n = size;
+    tb->regex_idx = (int *)arena_alloc(a, sizeof(int) * (size ? size : 1));
+    tb->expect = (uint64_t *)arena_calloc(a, sizeof(uint64_t) * ((size + 63) / 64 + 1));
+    tb->off = (size_t *)arena_alloc(a, sizeof(size_t) * (size + 1));
+    tb->blob = (char *)arena_alloc(a, bytes + 1);
+    check_mem(tb->regex_idx && tb->expect && tb->off && tb->blob);
+
+    tb->off[0] = 0;
+    for (int i = 0; i < size; i++) {
+        struct Line line = lines[i];
+        struct Line idx = next_field(&line);
+        struct Line str = next_field(&line);
+        struct Line expect = next_field(&line);
+        tb->regex_idx[i] = atoi(idx.ptr);
+        if (expect.ptr[0] != '0') bit_set(tb->expect, i);
+        memcpy(tb->blob + tb->off[i], str.ptr, str.len);
+        tb->off[i + 1] = tb->off[i] + str.len;
+    }
+    tb->blob[bytes] = '\0';
+    return 0;
+error:
+    return -1;
 }
 
-void free_test_cases(struct TestCase **tests, int n) {
-    if (tests) {
-        for (int i = 0; i < n; i++) {
-            if (tests[i]->str) free(tests[i]->str);
-            free(tests[i]);
+/* Character sets ---------------------------------------------------------- */
+
+struct CharSet {
+    uint64_t w[4];
+};
+
+static inline void cs_add(struct CharSet *cs, int c) { cs->w[c >> 6] |= 1ULL << (c & 63); }
+static inline void cs_del(struct CharSet *cs, int c) { cs->w[c >> 6] &= ~(1ULL << (c & 63)); }
+static inline int cs_has(const struct CharSet *cs, int c) { return (cs->w[c >> 6] >> (c & 63)) & 1; }
+
+int cs_add_class(struct CharSet *cs, const char *name, int len) {
+    static const struct { const char *name; int (*fn)(int); } classes[] = {
+        {"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum},
+        {"upper", isupper}, {"lower", islower}, {"space", isspace},
+        {"blank", isblank}, {"punct", ispunct}, {"print", isprint},
+        {"graph", isgraph}, {"cntrl", iscntrl}, {"xdigit", isxdigit},
+    };
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+        if ((int)strlen(classes[i].name) == len && !strncmp(classes[i].name, name, len)) {
+            for (int c = 1; c < 256; c++)
+                if (classes[i].fn(c)) cs_add(cs, c);
+            return 1;
         }
-        free(tests);
     }
+    return 0;
 }
 
-struct TestCase **parse_test_cases(char **lines, int size) {
-    int i = 0;
-    struct TestCase **rs = (struct TestCase **)malloc(sizeof(struct TestCase*) * size);
-    check_mem(rs);
+/* Parser: pattern -> AST --------------------------------------------------
+ *
+ * Handles the ERE subset documented at the top of this file.  Anything else
+ * (back-references, GNU escapes, collating elements, huge bounds) makes the
+ * parse fail and the pattern stays on regexec.
+ */
 
-    char *line;
-    char *token;
-    char *sep = " ";
-    while (i < size) {
-        struct TestCase *t = (struct TestCase *)malloc(sizeof(struct TestCase));
-        check_mem(t);
-        rs[i] = t;
-        line = lines[i++];
-        token = strtok(line, sep);
-        t->regex_idx = atoi(token);
-        token = strtok(NULL, sep);
-        t->str = strdup(token);
-        check_mem(t->str);
-        token = strtok(NULL, sep);
-        t->isMatch = atoi(token);
+enum NodeType { N_EMPTY, N_SET, N_CAT, N_ALT, N_REPEAT, N_GROUP, N_BOL, N_EOL };
+
+struct Node {
+    int type;
+    int left, right;    /* operands; N_REPEAT and N_GROUP use left only */
+    int min, max;       /* N_REPEAT bounds, max == -1 means unbounded */
+    int group;          /* N_GROUP subexpression number, from 1 */
+    struct CharSet set; /* N_SET */
+};
+
+struct Ast {
+    struct Node *nodes;
+    int n, cap;
+    int root;           /* -1 if the pattern could not be parsed */
+    int ngroups;
+};
+
+struct Parser {
+    const char *p;
+    struct Ast *ast;
+    int depth;
+    int anchors;        /* ^ and $ seen so far */
+};
+
+void free_ast(struct Ast *ast) {
+    free(ast->nodes);
+    memset(ast, 0, sizeof(*ast));
+    ast->root = -1;
+}
+
+int ast_node(struct Ast *ast, int type, int left, int right) {
+    if (ast->n == ast->cap) {
+        int new_cap = ast->cap ? ast->cap * 2 : 16;
+        struct Node *tmp = (struct Node *)realloc(ast->nodes, sizeof(struct Node) * new_cap);
+        check_mem(tmp);
+        ast->nodes = tmp;
+        ast->cap = new_cap;
     }
-    return rs;
+    struct Node *nd = &ast->nodes[ast->n];
+    memset(nd, 0, sizeof(*nd));
+    nd->type = type;
+    nd->left = left;
+    nd->right = right;
+    return ast->n++;
 error:
-    free_test_cases(rs, i);
-    return NULL;
+    return -1;
 }
 
-int main() {
-    int reti;
-    int retcode = 1;
-    char msgbuf[100];
+int parse_alt(struct Parser *ps);
 
-    int p_size = 0;
-    int t_size = 0;
-    int regcomp_cnt = 0;
-    char **patterns = NULL;
-    char **test_lines = NULL;
-    regex_t *regexs = NULL;
-    struct TestCase **tests = NULL;
-
-    /* Read patterns */
-    patterns = read_lines("pattern.txt", &p_size);
-    if (!patterns) goto error;
-
-    /* Compile regular expression */
-    regexs = (regex_t *)malloc(sizeof(regex_t) * p_size);
-    check_mem(regexs);
-    for (int i=0; i < p_size; i++) {
-        reti = regcomp(&regexs[i], patterns[i], REG_EXTENDED | REG_NOSUB);
-        if (reti) {
-            fprintf(stderr, "Could not compile regex: %s\n", patterns[i]);
-            regcomp_cnt = i;
-            goto error;
+int parse_bracket(struct Parser *ps) {
+    struct CharSet cs = {{0}};
+    const char *p = ps->p;
+    int negate = 0, first = 1;
+
+    if (*p == '^') {
+        negate = 1;
+        p++;
+    }
+    while (*p && (first || *p != ']')) {
+        int lo, hi;
+        first = 0;
+        if (p[0] == '[' && p[1] == ':') {
+            const char *end = strstr(p + 2, ":]");
+            if (!end || !cs_add_class(&cs, p + 2, end - p - 2)) return -1;
+            p = end + 2;
+            if (p[0] == '-' && p[1] != ']') return -1;
+            continue;
         }
+        if (p[0] == '[' && (p[1] == '.' || p[1] == '=')) return -1;
+        lo = hi = (unsigned char)*p++;
+        if (p[0] == '-' && p[1] && p[1] != ']') {
+            if (p[1] == '[') return -1;
+            hi = (unsigned char)p[1];
+            p += 2;
+            if (hi < lo) return -1;
+        }
+        for (int c = lo; c <= hi; c++)
+            cs_add(&cs, c);
     }
-    regcomp_cnt = p_size;
+    if (*p != ']') return -1;
+    ps->p = p + 1;
 
-    /* Read test cases */
-    test_lines = read_lines("test.txt", &t_size);
-    if (!test_lines) goto error;
+    if (negate)
+        for (int i = 0; i < 4; i++)
+            cs.w[i] = ~cs.w[i];
+    cs_del(&cs, 0);
+    int nd = ast_node(ps->ast, N_SET, -1, -1);
+    if (nd >= 0) ps->ast->nodes[nd].set = cs;
+    return nd;
+}
 
-    tests = parse_test_cases(test_lines, t_size);
-    if (!tests) goto error;
+int parse_atom(struct Parser *ps) {
+    int nd, escaped = 0, c = (unsigned char)*ps->p;
 
-    /* Execute regular expression */
-    for (int i=0; i < t_size; i++) {
-        struct TestCase *t = tests[i];
-        char *state;
-        reti = regexec(&regexs[t->regex_idx], t->str, 0, NULL, 0);
-        if ((t->isMatch && reti == 0) || (!t->isMatch && reti)) {
-            regerror(reti, &regexs[t->regex_idx], msgbuf, sizeof(msgbuf));
-            state = "Success";
+    switch (c) {
+    case '(': {
+        int group = ++ps->ast->ngroups;
+        ps->p++;
+        if (++ps->depth > 1000) return -1;
+        int inner = parse_alt(ps);
+        ps->depth--;
+        if (inner < 0 || *ps->p != ')') return -1;
+        ps->p++;
+        nd = ast_node(ps->ast, N_GROUP, inner, -1);
+        if (nd >= 0) ps->ast->nodes[nd].group = group;
+        return nd;
+    }
+    case '[':
+        ps->p++;
+        return parse_bracket(ps);
+    case '^':
+        ps->p++;
+        ps->anchors++;
+        return ast_node(ps->ast, N_BOL, -1, -1);
+    case '$':
+        ps->p++;
+        ps->anchors++;
+        return ast_node(ps->ast, N_EOL, -1, -1);
+    case '*': case '+': case '?': case '{': case '\0':
+        return -1;
+    case '\\':
+        c = (unsigned char)ps->p[1];
+        if (!c || strchr("wWsSbB<>`'123456789", c)) return -1;
+        ps->p += 2;
+        escaped = 1;
+        break;
+    default:
+        ps->p++;
+        break;
+    }
+
+    nd = ast_node(ps->ast, N_SET, -1, -1);
+    if (nd < 0) return -1;
+    if (c == '.' && !escaped) {
+        memset(&ps->ast->nodes[nd].set, 0xff, sizeof(struct CharSet));
+        cs_del(&ps->ast->nodes[nd].set, 0);
+    } else {
+        cs_add(&ps->ast->nodes[nd].set, c);
+    }
+    return nd;
+}
+
+int parse_bound(struct Parser *ps, int *min, int *max) {
+    const char *p = ps->p + 1;
+    char *end;
+
+    if (!isdigit((unsigned char)*p)) return -1;
+    *min = *max = (int)strtol(p, &end, 10);
+    p = end;
+    if (*p == ',') {
+        p++;
+        if (isdigit((unsigned char)*p)) {
+            *max = (int)strtol(p, &end, 10);
+            p = end;
         } else {
-            regerror(reti, &regexs[t->regex_idx], msgbuf, sizeof(msgbuf));
-            state = "Failed";
+            *max = -1;
         }
-        fprintf(stderr, "[%s] regex %d %s: %s\n",
-                state, t->regex_idx, t->str, msgbuf);
     }
-    retcode = 0;
+    if (*p != '}' || *min > MAX_REPEAT || *max > MAX_REPEAT) return -1;
+    if (*max >= 0 && *max < *min) return -1;
+    ps->p = p + 1;
+    return 0;
+}
+
+int parse_repeat(struct Parser *ps) {
+    int anchors = ps->anchors;
+    int nd = parse_atom(ps);
+
+    while (nd >= 0) {
+        int min, max;
+        switch (*ps->p) {
+        case '*': min = 0; max = -1; ps->p++; break;
+        case '+': min = 1; max = -1; ps->p++; break;
+        case '?': min = 0; max = 1; ps->p++; break;
+        case '{':
+            if (parse_bound(ps, &min, &max)) return -1;
+            break;
+        default:
+            return nd;
+        }
+        /* glibc treats repeated anchors idiosyncratically; leave them to it */
+        if (ps->anchors != anchors) return -1;
+        int rep = ast_node(ps->ast, N_REPEAT, nd, -1);
+        if (rep < 0) return -1;
+        ps->ast->nodes[rep].min = min;
+        ps->ast->nodes[rep].max = max;
+        nd = rep;
+    }
+    return nd;
+}
+
+int parse_cat(struct Parser *ps) {
+    int left = -1;
+
+    while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+        int right = parse_repeat(ps);
+        if (right < 0) return -1;
+        left = left < 0 ? right : ast_node(ps->ast, N_CAT, left, right);
+        if (left < 0) return -1;
+    }
+    return left < 0 ? ast_node(ps->ast, N_EMPTY, -1, -1) : left;
+}
+
+int parse_alt(struct Parser *ps) {
+    int left = parse_cat(ps);
+
+    while (left >= 0 && *ps->p == '|') {
+        ps->p++;
+        int right = parse_cat(ps);
+        if (right < 0) return -1;
+        left = ast_node(ps->ast, N_ALT, left, right);
+    }
+    return left;
+}
+
+/* Returns 0 on success.  On failure ast->root is -1 and the caller should
+ * fall back to regexec for this pattern. */
+int parse_pattern(const char *pattern, struct Ast *ast) {
+    struct Parser ps = {pattern, ast, 0, 0};
+
+    memset(ast, 0, sizeof(*ast));
+    ast->root = parse_alt(&ps);
+    if (ast->root < 0 || *ps.p != '\0') {
+        free_ast(ast);
+        return -1;
+    }
+    return 0;
+}
+
+/* parse_pattern for many patterns: builds in work, whose nodes are reused
+ * from one pattern to the next, and copies the result into a. */
+int parse_pattern_into(const char *pattern, struct Ast *ast, struct Ast *work, struct Arena *a) {
+    struct Parser ps = {pattern, work, 0, 0};
+    int root;
+
+    memset(ast, 0, sizeof(*ast));
+    ast->root = -1;
+    work->n = 0;
+    work->ngroups = 0;
+    root = parse_alt(&ps);
+    if (root < 0 || *ps.p != '\0') return -1;
+    ast->nodes = (struct Node *)arena_alloc(a, sizeof(struct Node) * work->n);
+    check_mem(ast->nodes);
+    memcpy(ast->nodes, work->nodes, sizeof(struct Node) * work->n);
+    ast->n = ast->cap = work->n;
+    ast->root = root;
+    ast->ngroups = work->ngroups;
+    return 0;
+error:
+    return -1;
+}
+
+/* Thompson NFA shared by all patterns of a rule set ----------------------- */
+
+enum NStateType { S_SET, S_SPLIT, S_EPS, S_BOL, S_EOL, S_MATCH, S_SAVE };
+
+struct NState {
+    int type;
+    int out, out1;      /* successors; out1 only for S_SPLIT */
+    int arg;            /* S_SET: index into sets, S_MATCH: pattern index,
+                           S_SAVE: capture slot */
+};
+
+struct Nfa {
+    struct NState *states;
+    int n, cap;
+    struct CharSet *sets;
+    int nsets, setcap;
+    int *start;         /* per pattern, -1 if the pattern is not in the NFA */
+    int npat;
+    int captures;       /* emit S_SAVE states around groups */
+};
+
+void free_nfa(struct Nfa *nfa) {
+    free(nfa->states);
+    free(nfa->sets);
+    free(nfa->start);
+    memset(nfa, 0, sizeof(*nfa));
+}
+
+int nfa_state(struct Nfa *nfa, int type, int out, int out1, int arg) {
+    if (nfa->n >= MAX_NFA_STATES) return -1;
+    if (nfa->n == nfa->cap) {
+        int new_cap = nfa->cap ? nfa->cap * 2 : 64;
+        struct NState *tmp = (struct NState *)realloc(nfa->states, sizeof(struct NState) * new_cap);
+        check_mem(tmp);
+        nfa->states = tmp;
+        nfa->cap = new_cap;
+    }
+    struct NState *s = &nfa->states[nfa->n];
+    s->type = type;
+    s->out = out;
+    s->out1 = out1;
+    s->arg = arg;
+    return nfa->n++;
+error:
+    return -1;
+}
+
+int nfa_set(struct Nfa *nfa, const struct CharSet *cs) {
+    for (int i = nfa->nsets - 1; i >= 0 && i >= nfa->nsets - 8; i--)
+        if (!memcmp(&nfa->sets[i], cs, sizeof(*cs))) return i;
+    if (nfa->nsets == nfa->setcap) {
+        int new_cap = nfa->setcap ? nfa->setcap * 2 : 32;
+        struct CharSet *tmp = (struct CharSet *)realloc(nfa->sets, sizeof(struct CharSet) * new_cap);
+        check_mem(tmp);
+        nfa->sets = tmp;
+        nfa->setcap = new_cap;
+    }
+    nfa->sets[nfa->nsets] = *cs;
+    return nfa->nsets++;
+error:
+    return -1;
+}
+
+/* Emits the fragment for AST node idx so that it continues into state next,
+ * building back to front.  Returns the fragment's entry state or -1. */
+int nfa_emit(struct Nfa *nfa, const struct Ast *ast, int idx, int next) {
+    const struct Node *nd = &ast->nodes[idx];
+    int a, b, s;
+
+    if (next < 0) return -1;
+    switch (nd->type) {
+    case N_EMPTY:
+        return next;
+    case N_SET:
+        if ((a = nfa_set(nfa, &nd->set)) < 0) return -1;
+        return nfa_state(nfa, S_SET, next, -1, a);
+    case N_CAT:
+        return nfa_emit(nfa, ast, nd->left, nfa_emit(nfa, ast, nd->right, next));
+    case N_ALT:
+        a = nfa_emit(nfa, ast, nd->left, next);
+        b = nfa_emit(nfa, ast, nd->right, next);
+        if (a < 0 || b < 0) return -1;
+        return nfa_state(nfa, S_SPLIT, a, b, 0);
+    case N_GROUP:
+        if (!nfa->captures) return nfa_emit(nfa, ast, nd->left, next);
+        if ((s = nfa_state(nfa, S_SAVE, next, -1, 2 * nd->group + 1)) < 0) return -1;
+        if ((a = nfa_emit(nfa, ast, nd->left, s)) < 0) return -1;
+        return nfa_state(nfa, S_SAVE, a, -1, 2 * nd->group);
+    case N_BOL:
+        return nfa_state(nfa, S_BOL, next, -1, 0);
+    case N_EOL:
+        return nfa_state(nfa, S_EOL, next, -1, 0);
+    case N_REPEAT:
+        s = next;
+        if (nd->max < 0) {
+            /* greedy loop: prefer another iteration over leaving */
+            if ((s = nfa_state(nfa, S_SPLIT, -1, next, 0)) < 0) return -1;
+            if ((a = nfa_emit(nfa, ast, nd->left, s)) < 0) return -1;
+            nfa->states[s].out = a;
+        } else {
+            for (int i = nd->min; i < nd->max; i++) {
+                if ((a = nfa_emit(nfa, ast, nd->left, s)) < 0) return -1;
+                if ((s = nfa_state(nfa, S_SPLIT, a, next, 0)) < 0) return -1;
+            }
+        }
+        for (int i = 0; i < nd->min; i++)
+            if ((s = nfa_emit(nfa, ast, nd->left, s)) < 0) return -1;
+        return s;
+    }
+    return -1;
+}
+
+/* Adds pattern pat to the NFA.  On failure the NFA is rolled back and the
+ * pattern is left out. */
+int nfa_add_pattern(struct Nfa *nfa, const struct Ast *ast, int pat) {
+    int n = nfa->n, nsets = nfa->nsets;
+    int m = nfa_state(nfa, S_MATCH, -1, -1, pat);
+    int start = m < 0 ? -1 : nfa_emit(nfa, ast, ast->root, m);
+
+    if (start < 0) {
+        nfa->n = n;
+        nfa->nsets = nsets;
+        return -1;
+    }
+    nfa->start[pat] = start;
+    return 0;
+}
+
+#define CLOSURE_BOL 1   /* at the start of the subject: ^ may be crossed */
+#define CLOSURE_EOL 2   /* at the end of the subject: $ may be crossed */
+
+/* Per-thread buffers for epsilon closures. */
+struct NfaScratch {
+    uint32_t *mark;
+    uint32_t gen;
+    int *stack;
+    int *buf;
+};
+
+void free_nfa_scratch(struct NfaScratch *ns) {
+    free(ns->mark);
+    free(ns->stack);
+    free(ns->buf);
+    memset(ns, 0, sizeof(*ns));
+}
+
+int init_nfa_scratch(struct NfaScratch *ns, const struct Nfa *nfa) {
+    int n = nfa->n + 1;
+    memset(ns, 0, sizeof(*ns));
+    ns->mark = (uint32_t *)calloc(n, sizeof(uint32_t));
+    ns->stack = (int *)malloc(sizeof(int) * (3 * n + nfa->npat));
+    ns->buf = (int *)malloc(sizeof(int) * (n + nfa->npat));
+    check_mem(ns->mark && ns->stack && ns->buf);
+    return 0;
+error:
+    free_nfa_scratch(ns);
+    return -1;
+}
+
+int cmp_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/* Follows epsilon edges from seeds and writes the sorted set of states that
+ * matter to a DFA (character sets, matches and uncrossed $) to ns->buf. */
+int nfa_closure(const struct Nfa *nfa, struct NfaScratch *ns, const int *seeds, int nseeds, int flags) {
+    int sp = 0, n = 0;
+
+    if (++ns->gen == 0) {
+        memset(ns->mark, 0, sizeof(uint32_t) * (nfa->n + 1));
+        ns->gen = 1;
+    }
+    for (int i = nseeds - 1; i >= 0; i--)
+        ns->stack[sp++] = seeds[i];
+    while (sp > 0) {
+        int id = ns->stack[--sp];
+        const struct NState *s = &nfa->states[id];
+        if (ns->mark[id] == ns->gen) continue;
+        ns->mark[id] = ns->gen;
+        switch (s->type) {
+        case S_SET:
+        case S_MATCH:
+            ns->buf[n++] = id;
+            break;
+        case S_EOL:
+            if (flags & CLOSURE_EOL) ns->stack[sp++] = s->out;
+            else ns->buf[n++] = id;
+            break;
+        case S_BOL:
+            if (flags & CLOSURE_BOL) ns->stack[sp++] = s->out;
+            break;
+        case S_SPLIT:
+            ns->stack[sp++] = s->out1;
+            ns->stack[sp++] = s->out;
+            break;
+        case S_EPS:
+        case S_SAVE:
+            ns->stack[sp++] = s->out;
+            break;
+        }
+    }
+    qsort(ns->buf, n, sizeof(int), cmp_int);
+    return n;
+}
+
+/* Combined DFA over all patterns ------------------------------------------
+ *
+ * Each DFA state is a set of NFA states.  Unanchored patterns are restarted
+ * at every byte, so one left-to-right scan finds every pattern that matches
+ * anywhere in the subject.  States record which patterns accept on entering
+ * them (acc) and which accept if the subject ends there (eoi).
+ */
+
+struct Dfa {
+    int nstates, cap;
+    int ncls;
+    int nwords;             /* uint64_t words per accept set */
+    int start, dead;
+    int max_states;
+    uint8_t cls[256];       /* byte -> equivalence class */
+    uint8_t rep[256];       /* class -> representative byte */
+    int32_t *trans;         /* nstates * ncls, -1 if not computed yet */
+    int32_t *acc;           /* offset into accpool or -1 */
+    int32_t *eoi;           /* offset into accpool or -1 */
+    uint64_t *accpool;
+    int naccpool, accpoolcap;
+
+    /* construction state */
+    int32_t *key_off, *key_len;
+    int *keys;
+    int nkeys, keycap;
+    int32_t *htab;
+    int hcap;
+    int *restart;           /* entry states of unanchored patterns */
+    int nrestart;
+    int *start_key;
+    int nstart_key;
+    struct NfaScratch ns;
+};
+
+void free_dfa(struct Dfa *d) {
+    free(d->trans);
+    free(d->acc);
+    free(d->eoi);
+    free(d->accpool);
+    free(d->key_off);
+    free(d->key_len);
+    free(d->keys);
+    free(d->htab);
+    free(d->restart);
+    free(d->start_key);
+    free_nfa_scratch(&d->ns);
+    memset(d, 0, sizeof(*d));
+}
+
+/* Partitions the byte alphabet so bytes no NFA set tells apart share a
+ * transition column. */
+void dfa_byte_classes(struct Dfa *d, const struct Nfa *nfa) {
+    memset(d->cls, 0, sizeof(d->cls));
+    d->ncls = 1;
+    for (int i = 0; i < nfa->nsets; i++) {
+        int remap[512], ncls = 0;
+        for (int j = 0; j < 512; j++)
+            remap[j] = -1;
+        for (int c = 0; c < 256; c++) {
+            int k = d->cls[c] * 2 + cs_has(&nfa->sets[i], c);
+            if (remap[k] < 0) remap[k] = ncls++;
+            d->cls[c] = remap[k];
+        }
+        d->ncls = ncls;
+    }
+    for (int c = 255; c >= 0; c--)
+        d->rep[d->cls[c]] = c;
+}
+
+int dfa_accept_set(struct Dfa *d, const struct Nfa *nfa, const int *set, int n) {
+    int off = -1;
+    for (int i = 0; i < n; i++) {
+        const struct NState *s = &nfa->states[set[i]];
+        if (s->type != S_MATCH) continue;
+        if (off < 0) {
+            if (d->naccpool + d->nwords > d->accpoolcap) {
+                int new_cap = d->accpoolcap ? d->accpoolcap * 2 : 64;
+                while (new_cap < d->naccpool + d->nwords) new_cap *= 2;
+                uint64_t *tmp = (uint64_t *)realloc(d->accpool, sizeof(uint64_t) * new_cap);
+                check_mem(tmp);
+                d->accpool = tmp;
+                d->accpoolcap = new_cap;
+            }
+            off = d->naccpool;
+            d->naccpool += d->nwords;
+            memset(d->accpool + off, 0, sizeof(uint64_t) * d->nwords);
+        }
+        bit_set(d->accpool + off, s->arg);
+    }
+    return off;
+error:
+    return -2;
+}
+
+uint32_t hash_ints(const int *v, int n) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < n; i++) {
+        h ^= (uint32_t)v[i];
+        h *= 16777619u;
+    }
+    return h ^ (uint32_t)n;
+}
+
+int dfa_rehash(struct Dfa *d) {
+    int hcap = d->hcap ? d->hcap * 2 : 1024;
+    int32_t *htab = (int32_t *)malloc(sizeof(int32_t) * hcap);
+    check_mem(htab);
+    for (int i = 0; i < hcap; i++)
+        htab[i] = -1;
+    for (int id = 0; id < d->nstates; id++) {
+        if (id == d->start) continue;
+        uint32_t h = hash_ints(d->keys + d->key_off[id], d->key_len[id]) & (hcap - 1);
+        while (htab[h] >= 0) h = (h + 1) & (hcap - 1);
+        htab[h] = id;
+    }
+    free(d->htab);
+    d->htab = htab;
+    d->hcap = hcap;
+    return 0;
+error:
+    return -1;
+}
+
+/* Returns the DFA state for NFA state set key, adding it if new.  The start
+ * state is never shared since ^ holds only there. */
+int dfa_intern(struct Dfa *d, const struct Nfa *nfa, const int *key, int n, int is_start) {
+    uint32_t h = 0;
+
+    if (!is_start) {
+        h = hash_ints(key, n) & (d->hcap - 1);
+        for (; d->htab[h] >= 0; h = (h + 1) & (d->hcap - 1)) {
+            int id = d->htab[h];
+            if (d->key_len[id] == n && !memcmp(d->keys + d->key_off[id], key, sizeof(int) * n))
+                return id;
+        }
+    }
+    if (d->nstates >= d->max_states) return -1;
+
+    if (d->nstates == d->cap) {
+        int new_cap = d->cap ? d->cap * 2 : 64;
+        int32_t *trans = (int32_t *)realloc(d->trans, sizeof(int32_t) * new_cap * d->ncls);
+        check_mem(trans);
+        d->trans = trans;
+        int32_t *acc = (int32_t *)realloc(d->acc, sizeof(int32_t) * new_cap);
+        check_mem(acc);
+        d->acc = acc;
+        int32_t *eoi = (int32_t *)realloc(d->eoi, sizeof(int32_t) * new_cap);
+        check_mem(eoi);
+        d->eoi = eoi;
+        int32_t *key_off = (int32_t *)realloc(d->key_off, sizeof(int32_t) * new_cap);
+        check_mem(key_off);
+        d->key_off = key_off;
+        int32_t *key_len = (int32_t *)realloc(d->key_len, sizeof(int32_t) * new_cap);
+        check_mem(key_len);
+        d->key_len = key_len;
+        d->cap = new_cap;
+    }
+    if (d->nkeys + n > d->keycap) {
+        int new_cap = d->keycap ? d->keycap * 2 : 1024;
+        while (new_cap < d->nkeys + n) new_cap *= 2;
+        int *keys = (int *)realloc(d->keys, sizeof(int) * new_cap);
+        check_mem(keys);
+        d->keys = keys;
+        d->keycap = new_cap;
+    }
+
+    int id = d->nstates++;
+    memcpy(d->keys + d->nkeys, key, sizeof(int) * n);
+    d->key_off[id] = d->nkeys;
+    d->key_len[id] = n;
+    d->nkeys += n;
+    for (int c = 0; c < d->ncls; c++)
+        d->trans[(size_t)id * d->ncls + c] = -1;
+    if ((d->acc[id] = dfa_accept_set(d, nfa, key, n)) == -2) return -1;
 
+    /* the closure below overwrites ns.buf, which key may point into */
+    int m = nfa_closure(nfa, &d->ns, d->keys + d->key_off[id], n,
+                        CLOSURE_EOL | (is_start ? CLOSURE_BOL : 0));
+    if ((d->eoi[id] = dfa_accept_set(d, nfa, d->ns.buf, m)) == -2) return -1;
+    if (n == 0 && d->dead < 0) d->dead = id;
+
+    if (!is_start) {
+        d->htab[h] = id;
+        if (d->nstates * 2 > d->hcap && dfa_rehash(d)) return -1;
+    }
+    return id;
+error:
+    return -1;
+}
+
+/* Writes the NFA state set reached from key on byte b to d->ns.buf and
+ * returns its size.  key must not point into d->ns.buf. */
+int dfa_next_set(struct Dfa *d, const struct Nfa *nfa, const int *key, int nkey, int b) {
+    int *seeds = d->ns.buf, n = 0;
+
+    for (int i = 0; i < nkey; i++) {
+        const struct NState *s = &nfa->states[key[i]];
+        if (s->type == S_SET && cs_has(&nfa->sets[s->arg], b))
+            seeds[n++] = s->out;
+    }
+    memcpy(seeds + n, d->restart, sizeof(int) * d->nrestart);
+    n += d->nrestart;
+    /* nfa_closure pushes seeds before it writes ns.buf */
+    return nfa_closure(nfa, &d->ns, seeds, n, 0);
+}
+
+/* Computes the transition out of state id on byte class c. */
+int dfa_step(struct Dfa *d, const struct Nfa *nfa, int id, int c) {
+    int n = dfa_next_set(d, nfa, d->keys + d->key_off[id], d->key_len[id], d->rep[c]);
+    int t = dfa_intern(d, nfa, d->ns.buf, n, 0);
+    if (t >= 0) d->trans[(size_t)id * d->ncls + c] = t;
+    return t;
+}
+
+int dfa_init(struct Dfa *d, const struct Nfa *nfa) {
+    int *key = NULL, n = 0;
+
+    memset(d, 0, sizeof(*d));
+    d->dead = -1;
+    d->start = -1;
+    d->max_states = MAX_DFA_STATES;
+    d->nwords = (nfa->npat + 63) / 64;
+    dfa_byte_classes(d, nfa);
+    if (init_nfa_scratch(&d->ns, nfa)) goto error;
+    if (dfa_rehash(d)) goto error;
+    d->restart = (int *)malloc(sizeof(int) * (nfa->npat + 1));
+    d->keycap = 1024;
+    d->keys = (int *)malloc(sizeof(int) * d->keycap);
+    check_mem(d->restart && d->keys);
+
+    /* the start state enters every pattern with ^ allowed */
+    for (int i = 0; i < nfa->npat; i++)
+        if (nfa->start[i] >= 0) d->restart[n++] = nfa->start[i];
+    n = nfa_closure(nfa, &d->ns, d->restart, n, CLOSURE_BOL);
+    key = (int *)malloc(sizeof(int) * (n + 1));
+    check_mem(key);
+    memcpy(key, d->ns.buf, sizeof(int) * n);
+
+    /* later states re-enter only the patterns that can match without ^ */
+    for (int i = 0; i < nfa->npat; i++) {
+        if (nfa->start[i] < 0) continue;
+        if (nfa_closure(nfa, &d->ns, &nfa->start[i], 1, 0) > 0)
+            d->restart[d->nrestart++] = nfa->start[i];
+    }
+    d->start_key = key;
+    d->nstart_key = n;
+    key = NULL;
+    d->start = dfa_intern(d, nfa, d->start_key, n, 1);
+    if (d->start < 0) goto error;
+    return 0;
+error:
+    free(key);
+    free_dfa(d);
+    return -1;
+}
+
+/* Drops every state but the start state, keeping the allocations. */
+int dfa_flush(struct Dfa *d, const struct Nfa *nfa) {
+    d->nstates = 0;
+    d->nkeys = 0;
+    d->naccpool = 0;
+    d->dead = -1;
+    for (int i = 0; i < d->hcap; i++)
+        d->htab[i] = -1;
+    d->start = dfa_intern(d, nfa, d->start_key, d->nstart_key, 1);
+    return d->start < 0 ? -1 : 0;
+}
+
+/* Determinises the whole NFA up front. */
+int dfa_build(struct Dfa *d, const struct Nfa *nfa) {
+    if (dfa_init(d, nfa)) return -1;
+    for (int id = 0; id < d->nstates; id++) {
+        for (int c = 0; c < d->ncls; c++) {
+            if (dfa_step(d, nfa, id, c) < 0) {
+                free_dfa(d);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* ORs the set of patterns matching s[0..len) into out. */
+void dfa_match(const struct Dfa *d, const char *s, size_t len, uint64_t *out) {
+    const uint8_t *p = (const uint8_t *)s, *end = p + len;
+    int st = d->start;
+
+    if (d->acc[st] >= 0)
+        for (int w = 0; w < d->nwords; w++) out[w] |= d->accpool[d->acc[st] + w];
+    while (p < end) {
+        st = d->trans[(size_t)st * d->ncls + d->cls[*p++]];
+        if (d->acc[st] >= 0)
+            for (int w = 0; w < d->nwords; w++) out[w] |= d->accpool[d->acc[st] + w];
+        if (st == d->dead) return;
+    }
+    if (d->eoi[st] >= 0)
+        for (int w = 0; w < d->nwords; w++) out[w] |= d->accpool[d->eoi[st] + w];
+}
+
+/* dfa_match that returns at the first accepting state, for any-match. */
+void dfa_match_any(const struct Dfa *d, const char *s, size_t len, uint64_t *out) {
+    const uint8_t *p = (const uint8_t *)s, *end = p + len;
+    int st = d->start;
+
+    while (d->acc[st] < 0) {
+        if (p == end) {
+            if (d->eoi[st] >= 0)
+                for (int w = 0; w < d->nwords; w++) out[w] |= d->accpool[d->eoi[st] + w];
+            return;
+        }
+        st = d->trans[(size_t)st * d->ncls + d->cls[*p++]];
+        if (st == d->dead) return;
+    }
+    for (int w = 0; w < d->nwords; w++) out[w] |= d->accpool[d->acc[st] + w];
+}
+
+/* Lowest pattern in the accept set at pool offset off, or INT32_MAX. */
+static inline int32_t acc_lowest(const struct Dfa *d, int32_t off) {
+    if (off >= 0)
+        for (int w = 0; w < d->nwords; w++)
+            if (d->accpool[off + w]) return w * 64 + __builtin_ctzll(d->accpool[off + w]);
+    return INT32_MAX;
+}
+
+/* For each state of d, which must have every transition computed, the
+ * lowest pattern that can still accept once the state is reached, or
+ * INT32_MAX if none can. */
+int32_t *dfa_first_live(const struct Dfa *d) {
+    int32_t *live = (int32_t *)malloc(sizeof(int32_t) * (d->nstates ? d->nstates : 1));
+    int32_t *enter = (int32_t *)malloc(sizeof(int32_t) * (d->nstates ? d->nstates : 1));
+    int changed = 1;
+
+    check_mem(live && enter);
+    for (int st = 0; st < d->nstates; st++) {
+        enter[st] = acc_lowest(d, d->acc[st]);
+        /* dfa_match stops at the dead state without looking at eoi */
+        live[st] = st != d->dead ? acc_lowest(d, d->eoi[st]) : INT32_MAX;
+    }
+    /* states are numbered in discovery order, so successors mostly come
+     * later and a backwards sweep settles most of them at once */
+    while (changed) {
+        changed = 0;
+        for (int st = d->nstates - 1; st >= 0; st--) {
+            if (st == d->dead) continue;
+            const int32_t *row = d->trans + (size_t)st * d->ncls;
+            int32_t v = live[st];
+            for (int c = 0; c < d->ncls; c++) {
+                if (enter[row[c]] < v) v = enter[row[c]];
+                if (live[row[c]] < v) v = live[row[c]];
+            }
+            if (v < live[st]) {
+                live[st] = v;
+                changed = 1;
+            }
+        }
+    }
+    free(enter);
+    return live;
 error:
-    if (regexs) {
-        for(int i = 0; i < regcomp_cnt; i++)
-            regfree(&regexs[i]);
-        free(regexs);
+    free(live);
+    free(enter);
+    return NULL;
+}
+
+/* dfa_match for first-match mode: sets only the lowest matching pattern in
+ * out, and returns as soon as live, from dfa_first_live, says no pattern
+ * below the lowest one found can still accept. */
+void dfa_match_first(const struct Dfa *d, const int32_t *live, const char *s, size_t len,
+                     uint64_t *out) {
+    const uint8_t *p = (const uint8_t *)s, *end = p + len;
+    int st = d->start;
+    int32_t first = acc_lowest(d, d->acc[st]);
+
+    while (first > live[st]) {
+        if (p == end) {
+            int32_t a = acc_lowest(d, d->eoi[st]);
+            if (a < first) first = a;
+            break;
+        }
+        st = d->trans[(size_t)st * d->ncls + d->cls[*p++]];
+        int32_t a = acc_lowest(d, d->acc[st]);
+        if (a < first) first = a;
+    }
+    if (first != INT32_MAX) bit_set(out, first);
+}
+
+/* DFA compiler to x86-64 ---------------------------------------------------
+ *
+ * Turns a complete combined DFA into machine code, one block per state: the
+ * block ORs the state's accept set into the result, then reads the next
+ * byte and jumps to the next state's block.  A state whose transitions fall
+ * into a few byte ranges compares and jumps; one with more indexes a jump
+ * table by byte class.  Code is built in memory, copied to a fresh mapping
+ * and made executable.  Where it cannot be built dfa_match is used.
+ */
+
+#define JIT_MAX_RANGES 6        /* byte ranges a state compares before using a table */
+#define JIT_MAX_CODE (64 << 20)
+#define JIT_CLS_SIZE 256        /* the byte class table leads the code */
+
+/* Called as fn(s, s + len, out, stop); ORs matches into out like
+ * dfa_match, or with stop set returns at the first accepting state like
+ * dfa_match_any. */
+typedef void (*jit_fn)(const uint8_t *p, const uint8_t *end, uint64_t *out, int stop);
+
+struct DfaJit {
+    jit_fn fn;                  /* NULL if not built */
+    void *code;
+    size_t size;
+};
+
+struct JitFixup {
+    size_t at;                  /* int32 to patch */
+    size_t base;                /* it holds the target's offset minus base */
+    int state;
+};
+
+struct JitBuf {
+    uint8_t *buf;
+    size_t len, cap;
+    size_t *state_at;           /* offset of each state's block */
+    struct JitFixup *fix;
+    int nfix, fixcap;
+    int failed;
+};
+
+void free_jit(struct DfaJit *jt) {
+    if (jt->code) munmap(jt->code, jt->size);
+    memset(jt, 0, sizeof(*jt));
+}
+
+static void jit_bytes(struct JitBuf *j, const void *p, size_t n) {
+    if (j->failed) return;
+    if (j->len + n > j->cap) {
+        size_t cap = j->cap ? j->cap * 2 : 4096;
+        while (cap < j->len + n) cap *= 2;
+        uint8_t *buf = cap <= JIT_MAX_CODE ? (uint8_t *)realloc(j->buf, cap) : NULL;
+        if (!buf) {
+            j->failed = 1;
+            return;
+        }
+        j->buf = buf;
+        j->cap = cap;
     }
-    if (patterns) free_lines(patterns, p_size);
-    if (test_lines) free_lines(test_lines, t_size);
-    if (tests) free_test_cases(tests, t_size);
+    memcpy(j->buf + j->len, p, n);
+    j->len += n;
+}
+
+static void jit_u32(struct JitBuf *j, uint32_t v) {
+    jit_bytes(j, &v, sizeof(v));
+}
+
+/* A placeholder int32 that will hold state's offset minus base. */
+static void jit_ref(struct JitBuf *j, int state, size_t base) {
+    if (j->nfix == j->fixcap) {
+        int cap = j->fixcap ? j->fixcap * 2 : 256;
+        struct JitFixup *fix = (struct JitFixup *)realloc(j->fix, sizeof(struct JitFixup) * cap);
+        if (!fix) {
+            j->failed = 1;
+            return;
+        }
+        j->fix = fix;
+        j->fixcap = cap;
+    }
+    j->fix[j->nfix].at = j->len;
+    j->fix[j->nfix].base = base;
+    j->fix[j->nfix].state = state;
+    j->nfix++;
+    jit_u32(j, 0);
+}
+
+/* op followed by a rel32 to state's block. */
+static void jit_jump(struct JitBuf *j, const char *op, size_t oplen, int state) {
+    jit_bytes(j, op, oplen);
+    jit_ref(j, state, j->len + 4);
+}
+
+/* or [rdx + 8 * w], rax for each word of the accept set at pool offset off. */
+static void jit_accept(struct JitBuf *j, const struct Dfa *d, int32_t off) {
+    for (int w = 0; w < d->nwords; w++) {
+        uint64_t bits = d->accpool[off + w];
+        if (!bits) continue;
+        jit_bytes(j, "\x48\xb8", 2);            /* mov rax, imm64 */
+        jit_bytes(j, &bits, sizeof(bits));
+        jit_bytes(j, "\x48\x09\x82", 3);        /* or [rdx + disp32], rax */
+        jit_u32(j, w * 8);
+    }
+}
+
+/* Branches on the byte in eax to the next state of st. */
+static void jit_dispatch(struct JitBuf *j, const struct Dfa *d, int st) {
+    const int32_t *row = d->trans + (size_t)st * d->ncls;
+    int lo[256], hi[256], to[256], nruns = 0, dflt = -1, best = 0;
+
+    for (int b = 0; b < 256; b++) {
+        int t = row[d->cls[b]];
+        if (nruns && to[nruns - 1] == t) {
+            hi[nruns - 1] = b;
+            continue;
+        }
+        lo[nruns] = hi[nruns] = b;
+        to[nruns++] = t;
+    }
+    /* the target covering the most bytes is the fallthrough */
+    for (int r = 0; r < nruns; r++) {
+        int bytes = 0;
+        for (int k = 0; k < nruns; k++)
+            if (to[k] == to[r]) bytes += hi[k] - lo[k] + 1;
+        if (bytes > best) {
+            best = bytes;
+            dflt = to[r];
+        }
+    }
+
+    int ranges = 0;
+    for (int r = 0; r < nruns; r++)
+        ranges += to[r] != dflt;
+    if (ranges <= JIT_MAX_RANGES) {
+        for (int r = 0; r < nruns; r++) {
+            if (to[r] == dflt) continue;
+            if (lo[r] == hi[r]) {
+                uint8_t cmp[2] = {0x3c, (uint8_t)lo[r]};     /* cmp al, imm8 */
+                jit_bytes(j, cmp, 2);
+                jit_jump(j, "\x0f\x84", 2, to[r]);          /* je */
+            } else {
+                jit_bytes(j, "\x89\xc1\x81\xe9", 4);        /* mov ecx, eax; sub ecx, imm32 */
+                jit_u32(j, lo[r]);
+                jit_bytes(j, "\x81\xf9", 2);                /* cmp ecx, imm32 */
+                jit_u32(j, hi[r] - lo[r]);
+                jit_jump(j, "\x0f\x86", 2, to[r]);          /* jbe */
+            }
+        }
+        jit_jump(j, "\xe9", 1, dflt);                       /* jmp */
+        return;
+    }
+
+    jit_bytes(j, "\x48\x8d\x0d", 3);            /* lea rcx, [rip + class table] */
+    jit_u32(j, (uint32_t)(0 - (j->len + 4)));
+    jit_bytes(j, "\x0f\xb6\x04\x01", 4);        /* movzx eax, byte [rcx + rax] */
+    jit_bytes(j, "\x48\x8d\x0d", 3);            /* lea rcx, [rip + jump table] */
+    jit_u32(j, 9);
+    jit_bytes(j, "\x48\x63\x04\x81", 4);        /* movsxd rax, dword [rcx + rax * 4] */
+    jit_bytes(j, "\x48\x01\xc8", 3);            /* add rax, rcx */
+    jit_bytes(j, "\xff\xe0", 2);                /* jmp rax */
+    size_t table = j->len;
+    for (int c = 0; c < d->ncls; c++)
+        jit_ref(j, row[c], table);
+}
+
+/* Compiles d, which must have every transition computed; 0 on success. */
+int jit_dfa(struct DfaJit *jt, const struct Dfa *d) {
+    memset(jt, 0, sizeof(*jt));
+#ifdef __x86_64__
+    struct JitBuf j = {0};
+    void *code = MAP_FAILED;
+
+    for (size_t i = 0; i < (size_t)d->nstates * d->ncls; i++)
+        if (d->trans[i] < 0) return -1;
+    j.state_at = (size_t *)malloc(sizeof(size_t) * (d->nstates ? d->nstates : 1));
+    if (!j.state_at) return -1;
+
+    jit_bytes(&j, d->cls, JIT_CLS_SIZE);
+    jit_bytes(&j, "\x49\x89\xc8", 3);           /* entry: mov r8, rcx */
+    jit_jump(&j, "\xe9", 1, d->start);
+    for (int st = 0; st < d->nstates; st++) {
+        j.state_at[st] = j.len;
+        if (d->acc[st] >= 0) {
+            jit_accept(&j, d, d->acc[st]);
+            jit_bytes(&j, "\x45\x85\xc0\x74\x01\xc3", 6);   /* test r8d, r8d; jz +1; ret */
+        }
+        if (st == d->dead) {
+            jit_bytes(&j, "\xc3", 1);           /* ret */
+            continue;
+        }
+        jit_bytes(&j, "\x48\x39\xf7", 3);       /* cmp rdi, rsi */
+        jit_bytes(&j, "\x0f\x83", 2);           /* jae end of input */
+        size_t eoi = j.len;
+        jit_u32(&j, 0);
+        jit_bytes(&j, "\x0f\xb6\x07", 3);       /* movzx eax, byte [rdi] */
+        jit_bytes(&j, "\x48\xff\xc7", 3);       /* inc rdi */
+        jit_dispatch(&j, d, st);
+        if (j.failed) break;
+        uint32_t rel = j.len - (eoi + 4);
+        memcpy(j.buf + eoi, &rel, sizeof(rel));
+        if (d->eoi[st] >= 0) jit_accept(&j, d, d->eoi[st]);
+        jit_bytes(&j, "\xc3", 1);               /* ret */
+    }
+    if (j.failed) goto error;
+    for (int k = 0; k < j.nfix; k++) {
+        uint32_t rel = (uint32_t)(j.state_at[j.fix[k].state] - j.fix[k].base);
+        memcpy(j.buf + j.fix[k].at, &rel, sizeof(rel));
+    }
+
+    code = mmap(NULL, j.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) goto error;
+    memcpy(code, j.buf, j.len);
+    if (mprotect(code, j.len, PROT_READ | PROT_EXEC)) goto error;
+    jt->code = code;
+    jt->size = j.len;
+    jt->fn = (jit_fn)(void *)((uint8_t *)code + JIT_CLS_SIZE);
+    free(j.buf);
+    free(j.state_at);
+    free(j.fix);
+    return 0;
+
+error:
+    if (code != MAP_FAILED) munmap(code, j.len);
+    free(j.buf);
+    free(j.state_at);
+    free(j.fix);
+    return -1;
+#else
+    (void)d;
+    return -1;
+#endif
+}
+
+/* Lazy DFA ------------------------------------------------------------------
+ *
+ * Builds DFA states on demand while scanning and keeps at most max_states of
+ * them.  When the cache is full it is flushed and rebuilt from the current
+ * state; if a single search keeps flushing without making progress the rest
+ * of it runs as a plain NFA simulation instead.
+ */
+
+#define DEFAULT_CACHE_STATES 1024
+
+struct LazyDfa {
+    struct Dfa d;
+    const struct Nfa *nfa;
+    int *cur;               /* NFA state set carried across a flush */
+    uint64_t hits, misses, flushes, nfa_searches;
+};
+
+void free_lazy_dfa(struct LazyDfa *lz) {
+    free_dfa(&lz->d);
+    free(lz->cur);
+    memset(lz, 0, sizeof(*lz));
+}
+
+int init_lazy_dfa(struct LazyDfa *lz, const struct Nfa *nfa, int max_states) {
+    memset(lz, 0, sizeof(*lz));
+    if (dfa_init(&lz->d, nfa)) return -1;
+    lz->nfa = nfa;
+    lz->d.max_states = max_states < 4 ? 4 : max_states;
+    lz->cur = (int *)malloc(sizeof(int) * (nfa->n + nfa->npat + 1));
+    check_mem(lz->cur);
+    return 0;
+error:
+    free_lazy_dfa(lz);
+    return -1;
+}
+
+static inline void or_accepts(const struct Dfa *d, int off, uint64_t *out) {
+    if (off >= 0)
+        for (int w = 0; w < d->nwords; w++) out[w] |= d->accpool[off + w];
+}
+
+/* Continues a search over [p, end) from NFA state set lz->cur[0..n)
+ * without building DFA states; with stop, only until something matches. */
+void lazy_simulate(struct LazyDfa *lz, int n, const uint8_t *p, const uint8_t *end, int stop,
+                   uint64_t *out) {
+    struct Dfa *d = &lz->d;
+    const struct Nfa *nfa = lz->nfa;
+
+    lz->nfa_searches++;
+    for (; p < end; p++) {
+        int found = 0;
+        n = dfa_next_set(d, nfa, lz->cur, n, *p);
+        memcpy(lz->cur, d->ns.buf, sizeof(int) * n);
+        for (int i = 0; i < n; i++)
+            if (nfa->states[lz->cur[i]].type == S_MATCH) {
+                bit_set(out, nfa->states[lz->cur[i]].arg);
+                found = 1;
+            }
+        if (found && stop) return;
+    }
+    n = nfa_closure(nfa, &d->ns, lz->cur, n, CLOSURE_EOL);
+    for (int i = 0; i < n; i++)
+        if (nfa->states[d->ns.buf[i]].type == S_MATCH) bit_set(out, nfa->states[d->ns.buf[i]].arg);
+}
+
+/* Flushes the cache and returns the state for lz->cur[0..n), or -1. */
+int lazy_flush(struct LazyDfa *lz, int n, int was_start) {
+    lz->flushes++;
+    if (dfa_flush(&lz->d, lz->nfa)) return -1;
+    return was_start ? lz->d.start : dfa_intern(&lz->d, lz->nfa, lz->cur, n, 0);
+}
+
+/* ORs the set of patterns matching s[0..len) into out; with stop, only
+ * those accepting at the first accepting state, like dfa_match_any. */
+void lazy_match(struct LazyDfa *lz, const char *s, size_t len, int stop, uint64_t *out) {
+    struct Dfa *d = &lz->d;
+    const uint8_t *p = (const uint8_t *)s, *end = p + len;
+    int st = d->start, flushes = 0;
+    size_t since_flush = 0;
+
+    or_accepts(d, d->acc[st], out);
+    if (stop && d->acc[st] >= 0) return;
+    while (p < end) {
+        int c = d->cls[*p];
+        int t = d->trans[(size_t)st * d->ncls + c];
+        if (t >= 0) {
+            lz->hits++;
+        } else {
+            lz->misses++;
+            t = dfa_step(d, lz->nfa, st, c);
+            if (t < 0) {
+                int n = d->key_len[st];
+                memcpy(lz->cur, d->keys + d->key_off[st], sizeof(int) * n);
+                /* thrashing: under 10 bytes scanned per cached state */
+                if (++flushes > 2 && since_flush < 10 * (size_t)d->max_states) {
+                    lazy_simulate(lz, n, p, end, stop, out);
+                    return;
+                }
+                since_flush = 0;
+                if ((st = lazy_flush(lz, n, st == d->start)) < 0 ||
+                    (t = dfa_step(d, lz->nfa, st, c)) < 0) {
+                    lazy_simulate(lz, n, p, end, stop, out);
+                    return;
+                }
+            }
+        }
+        st = t;
+        p++;
+        since_flush++;
+        or_accepts(d, d->acc[st], out);
+        if (st == d->dead || (stop && d->acc[st] >= 0)) return;
+    }
+    or_accepts(d, d->eoi[st], out);
+}
+
+/* Literal prefix trie ------------------------------------------------------
+ *
+ * Most rules are ^-anchored and open with a literal run.  The trie maps
+ * those prefixes to patterns, so one walk over the head of a name yields
+ * the only patterns worth handing to a per-pattern engine.
+ */
+
+#define MAX_PREFIX 256
+
+/* Returns the only byte in cs, or -1. */
+int cs_single(const struct CharSet *cs) {
+    int c = -1;
+    for (int i = 0; i < 4; i++) {
+        if (!cs->w[i]) continue;
+        if (c >= 0 || (cs->w[i] & (cs->w[i] - 1))) return -1;
+        c = i * 64 + __builtin_ctzll(cs->w[i]);
+    }
+    return c;
+}
+
+/* Appends the literal run that node idx forces at the start of the subject.
+ * Returns 1 if the run may continue past the node. */
+int prefix_walk(const struct Ast *ast, int idx, char *buf, int *len, int *anchored) {
+    const struct Node *nd = &ast->nodes[idx];
+    int c;
+
+    switch (nd->type) {
+    case N_EMPTY:
+        return 1;
+    case N_CAT:
+        return prefix_walk(ast, nd->left, buf, len, anchored) &&
+               prefix_walk(ast, nd->right, buf, len, anchored);
+    case N_GROUP:
+        return prefix_walk(ast, nd->left, buf, len, anchored);
+    case N_BOL:
+        if (*len > 0) return 0;
+        *anchored = 1;
+        return 1;
+    case N_SET:
+        if (!*anchored || *len >= MAX_PREFIX || (c = cs_single(&nd->set)) < 0) return 0;
+        buf[(*len)++] = c;
+        return 1;
+    case N_REPEAT:
+        if (!*anchored || ast->nodes[nd->left].type != N_SET) return 0;
+        if ((c = cs_single(&ast->nodes[nd->left].set)) < 0) return 0;
+        for (int i = 0; i < nd->min && *len < MAX_PREFIX; i++)
+            buf[(*len)++] = c;
+        return nd->min == nd->max;
+    }
+    return 0;
+}
+
+/* Writes the literal prefix every match of a ^-anchored pattern starts with
+ * to buf (MAX_PREFIX bytes) and returns its length, 0 if there is none. */
+int ast_literal_prefix(const struct Ast *ast, char *buf) {
+    int len = 0, anchored = 0;
+    if (ast->root < 0) return 0;
+    prefix_walk(ast, ast->root, buf, &len, &anchored);
+    return anchored ? len : 0;
+}
+
+struct PrefixTrie {
+    int nnodes, cap;
+    int32_t *child;         /* first child, -1 if none */
+    int32_t *sibling;       /* next child of the same parent */
+    uint8_t *byte;          /* label of the edge into the node */
+    int32_t *term;          /* first pattern whose prefix ends here, -1 */
+    int32_t *term_next;     /* per pattern: next pattern ending at the same node */
+    uint64_t *always;       /* patterns without a prefix are always candidates */
+    int nwords;
+};
+
+void free_trie(struct PrefixTrie *t) {
+    free(t->child);
+    free(t->sibling);
+    free(t->byte);
+    free(t->term);
+    free(t->term_next);
+    free(t->always);
+    memset(t, 0, sizeof(*t));
+}
+
+int trie_node(struct PrefixTrie *t, int parent, int c) {
+    if (t->nnodes == t->cap) {
+        int new_cap = t->cap ? t->cap * 2 : 64;
+        int32_t *child = (int32_t *)realloc(t->child, sizeof(int32_t) * new_cap);
+        check_mem(child);
+        t->child = child;
+        int32_t *sibling = (int32_t *)realloc(t->sibling, sizeof(int32_t) * new_cap);
+        check_mem(sibling);
+        t->sibling = sibling;
+        uint8_t *byte = (uint8_t *)realloc(t->byte, new_cap);
+        check_mem(byte);
+        t->byte = byte;
+        int32_t *term = (int32_t *)realloc(t->term, sizeof(int32_t) * new_cap);
+        check_mem(term);
+        t->term = term;
+        t->cap = new_cap;
+    }
+    int id = t->nnodes++;
+    t->child[id] = -1;
+    t->term[id] = -1;
+    t->byte[id] = c;
+    if (parent >= 0) {
+        t->sibling[id] = t->child[parent];
+        t->child[parent] = id;
+    } else {
+        t->sibling[id] = -1;
+    }
+    return id;
+error:
+    return -1;
+}
+
+static inline int trie_child(const struct PrefixTrie *t, int node, int c) {
+    for (int k = t->child[node]; k >= 0; k = t->sibling[k])
+        if (t->byte[k] == c) return k;
+    return -1;
+}
+
+int trie_insert(struct PrefixTrie *t, const char *s, int len, int pat) {
+    int node = 0;
+    for (int i = 0; i < len; i++) {
+        int next = trie_child(t, node, (unsigned char)s[i]);
+        if (next < 0 && (next = trie_node(t, node, (unsigned char)s[i])) < 0) return -1;
+        node = next;
+    }
+    t->term_next[pat] = t->term[node];
+    t->term[node] = pat;
+    return 0;
+}
+
+int trie_init(struct PrefixTrie *t, int npat) {
+    memset(t, 0, sizeof(*t));
+    t->nwords = (npat + 63) / 64;
+    t->term_next = (int32_t *)malloc(sizeof(int32_t) * (npat ? npat : 1));
+    t->always = (uint64_t *)calloc(t->nwords ? t->nwords : 1, sizeof(uint64_t));
+    check_mem(t->term_next && t->always);
+    if (trie_node(t, -1, 0) < 0) goto error;
+    return 0;
+error:
+    free_trie(t);
+    return -1;
+}
+
+/* Writes the patterns whose prefix s carries, plus those without one. */
+void trie_candidates(const struct PrefixTrie *t, const char *s, size_t len, uint64_t *cand) {
+    int node = 0;
+
+    memcpy(cand, t->always, sizeof(uint64_t) * t->nwords);
+    for (size_t i = 0; i < len; i++) {
+        if ((node = trie_child(t, node, (unsigned char)s[i])) < 0) return;
+        for (int p = t->term[node]; p >= 0; p = t->term_next[p])
+            bit_set(cand, p);
+    }
+}
+
+/* Literal search kernels -----------------------------------------------------
+ *
+ * Substring search and Teddy multi-literal search, each with a scalar
+ * version and SSSE3/AVX2 versions chosen at run time from what the CPU
+ * has (or -k).  Substring search compares the first and last byte of the
+ * needle at 16 or 32 positions at once and only memcmps where both hit.
+ * Teddy packs up to 8 buckets of literals into byte masks indexed by the
+ * low and high nibble of the first few bytes; pshufb looks up a whole
+ * vector of positions, and only positions whose masks still have a bucket
+ * bit set are compared against that bucket's literals.
+ */
+
+#define TEDDY_MAX_LITS 64       /* beyond this the buckets get too crowded */
+#define TEDDY_MAX_MASKS 3       /* bytes fingerprinted per position */
+
+enum SimdLevel { SIMD_SCALAR, SIMD_SSSE3, SIMD_AVX2, SIMD_COUNT };
+const char *simd_names[] = { "scalar", "ssse3", "avx2" };
+int simd_level = SIMD_SCALAR;
+
+int simd_supported(int level) {
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (level == SIMD_SSSE3) return __builtin_cpu_supports("ssse3");
+    if (level == SIMD_AVX2) return __builtin_cpu_supports("avx2");
+#endif
+    return level == SIMD_SCALAR;
+}
+
+/* Sets simd_level to the named level, or the best one with name NULL. */
+int simd_select(const char *name) {
+    for (int l = SIMD_COUNT - 1; l >= 0; l--) {
+        if (name && strcmp(name, simd_names[l])) continue;
+        if (!simd_supported(l)) break;
+        simd_level = l;
+        return 0;
+    }
+    return -1;
+}
+
+/* Offset of the first lit[0..m) in s[0..n), or -1. */
+long lit_find_scalar(const char *s, size_t n, const char *lit, size_t m) {
+    const char *p = s, *end;
+
+    if (m == 0) return 0;
+    if (m > n) return -1;
+    end = s + n - m + 1;
+    while ((p = (const char *)memchr(p, lit[0], end - p)) != NULL) {
+        if (!memcmp(p + 1, lit + 1, m - 1)) return p - s;
+        p++;
+    }
+    return -1;
+}
+
+#ifdef SIMD_X86
+__attribute__((target("ssse3")))
+long lit_find_ssse3(const char *s, size_t n, const char *lit, size_t m) {
+    size_t i = 0;
+    long r;
+
+    if (m < 2) return lit_find_scalar(s, n, lit, m);
+    const __m128i first = _mm_set1_epi8(lit[0]), last = _mm_set1_epi8(lit[m - 1]);
+    for (; i + m + 15 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+        for (; mask; mask &= mask - 1) {
+            size_t j = i + __builtin_ctz(mask);
+            if (!memcmp(s + j + 1, lit + 1, m - 2)) return j;
+        }
+    }
+    r = lit_find_scalar(s + i, n - i, lit, m);
+    return r < 0 ? -1 : (long)i + r;
+}
+
+__attribute__((target("avx2")))
+long lit_find_avx2(const char *s, size_t n, const char *lit, size_t m) {
+    size_t i = 0;
+    long r;
+
+    if (m < 2) return lit_find_scalar(s, n, lit, m);
+    const __m256i first = _mm256_set1_epi8(lit[0]), last = _mm256_set1_epi8(lit[m - 1]);
+    for (; i + m + 31 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + i + m - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                              _mm256_cmpeq_epi8(b, last)));
+        for (; mask; mask &= mask - 1) {
+            size_t j = i + __builtin_ctz(mask);
+            if (!memcmp(s + j + 1, lit + 1, m - 2)) return j;
+        }
+    }
+    r = lit_find_ssse3(s + i, n - i, lit, m);
+    return r < 0 ? -1 : (long)i + r;
+}
+#endif
+
+long lit_find(const char *s, size_t n, const char *lit, size_t m) {
+#ifdef SIMD_X86
+    if (simd_level == SIMD_AVX2) return lit_find_avx2(s, n, lit, m);
+    if (simd_level == SIMD_SSSE3) return lit_find_ssse3(s, n, lit, m);
+#endif
+    return lit_find_scalar(s, n, lit, m);
+}
+
+/* Nibble masks and buckets over at most TEDDY_MAX_LITS literals, which
+ * stay owned by the caller. */
+struct Teddy {
+    int nlits;
+    int nmasks;             /* leading bytes fingerprinted, the shortest literal at most */
+    uint8_t lo[TEDDY_MAX_MASKS][16] __attribute__((aligned(16)));
+    uint8_t hi[TEDDY_MAX_MASKS][16] __attribute__((aligned(16)));
+    int bucket_off[9];      /* literals of bucket b: bucket_lits[bucket_off[b]..bucket_off[b + 1]) */
+    int bucket_lits[TEDDY_MAX_LITS];
+    const char *const *lit;
+    const int *len;
+};
+
+/* Reports literal l found in the scanned string. */
+typedef void (*teddy_hit_fn)(void *ctx, int l);
+
+/* Literals sharing a fingerprint go to the same bucket, so a position
+ * that hits one bucket has few literals to compare.  Returns -1 if the
+ * set does not fit. */
+int teddy_build(struct Teddy *t, const char *const *lit, const int *len, int n) {
+    int order[TEDDY_MAX_LITS];
+
+    memset(t, 0, sizeof(*t));
+    if (n < 1 || n > TEDDY_MAX_LITS) return -1;
+    t->nlits = n;
+    t->lit = lit;
+    t->len = len;
+    t->nmasks = TEDDY_MAX_MASKS;
+    for (int l = 0; l < n; l++) {
+        if (len[l] < 1) return -1;
+        if (len[l] < t->nmasks) t->nmasks = len[l];
+        order[l] = l;
+    }
+    for (int r = 1; r < n; r++) {
+        int l = order[r], q = r;
+        for (; q > 0 && memcmp(lit[order[q - 1]], lit[l], t->nmasks) > 0; q--)
+            order[q] = order[q - 1];
+        order[q] = l;
+    }
+    for (int r = 0; r < n; r++) {
+        int l = order[r], b = r * 8 / n;
+        t->bucket_off[b + 1]++;
+        t->bucket_lits[r] = l;
+        for (int k = 0; k < t->nmasks; k++) {
+            unsigned char c = (unsigned char)lit[l][k];
+            t->lo[k][c & 15] |= 1 << b;
+            t->hi[k][c >> 4] |= 1 << b;
+        }
+    }
+    for (int b = 0; b < 8; b++)
+        t->bucket_off[b + 1] += t->bucket_off[b];
+    return 0;
+}
+
+void teddy_verify(const struct Teddy *t, const char *s, size_t n, size_t i,
+                  unsigned buckets, teddy_hit_fn hit, void *ctx) {
+    for (; buckets; buckets &= buckets - 1) {
+        int b = __builtin_ctz(buckets);
+        for (int k = t->bucket_off[b]; k < t->bucket_off[b + 1]; k++) {
+            int l = t->bucket_lits[k];
+            if (i + t->len[l] <= n && !memcmp(s + i, t->lit[l], t->len[l])) hit(ctx, l);
+        }
+    }
+}
+
+void teddy_scan_scalar(const struct Teddy *t, const char *s, size_t n,
+                       teddy_hit_fn hit, void *ctx) {
+    for (size_t i = 0; i + t->nmasks <= n; i++) {
+        unsigned buckets = 0xff;
+        for (int k = 0; k < t->nmasks && buckets; k++) {
+            unsigned char c = (unsigned char)s[i + k];
+            buckets &= t->lo[k][c & 15] & t->hi[k][c >> 4];
+        }
+        if (buckets) teddy_verify(t, s, n, i, buckets, hit, ctx);
+    }
+}
+
+#ifdef SIMD_X86
+/* The last block is copied out zero-padded so every load is whole;
+ * verify still reads the name itself, and bounds-checks the literal. */
+__attribute__((target("ssse3")))
+void teddy_scan_ssse3(const struct Teddy *t, const char *s, size_t n,
+                      teddy_hit_fn hit, void *ctx) {
+    const __m128i nib = _mm_set1_epi8(0x0f), zero = _mm_setzero_si128();
+    uint8_t res[16] __attribute__((aligned(16)));
+    char pad[16 + TEDDY_MAX_MASKS + 16];
+
+    for (size_t i = 0; i < n; i += 16) {
+        const char *p = s + i;
+        unsigned valid = 0xffff;
+        if (i + 15 + t->nmasks > n) {
+            memset(pad, 0, sizeof(pad));
+            memcpy(pad, p, n - i);
+            p = pad;
+            if (n - i < 16) valid = (1u << (n - i)) - 1;
+        }
+        __m128i acc = _mm_set1_epi8((char)0xff);
+        for (int k = 0; k < t->nmasks; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + k));
+            __m128i lo = _mm_shuffle_epi8(_mm_load_si128((const __m128i *)t->lo[k]),
+                                          _mm_and_si128(v, nib));
+            __m128i hi = _mm_shuffle_epi8(_mm_load_si128((const __m128i *)t->hi[k]),
+                                          _mm_and_si128(_mm_srli_epi16(v, 4), nib));
+            acc = _mm_and_si128(acc, _mm_and_si128(lo, hi));
+        }
+        unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) & valid;
+        if (!mask) continue;
+        _mm_store_si128((__m128i *)res, acc);
+        for (; mask; mask &= mask - 1) {
+            int j = __builtin_ctz(mask);
+            teddy_verify(t, s, n, i + j, res[j], hit, ctx);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+void teddy_scan_avx2(const struct Teddy *t, const char *s, size_t n,
+                     teddy_hit_fn hit, void *ctx) {
+    const __m256i nib = _mm256_set1_epi8(0x0f), zero = _mm256_setzero_si256();
+    uint8_t res[32] __attribute__((aligned(32)));
+    char pad[32 + TEDDY_MAX_MASKS + 32];
+    __m256i lom[TEDDY_MAX_MASKS], him[TEDDY_MAX_MASKS];
+
+    /* pshufb looks up within each 128-bit lane, so both lanes get the table */
+    for (int k = 0; k < t->nmasks; k++) {
+        lom[k] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)t->lo[k]));
+        him[k] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)t->hi[k]));
+    }
+    for (size_t i = 0; i < n; i += 32) {
+        const char *p = s + i;
+        unsigned valid = 0xffffffff;
+        if (i + 31 + t->nmasks > n) {
+            memset(pad, 0, sizeof(pad));
+            memcpy(pad, p, n - i);
+            p = pad;
+            if (n - i < 32) valid = (1u << (n - i)) - 1;
+        }
+        __m256i acc = _mm256_set1_epi8((char)0xff);
+        for (int k = 0; k < t->nmasks; k++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + k));
+            __m256i lo = _mm256_shuffle_epi8(lom[k], _mm256_and_si256(v, nib));
+            __m256i hi = _mm256_shuffle_epi8(him[k], _mm256_and_si256(_mm256_srli_epi16(v, 4), nib));
+            acc = _mm256_and_si256(acc, _mm256_and_si256(lo, hi));
+        }
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(acc, zero)) & valid;
+        if (!mask) continue;
+        _mm256_store_si256((__m256i *)res, acc);
+        for (; mask; mask &= mask - 1) {
+            int j = __builtin_ctz(mask);
+            teddy_verify(t, s, n, i + j, res[j], hit, ctx);
+        }
+    }
+}
+#endif
+
+/* Calls hit for every occurrence of every literal in s[0..n), in order of
+ * start position; one literal may be reported several times. */
+void teddy_scan(const struct Teddy *t, const char *s, size_t n, teddy_hit_fn hit, void *ctx) {
+#ifdef SIMD_X86
+    if (simd_level == SIMD_AVX2) {
+        teddy_scan_avx2(t, s, n, hit, ctx);
+        return;
+    }
+    if (simd_level == SIMD_SSSE3) {
+        teddy_scan_ssse3(t, s, n, hit, ctx);
+        return;
+    }
+#endif
+    teddy_scan_scalar(t, s, n, hit, ctx);
+}
+
+/* Required literals ----------------------------------------------------------
+ *
+ * Most rules also force literals inside the name, like ".services." and
+ * ".perfdata." after a ".*".  Each pattern gets a conjunction of clauses,
+ * each clause a literal or an alternation of literals, and one
+ * Aho-Corasick automaton over every literal finds them all in a single
+ * pass.  Only patterns whose clauses were all seen go on to their own
+ * engine, so a name no rule can match costs one scan.
+ */
+
+#define MAX_REQ_LEN 64          /* longer runs are cut; a piece is still required */
+#define MIN_REQ_LEN 2           /* shorter literals are in nearly every name */
+#define MAX_REQ_CLAUSES 8       /* per pattern, best first */
+#define MAX_REQ_ALTS 16         /* literals in one clause */
+#define REQ_FIND_LITS 2         /* up to this many, search for each directly */
+
+struct ReqClause {
+    int n;
+    int minlen;
+    char lit[MAX_REQ_ALTS][MAX_REQ_LEN];
+    int len[MAX_REQ_ALTS];
+};
+
+struct ReqWalk {
+    struct ReqClause *clauses;
+    int n, cap;
+    char run[MAX_REQ_LEN];
+    int runlen;
+};
+
+int req_push(struct ReqWalk *w, const struct ReqClause *c) {
+    if (w->n == w->cap) {
+        int new_cap = w->cap ? w->cap * 2 : 8;
+        struct ReqClause *tmp = (struct ReqClause *)realloc(w->clauses, sizeof(struct ReqClause) * new_cap);
+        check_mem(tmp);
+        w->clauses = tmp;
+        w->cap = new_cap;
+    }
+    w->clauses[w->n++] = *c;
+    return 0;
+error:
+    return -1;
+}
+
+/* Ends the current literal run, keeping it if it is long enough. */
+int req_flush(struct ReqWalk *w) {
+    struct ReqClause c;
+    int len = w->runlen;
+
+    w->runlen = 0;
+    if (len < MIN_REQ_LEN) return 0;
+    c.n = 1;
+    c.minlen = c.len[0] = len;
+    memcpy(c.lit[0], w->run, len);
+    return req_push(w, &c);
+}
+
+int req_append(struct ReqWalk *w, int c) {
+    if (w->runlen == MAX_REQ_LEN && req_flush(w)) return -1;
+    w->run[w->runlen++] = c;
+    return 0;
+}
+
+int req_walk(const struct Ast *ast, int idx, struct ReqWalk *w);
+
+/* An alternation requires one of its branches' best literals, if every
+ * branch has one. */
+int req_alt(const struct Ast *ast, int idx, struct ReqWalk *w) {
+    int stack[MAX_REQ_ALTS + 1], sp = 0, nb = 0, branches[MAX_REQ_ALTS];
+    struct ReqClause c = {0, MAX_REQ_LEN, {{0}}, {0}};
+
+    stack[sp++] = idx;
+    while (sp > 0) {
+        const struct Node *nd = &ast->nodes[stack[--sp]];
+        if (nd->type == N_ALT) {
+            if (sp + 2 > MAX_REQ_ALTS + 1) return 0;
+            stack[sp++] = nd->right;
+            stack[sp++] = nd->left;
+        } else {
+            if (nb == MAX_REQ_ALTS) return 0;
+            branches[nb++] = stack[sp];
+        }
+    }
+    for (int b = 0; b < nb; b++) {
+        struct ReqWalk sub = {0};
+        int best = -1;
+        if (req_walk(ast, branches[b], &sub) || req_flush(&sub)) {
+            free(sub.clauses);
+            return -1;
+        }
+        for (int k = 0; k < sub.n; k++)
+            if (sub.clauses[k].n == 1 && (best < 0 || sub.clauses[k].len[0] > sub.clauses[best].len[0]))
+                best = k;
+        if (best >= 0) {
+            c.len[c.n] = sub.clauses[best].len[0];
+            memcpy(c.lit[c.n], sub.clauses[best].lit[0], c.len[c.n]);
+            if (c.len[c.n] < c.minlen) c.minlen = c.len[c.n];
+            c.n++;
+        }
+        free(sub.clauses);
+        if (best < 0) return 0;
+    }
+    return req_push(w, &c);
+}
+
+/* Collects the literals every match of node idx contains.  Runs continue
+ * across concatenation and groups and end at anything else. */
+int req_walk(const struct Ast *ast, int idx, struct ReqWalk *w) {
+    const struct Node *nd = &ast->nodes[idx];
+    int c;
+
+    switch (nd->type) {
+    case N_EMPTY:
+        return 0;
+    case N_CAT:
+        return req_walk(ast, nd->left, w) || req_walk(ast, nd->right, w) ? -1 : 0;
+    case N_GROUP:
+        return req_walk(ast, nd->left, w);
+    case N_SET:
+        if ((c = cs_single(&nd->set)) >= 0) return req_append(w, c);
+        return req_flush(w);
+    case N_REPEAT:
+        if (ast->nodes[nd->left].type == N_SET && nd->min == nd->max &&
+            (c = cs_single(&ast->nodes[nd->left].set)) >= 0) {
+            for (int i = 0; i < nd->min; i++)
+                if (req_append(w, c)) return -1;
+            return 0;
+        }
+        if (req_flush(w)) return -1;
+        if (nd->min > 0 && (req_walk(ast, nd->left, w) || req_flush(w))) return -1;
+        return 0;
+    case N_ALT:
+        if (req_flush(w)) return -1;
+        return req_alt(ast, idx, w);
+    default:
+        return req_flush(w);
+    }
+}
+
+int cmp_clause(const void *a, const void *b) {
+    const struct ReqClause *x = (const struct ReqClause *)a, *y = (const struct ReqClause *)b;
+    return y->minlen - x->minlen;
+}
+
+/* Aho-Corasick automaton over the required literals of all patterns, with
+ * the clause structure needed to turn the literals seen into candidates. */
+struct ReqFilter {
+    int nstates, cap;
+    int ncls;
+    uint8_t cls[256];
+    int32_t *delta;         /* nstates * ncls, complete */
+    int32_t *lit;           /* per state: literal ending here, -1 */
+    int32_t *dict;          /* per state: longest proper suffix state with a literal, -1 */
+    int32_t *out;           /* per state: itself if it has a literal, else dict */
+    int32_t *child;         /* build only: trie edges */
+    int32_t *sibling;
+    uint8_t *byte;
+    int nlits;
+    char **lit_str;         /* for describe_ruleset */
+    int *lit_len;
+    int32_t *lit_off;       /* clauses of literal l: lit_clauses[lit_off[l]..lit_off[l + 1]) */
+    int32_t *lit_clauses;
+    int nclauses;
+    int32_t *clause_pat;
+    int32_t *clause_off;    /* literals of clause c: clause_lits[clause_off[c]..clause_off[c + 1]) */
+    int32_t *clause_lits;
+    int *nreq;              /* per pattern: clauses, 0 if unfiltered */
+    uint64_t *unfiltered;
+    int nwords;
+    struct Teddy teddy;     /* over lit_str when it fits, else nlits 0 */
+};
+
+/* Per-thread state for one scan; stamps avoid clearing between names. */
+struct ReqScratch {
+    uint32_t gen;
+    uint32_t *lit_gen;
+    uint32_t *clause_gen;
+    uint32_t *pat_gen;
+    int *pat_seen;          /* clauses satisfied so far */
+};
+
+void free_req_filter(struct ReqFilter *f) {
+    free(f->delta);
+    free(f->lit);
+    free(f->dict);
+    free(f->out);
+    free(f->child);
+    free(f->sibling);
+    free(f->byte);
+    free_lines(f->lit_str, f->nlits);
+    free(f->lit_len);
+    free(f->lit_off);
+    free(f->lit_clauses);
+    free(f->clause_pat);
+    free(f->clause_off);
+    free(f->clause_lits);
+    free(f->nreq);
+    free(f->unfiltered);
+    memset(f, 0, sizeof(*f));
+}
+
+int req_state(struct ReqFilter *f, int parent, int c) {
+    if (f->nstates == f->cap) {
+        int new_cap = f->cap ? f->cap * 2 : 64;
+        int32_t *child = (int32_t *)realloc(f->child, sizeof(int32_t) * new_cap);
+        check_mem(child);
+        f->child = child;
+        int32_t *sibling = (int32_t *)realloc(f->sibling, sizeof(int32_t) * new_cap);
+        check_mem(sibling);
+        f->sibling = sibling;
+        uint8_t *byte = (uint8_t *)realloc(f->byte, new_cap);
+        check_mem(byte);
+        f->byte = byte;
+        int32_t *lit = (int32_t *)realloc(f->lit, sizeof(int32_t) * new_cap);
+        check_mem(lit);
+        f->lit = lit;
+        f->cap = new_cap;
+    }
+    int id = f->nstates++;
+    f->child[id] = -1;
+    f->lit[id] = -1;
+    f->byte[id] = c;
+    if (parent >= 0) {
+        f->sibling[id] = f->child[parent];
+        f->child[parent] = id;
+    } else {
+        f->sibling[id] = -1;
+    }
+    return id;
+error:
+    return -1;
+}
+
+/* Returns the id of literal s[0..len), adding it if new, or -1. */
+int req_insert(struct ReqFilter *f, const char *s, int len) {
+    int node = 0;
+    for (int i = 0; i < len; i++) {
+        int c = (unsigned char)s[i], next = -1;
+        for (int k = f->child[node]; k >= 0; k = f->sibling[k])
+            if (f->byte[k] == c) {
+                next = k;
+                break;
+            }
+        if (next < 0 && (next = req_state(f, node, c)) < 0) return -1;
+        node = next;
+    }
+    if (f->lit[node] < 0) {
+        if (f->nlits % 64 == 0) {
+            char **str = (char **)realloc(f->lit_str, sizeof(char *) * (f->nlits + 64));
+            check_mem(str);
+            f->lit_str = str;
+            int *lens = (int *)realloc(f->lit_len, sizeof(int) * (f->nlits + 64));
+            check_mem(lens);
+            f->lit_len = lens;
+        }
+        f->lit_str[f->nlits] = strndup(s, len);
+        check_mem(f->lit_str[f->nlits]);
+        f->lit_len[f->nlits] = len;
+        f->lit[node] = f->nlits++;
+    }
+    return f->lit[node];
+error:
+    return -1;
+}
+
+/* Fills in failure transitions, turning the trie into a complete DFA. */
+int req_finish(struct ReqFilter *f) {
+    int used[256] = {0}, *queue = NULL, *fail = NULL, qh = 0, qt = 0;
+
+    for (int s = 1; s < f->nstates; s++)
+        used[f->byte[s]] = 1;
+    f->ncls = 1;
+    for (int c = 0; c < 256; c++)
+        f->cls[c] = used[c] ? f->ncls++ : 0;
+
+    f->delta = (int32_t *)malloc(sizeof(int32_t) * f->nstates * f->ncls);
+    f->dict = (int32_t *)malloc(sizeof(int32_t) * f->nstates);
+    f->out = (int32_t *)malloc(sizeof(int32_t) * f->nstates);
+    queue = (int *)malloc(sizeof(int) * f->nstates);
+    fail = (int *)malloc(sizeof(int) * f->nstates);
+    check_mem(f->delta && f->dict && f->out && queue && fail);
+
+    fail[0] = 0;
+    f->dict[0] = -1;
+    queue[qt++] = 0;
+    while (qh < qt) {
+        int u = queue[qh++];
+        int32_t *row = f->delta + (size_t)u * f->ncls;
+        if (u == 0) memset(row, 0, sizeof(int32_t) * f->ncls);
+        else memcpy(row, f->delta + (size_t)fail[u] * f->ncls, sizeof(int32_t) * f->ncls);
+        for (int v = f->child[u]; v >= 0; v = f->sibling[v]) {
+            int c = f->cls[f->byte[v]];
+            fail[v] = u == 0 ? 0 : f->delta[(size_t)fail[u] * f->ncls + c];
+            f->dict[v] = f->lit[fail[v]] >= 0 ? fail[v] : f->dict[fail[v]];
+            row[c] = v;
+            queue[qt++] = v;
+        }
+        f->out[u] = f->lit[u] >= 0 ? u : f->dict[u];
+    }
+    free(queue);
+    free(fail);
+    return 0;
+error:
+    free(queue);
+    free(fail);
+    return -1;
+}
+
+/* Extracts the required literals of every parsed pattern and builds the
+ * automaton.  Patterns without any are left unfiltered. */
+int req_build(struct ReqFilter *f, const struct Ast *asts, int npat) {
+    struct ReqWalk w = {0};
+    int nclauses = 0, nlinks = 0, cap = 0;
+    int32_t *link_clause = NULL, *link_lit = NULL, *cursor = NULL;
+
+    memset(f, 0, sizeof(*f));
+    f->nwords = (npat + 63) / 64;
+    f->nreq = (int *)calloc(npat ? npat : 1, sizeof(int));
+    f->unfiltered = (uint64_t *)calloc(f->nwords ? f->nwords : 1, sizeof(uint64_t));
+    check_mem(f->nreq && f->unfiltered);
+    if (req_state(f, -1, 0) < 0) goto error;
+
+    for (int p = 0; p < npat; p++) {
+        w.n = w.runlen = 0;
+        if (asts[p].root < 0 || req_walk(&asts[p], asts[p].root, &w) || req_flush(&w)) w.n = 0;
+        if (w.n > 1) qsort(w.clauses, w.n, sizeof(struct ReqClause), cmp_clause);
+        if (w.n > MAX_REQ_CLAUSES) w.n = MAX_REQ_CLAUSES;
+        if (w.n == 0) bit_set(f->unfiltered, p);
+        for (int k = 0; k < w.n; k++, nclauses++) {
+            const struct ReqClause *c = &w.clauses[k];
+            if (nclauses % 64 == 0) {
+                int32_t *pat = (int32_t *)realloc(f->clause_pat, sizeof(int32_t) * (nclauses + 64));
+                check_mem(pat);
+                f->clause_pat = pat;
+            }
+            f->clause_pat[nclauses] = p;
+            for (int j = 0; j < c->n; j++, nlinks++) {
+                if (nlinks == cap) {
+                    cap = cap ? cap * 2 : 64;
+                    int32_t *lc = (int32_t *)realloc(link_clause, sizeof(int32_t) * cap);
+                    check_mem(lc);
+                    link_clause = lc;
+                    int32_t *ll = (int32_t *)realloc(link_lit, sizeof(int32_t) * cap);
+                    check_mem(ll);
+                    link_lit = ll;
+                }
+                link_clause[nlinks] = nclauses;
+                if ((link_lit[nlinks] = req_insert(f, c->lit[j], c->len[j])) < 0) goto error;
+            }
+        }
+        f->nreq[p] = w.n;
+    }
+    f->nclauses = nclauses;
+
+    /* clause -> literals and literal -> clauses from the link list, which
+     * is in clause order already */
+    f->clause_off = (int32_t *)calloc(nclauses + 1, sizeof(int32_t));
+    f->clause_lits = (int32_t *)malloc(sizeof(int32_t) * (nlinks ? nlinks : 1));
+    f->lit_off = (int32_t *)calloc(f->nlits + 1, sizeof(int32_t));
+    f->lit_clauses = (int32_t *)malloc(sizeof(int32_t) * (nlinks ? nlinks : 1));
+    check_mem(f->clause_off && f->clause_lits && f->lit_off && f->lit_clauses);
+    for (int k = 0; k < nlinks; k++) {
+        f->clause_off[link_clause[k] + 1]++;
+        f->lit_off[link_lit[k] + 1]++;
+        f->clause_lits[k] = link_lit[k];
+    }
+    for (int c = 0; c < nclauses; c++)
+        f->clause_off[c + 1] += f->clause_off[c];
+    for (int l = 0; l < f->nlits; l++)
+        f->lit_off[l + 1] += f->lit_off[l];
+    cursor = (int32_t *)malloc(sizeof(int32_t) * (f->nlits ? f->nlits : 1));
+    check_mem(cursor);
+    memcpy(cursor, f->lit_off, sizeof(int32_t) * f->nlits);
+    for (int k = 0; k < nlinks; k++)
+        f->lit_clauses[cursor[link_lit[k]]++] = link_clause[k];
+
+    if (req_finish(f)) goto error;
+    teddy_build(&f->teddy, (const char *const *)f->lit_str, f->lit_len, f->nlits);
+    free(w.clauses);
+    free(link_clause);
+    free(link_lit);
+    free(cursor);
+    return 0;
+error:
+    free(w.clauses);
+    free(link_clause);
+    free(link_lit);
+    free(cursor);
+    free_req_filter(f);
+    return -1;
+}
+
+void free_req_scratch(struct ReqScratch *rq) {
+    free(rq->lit_gen);
+    free(rq->clause_gen);
+    free(rq->pat_gen);
+    free(rq->pat_seen);
+    memset(rq, 0, sizeof(*rq));
+}
+
+int init_req_scratch(struct ReqScratch *rq, const struct ReqFilter *f, int npat) {
+    memset(rq, 0, sizeof(*rq));
+    rq->lit_gen = (uint32_t *)calloc(f->nlits ? f->nlits : 1, sizeof(uint32_t));
+    rq->clause_gen = (uint32_t *)calloc(f->nclauses ? f->nclauses : 1, sizeof(uint32_t));
+    rq->pat_gen = (uint32_t *)calloc(npat ? npat : 1, sizeof(uint32_t));
+    rq->pat_seen = (int *)calloc(npat ? npat : 1, sizeof(int));
+    check_mem(rq->lit_gen && rq->clause_gen && rq->pat_gen && rq->pat_seen);
+    return 0;
+error:
+    free_req_scratch(rq);
+    return -1;
+}
+
+/* Marks literal l seen and counts the clauses it satisfies. */
+static inline void req_seen(const struct ReqFilter *f, struct ReqScratch *rq, int l, uint64_t *sat) {
+    rq->lit_gen[l] = rq->gen;
+    for (int k = f->lit_off[l]; k < f->lit_off[l + 1]; k++) {
+        int c = f->lit_clauses[k], p = f->clause_pat[c];
+        if (rq->clause_gen[c] == rq->gen) continue;
+        rq->clause_gen[c] = rq->gen;
+        if (rq->pat_gen[p] != rq->gen) {
+            rq->pat_gen[p] = rq->gen;
+            rq->pat_seen[p] = 0;
+        }
+        if (++rq->pat_seen[p] == f->nreq[p]) bit_set(sat, p);
+    }
+}
+
+struct ReqHit {
+    const struct ReqFilter *f;
+    struct ReqScratch *rq;
+    uint64_t *sat;
+};
+
+void req_hit(void *ctx, int l) {
+    struct ReqHit *h = (struct ReqHit *)ctx;
+    if (h->rq->lit_gen[l] != h->rq->gen) req_seen(h->f, h->rq, l, h->sat);
+}
+
+/* Removes from cand the patterns whose required literals s[0..len) lacks.
+ * With a vector unit the literals are found by Teddy, or one at a time
+ * when there are only a couple; the automaton is the scalar path and
+ * takes literal sets too large for Teddy's buckets. */
+void req_candidates(const struct ReqFilter *f, struct ReqScratch *rq, int npat,
+                    const char *s, size_t len, uint64_t *cand) {
+    uint64_t sat[f->nwords ? f->nwords : 1], any = 0;
+    int32_t st = 0;
+
+    for (int w = 0; w < f->nwords; w++)
+        any |= cand[w] & ~f->unfiltered[w];
+    if (!any) return;
+    if (++rq->gen == 0) {
+        memset(rq->lit_gen, 0, sizeof(uint32_t) * (f->nlits ? f->nlits : 1));
+        memset(rq->clause_gen, 0, sizeof(uint32_t) * (f->nclauses ? f->nclauses : 1));
+        memset(rq->pat_gen, 0, sizeof(uint32_t) * (npat ? npat : 1));
+        rq->gen = 1;
+    }
+    memcpy(sat, f->unfiltered, sizeof(uint64_t) * f->nwords);
+    if (simd_level != SIMD_SCALAR && f->nlits <= REQ_FIND_LITS) {
+        for (int l = 0; l < f->nlits; l++)
+            if (lit_find(s, len, f->lit_str[l], f->lit_len[l]) >= 0) req_seen(f, rq, l, sat);
+    } else if (simd_level != SIMD_SCALAR && f->teddy.nlits) {
+        struct ReqHit h = { f, rq, sat };
+        teddy_scan(&f->teddy, s, len, req_hit, &h);
+    } else {
+        for (size_t i = 0; i < len; i++) {
+            st = f->delta[(size_t)st * f->ncls + f->cls[(unsigned char)s[i]]];
+            /* suffixes of a literal already seen were reported with it */
+            for (int32_t t = f->out[st]; t >= 0 && rq->lit_gen[f->lit[t]] != rq->gen; t = f->dict[t])
+                req_seen(f, rq, f->lit[t], sat);
+        }
+    }
+    for (int w = 0; w < f->nwords; w++)
+        cand[w] &= sat[w];
+}
+
+/* Segment matcher for dot-separated metric paths ---------------------------
+ *
+ * Graphite rules are mostly ^-anchored sequences of whole path segments:
+ * literals, character-class runs such as [a-z0-9]{12}, `.*` spanning any
+ * number of segments, and alternations of these.  Such a pattern compiles
+ * to a small NFA over segments, and a name is split at its dots once and
+ * fed through it segment by segment.
+ */
+
+#define MAX_SEG_STATES 256
+#define SEG_WORDS (MAX_SEG_STATES / 64)
+#define MAX_SEG_SEQS 64         /* alternatives after distributing | and . */
+#define MAX_SEG_TOKS 256
+#define MAX_SEGMENTS 128
+#define MAX_SEG_SPAN 512        /* longer segments take their offset sets from the heap */
+
+enum SegStateType { G_TEST, G_SPLIT, G_REST, G_END };
+
+struct SegRun {
+    struct CharSet set;     /* never contains '.' */
+    int min, max;           /* max == -1 means unbounded */
+};
+
+struct SegTest {
+    int run_off, nruns;
+    int prefix;             /* runs need only match the head of the segment */
+};
+
+struct SegState {
+    int type;               /* G_REST accepts whatever follows, G_END only at the end */
+    int out, out1;
+    int arg;                /* G_TEST: index into tests */
+};
+
+struct SegProg {
+    int nstates, start;
+    struct SegState *states;
+    uint64_t *closure;      /* nstates * SEG_WORDS: states reachable by G_SPLIT */
+    int ntests;
+    struct SegTest *tests;
+    int nruns;
+    struct SegRun *runs;
+};
+
+enum SegTokType { K_RUN, K_SEP, K_ANY, K_BOL, K_EOL };
+
+struct SegTok {
+    int type;
+    int min, max;
+    struct CharSet set;
+};
+
+struct SegBuild {
+    const struct Ast *ast;
+    struct SegProg *prog;
+    struct SegTok toks[MAX_SEG_TOKS];
+    int seq_start[MAX_SEG_SEQS];
+    int nseqs;
+    int scap, tcap, rcap;
+};
+
+struct SegWork {
+    int node;
+    const struct SegWork *next;
+};
+
+void free_segprog(struct SegProg *g) {
+    free(g->states);
+    free(g->closure);
+    free(g->tests);
+    free(g->runs);
+    memset(g, 0, sizeof(*g));
+}
+
+int seg_state(struct SegBuild *b, int type, int out, int out1, int arg) {
+    struct SegProg *g = b->prog;
+    if (g->nstates >= MAX_SEG_STATES) return -1;
+    if (g->nstates == b->scap) {
+        b->scap = b->scap ? b->scap * 2 : 16;
+        struct SegState *tmp = (struct SegState *)realloc(g->states, sizeof(struct SegState) * b->scap);
+        check_mem(tmp);
+        g->states = tmp;
+    }
+    struct SegState *s = &g->states[g->nstates];
+    s->type = type;
+    s->out = out;
+    s->out1 = out1;
+    s->arg = arg;
+    return g->nstates++;
+error:
+    return -1;
+}
+
+/* Adds a test for the runs in toks[0..n) and returns its index. */
+int seg_test(struct SegBuild *b, const struct SegTok *toks, int n, int prefix) {
+    struct SegProg *g = b->prog;
+    if (g->ntests == b->tcap) {
+        b->tcap = b->tcap ? b->tcap * 2 : 16;
+        struct SegTest *tmp = (struct SegTest *)realloc(g->tests, sizeof(struct SegTest) * b->tcap);
+        check_mem(tmp);
+        g->tests = tmp;
+    }
+    if (g->nruns + n > b->rcap) {
+        while (g->nruns + n > b->rcap) b->rcap = b->rcap ? b->rcap * 2 : 16;
+        struct SegRun *tmp = (struct SegRun *)realloc(g->runs, sizeof(struct SegRun) * b->rcap);
+        check_mem(tmp);
+        g->runs = tmp;
+    }
+    struct SegTest *t = &g->tests[g->ntests];
+    t->run_off = g->nruns;
+    t->nruns = n;
+    t->prefix = prefix;
+    for (int i = 0; i < n; i++) {
+        struct SegRun *r = &g->runs[g->nruns++];
+        r->set = toks[i].set;
+        r->min = toks[i].min;
+        r->max = toks[i].max;
+    }
+    return g->ntests++;
+error:
+    return -1;
+}
+
+/* Turns one alternative, ^ slot (. slot)* [$], into a chain of segment
+ * states and records its entry.  Returns nonzero if it does not fit. */
+int seg_emit_seq(struct SegBuild *b, int ntok) {
+    int slot_start[MAX_SEG_TOKS], slot_end[MAX_SEG_TOKS];
+    int nslots = 0, eol = 0, i = 1;
+
+    if (ntok == 0 || b->toks[0].type != K_BOL) return -1;
+    if (b->toks[ntok - 1].type == K_EOL) {
+        eol = 1;
+        ntok--;
+    }
+    slot_start[0] = 1;
+    for (; i < ntok; i++) {
+        int type = b->toks[i].type;
+        if (type == K_BOL || type == K_EOL) return -1;
+        if (type == K_SEP) {
+            slot_end[nslots++] = i;
+            slot_start[nslots] = i + 1;
+        }
+    }
+    slot_end[nslots++] = ntok;
+
+    int next = seg_state(b, eol ? G_END : G_REST, -1, -1, 0);
+    for (int k = nslots - 1; k >= 0 && next >= 0; k--) {
+        const struct SegTok *toks = &b->toks[slot_start[k]];
+        int n = slot_end[k] - slot_start[k];
+        int any = n == 1 && toks[0].type == K_ANY;
+        int last = k == nslots - 1 && !eol;
+        for (int j = 0; j < n; j++)
+            if (toks[j].type == K_ANY && !any) return -1;
+
+        if (any && !last) {
+            /* .* between dots spans one or more whole segments */
+            int split = seg_state(b, G_SPLIT, -1, next, 0);
+            int t = seg_test(b, NULL, 0, 1);
+            if (split < 0 || t < 0) return -1;
+            next = seg_state(b, G_TEST, split, -1, t);
+            if (next >= 0) b->prog->states[split].out = next;
+        } else {
+            int t = seg_test(b, toks, any ? 0 : n, last);
+            if (t < 0) return -1;
+            next = seg_state(b, G_TEST, next, -1, t);
+        }
+    }
+    if (next < 0 || b->nseqs == MAX_SEG_SEQS) return -1;
+    b->seq_start[b->nseqs++] = next;
+    return 0;
+}
+
+int seg_push(struct SegBuild *b, const struct SegWork *w, int ntok, int type,
+             const struct CharSet *cs, int min, int max);
+
+/* Depth-first over the choices in the work list (alternation branches,
+ * whether an unescaped . is a separator, bounded repeat counts), emitting
+ * one flat token sequence per combination.  Returns nonzero on failure. */
+int seg_gen(struct SegBuild *b, const struct SegWork *w, int ntok) {
+    if (!w) return seg_emit_seq(b, ntok);
+
+    const struct Node *nd = &b->ast->nodes[w->node];
+    const struct Node *child = nd->left >= 0 ? &b->ast->nodes[nd->left] : NULL;
+    struct CharSet nodot;
+
+    switch (nd->type) {
+    case N_EMPTY:
+        return seg_gen(b, w->next, ntok);
+    case N_CAT: {
+        struct SegWork r = {nd->right, w->next};
+        struct SegWork l = {nd->left, &r};
+        return seg_gen(b, &l, ntok);
+    }
+    case N_GROUP: {
+        struct SegWork c = {nd->left, w->next};
+        return seg_gen(b, &c, ntok);
+    }
+    case N_ALT: {
+        struct SegWork l = {nd->left, w->next};
+        struct SegWork r = {nd->right, w->next};
+        return seg_gen(b, &l, ntok) || seg_gen(b, &r, ntok);
+    }
+    case N_BOL:
+        return seg_push(b, w->next, ntok, K_BOL, NULL, 0, 0);
+    case N_EOL:
+        return seg_push(b, w->next, ntok, K_EOL, NULL, 0, 0);
+    case N_SET:
+        if (!cs_has(&nd->set, '.'))
+            return seg_push(b, w->next, ntok, K_RUN, &nd->set, 1, 1);
+        if (seg_push(b, w->next, ntok, K_SEP, NULL, 0, 0)) return -1;
+        nodot = nd->set;
+        cs_del(&nodot, '.');
+        if (cs_single(&nd->set) == '.') return 0;
+        return seg_push(b, w->next, ntok, K_RUN, &nodot, 1, 1);
+    case N_REPEAT:
+        if (child->type == N_SET && !cs_has(&child->set, '.'))
+            return seg_push(b, w->next, ntok, K_RUN, &child->set, nd->min, nd->max);
+        if (child->type == N_SET && nd->min == 0 && nd->max < 0) {
+            for (int c = 1; c < 256; c++)
+                if (!cs_has(&child->set, c)) return -1;
+            return seg_push(b, w->next, ntok, K_ANY, NULL, 0, -1);
+        }
+        if (nd->max < 0 || nd->max > 4) return -1;
+        for (int k = nd->min; k <= nd->max; k++) {
+            struct SegWork copies[4];
+            const struct SegWork *head = w->next;
+            for (int j = 0; j < k; j++) {
+                copies[j].node = nd->left;
+                copies[j].next = head;
+                head = &copies[j];
+            }
+            if (seg_gen(b, head, ntok)) return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+int seg_push(struct SegBuild *b, const struct SegWork *w, int ntok, int type,
+             const struct CharSet *cs, int min, int max) {
+    if (ntok == MAX_SEG_TOKS) return -1;
+    struct SegTok *t = &b->toks[ntok];
+    t->type = type;
+    t->min = min;
+    t->max = max;
+    if (cs) t->set = *cs;
+    return seg_gen(b, w, ntok + 1);
+}
+
+/* Compiles ast into g.  Returns nonzero if the pattern is not a segment
+ * pattern, in which case g is left empty. */
+int compile_segprog(const struct Ast *ast, struct SegProg *g) {
+    struct SegBuild *b = NULL;
+
+    memset(g, 0, sizeof(*g));
+    if (ast->root < 0) return -1;
+    b = (struct SegBuild *)calloc(1, sizeof(struct SegBuild));
+    check_mem(b);
+    b->ast = ast;
+    b->prog = g;
+
+    struct SegWork root = {ast->root, NULL};
+    if (seg_gen(b, &root, 0)) goto error;
+
+    g->start = b->seq_start[b->nseqs - 1];
+    for (int i = b->nseqs - 2; i >= 0; i--)
+        if ((g->start = seg_state(b, G_SPLIT, b->seq_start[i], g->start, 0)) < 0) goto error;
+
+    /* Precompute split closures; split targets always have lower ids
+     * except for loop-backs, so iterate to a fixed point */
+    g->closure = (uint64_t *)calloc((size_t)g->nstates * SEG_WORDS, sizeof(uint64_t));
+    check_mem(g->closure);
+    for (int i = 0; i < g->nstates; i++)
+        bit_set(g->closure + i * SEG_WORDS, i);
+    for (int changed = 1; changed;) {
+        changed = 0;
+        for (int i = 0; i < g->nstates; i++) {
+            const struct SegState *s = &g->states[i];
+            uint64_t *c = g->closure + i * SEG_WORDS;
+            if (s->type != G_SPLIT) continue;
+            for (int w = 0; w < SEG_WORDS; w++) {
+                uint64_t v = c[w] | g->closure[s->out * SEG_WORDS + w] | g->closure[s->out1 * SEG_WORDS + w];
+                if (v != c[w]) {
+                    c[w] = v;
+                    changed = 1;
+                }
+            }
+        }
+    }
+    free(b);
+    return 0;
+error:
+    free(b);
+    free_segprog(g);
+    return -1;
+}
+
+/* Matches one segment against a sequence of runs by carrying the set of
+ * offsets each run can end at, so the cost is O(runs * length) however
+ * the runs overlap.  Run r can end at q if it starts at a reachable p in
+ * [q - max, q - min] with s[p..q) inside its class; the latest reachable
+ * p <= q - min is the only candidate worth keeping. */
+int seg_runs_match(const struct SegRun *r, int nr, const char *s, int len, int prefix) {
+    uint8_t stack[2 * (MAX_SEG_SPAN + 1)], *buf = stack;
+    int alive = 1, ok = 0;
+
+    if (len > MAX_SEG_SPAN) {
+        buf = (uint8_t *)malloc(2 * ((size_t)len + 1));
+        check_mem(buf);
+    }
+    uint8_t *cur = buf, *next = buf + len + 1;
+    memset(cur, 0, len + 1);
+    cur[0] = 1;
+    for (int i = 0; i < nr && alive; i++, r++) {
+        int start = 0, last = -1;
+        alive = 0;
+        for (int q = 0; q <= len; q++) {
+            if (q > 0 && !cs_has(&r->set, (unsigned char)s[q - 1])) start = q;
+            if (q >= r->min && cur[q - r->min]) last = q - r->min;
+            int lo = r->max < 0 || q - r->max < start ? start : q - r->max;
+            next[q] = last >= lo;
+            alive |= next[q];
+        }
+        uint8_t *tmp = cur;
+        cur = next;
+        next = tmp;
+    }
+    ok = alive && (prefix || cur[len]);
+error:
+    if (buf != stack) free(buf);
+    return ok;
+}
+
+/* A name split at its dots. */
+struct Segments {
+    int n;
+    int off[MAX_SEGMENTS];
+    int len[MAX_SEGMENTS];
+};
+
+/* Returns nonzero if the name has too many segments to split. */
+int split_segments(const char *s, size_t len, struct Segments *sg) {
+    size_t start = 0;
+    sg->n = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && s[i] != '.') continue;
+        if (sg->n == MAX_SEGMENTS) return -1;
+        sg->off[sg->n] = start;
+        sg->len[sg->n++] = i - start;
+        start = i + 1;
+    }
+    return 0;
+}
+
+static inline void seg_add_closure(const struct SegProg *g, uint64_t *set, int id) {
+    for (int w = 0; w < SEG_WORDS; w++)
+        set[w] |= g->closure[id * SEG_WORDS + w];
+}
+
+/* Returns 1 if the segment program matches the split name. */
+int seg_match(const struct SegProg *g, const char *s, const struct Segments *sg) {
+    uint64_t cur[SEG_WORDS] = {0}, next[SEG_WORDS];
+
+    seg_add_closure(g, cur, g->start);
+    for (int i = 0; ; i++) {
+        int alive = 0;
+        for (int w = 0; w < SEG_WORDS; w++) {
+            for (uint64_t m = cur[w]; m; m &= m - 1) {
+                const struct SegState *st = &g->states[w * 64 + __builtin_ctzll(m)];
+                if (st->type == G_REST || (st->type == G_END && i == sg->n)) return 1;
+                alive |= st->type == G_TEST;
+            }
+        }
+        if (!alive || i == sg->n) return 0;
+
+        memset(next, 0, sizeof(next));
+        for (int w = 0; w < SEG_WORDS; w++) {
+            for (uint64_t m = cur[w]; m; m &= m - 1) {
+                const struct SegState *st = &g->states[w * 64 + __builtin_ctzll(m)];
+                if (st->type != G_TEST) continue;
+                const struct SegTest *t = &g->tests[st->arg];
+                if (seg_runs_match(g->runs + t->run_off, t->nruns, s + sg->off[i], sg->len[i], t->prefix))
+                    seg_add_closure(g, next, st->out);
+            }
+        }
+        memcpy(cur, next, sizeof(cur));
+    }
+}
+
+/* Bit-parallel Glushkov matcher -------------------------------------------
+ *
+ * A small pattern becomes its Glushkov automaton: one state per character
+ * position, ^ and $ included, numbered left to right.  The set of live
+ * positions is a few machine words.  Most edges go from a position to its
+ * right neighbour, so a shift follows them all at once; the others (loops,
+ * alternations, skips) come from tables indexed by 8 bits of the state at
+ * a time, one table per byte of positions that has such edges; self loops
+ * are a mask.  A step is
+ * then shifts, a fixed number of lookups and an AND with the positions
+ * that accept the input byte, with no branches and no allocation.
+ */
+
+#define GL_MAX_POS 256
+#define GL_WORDS (GL_MAX_POS / 64)
+#define GL_MAX_CHUNKS 8         /* follow tables per pattern, 256 entries each */
+
+struct Glushkov {
+    int npos;               /* 0 if the pattern stays on another engine */
+    int nwords;
+    int nchunks;
+    int always;             /* the empty string matches at the start */
+    int chunk[GL_MAX_CHUNKS];
+    uint64_t *accept;       /* 256 * nwords: positions whose class has the byte */
+    uint64_t *tab;          /* nchunks * 256 * nwords: edges other than p -> p + 1 */
+    uint64_t shift[GL_WORDS];   /* positions entered from their left neighbour */
+    uint64_t loop[GL_WORDS];    /* positions that follow themselves, as in .* */
+    uint64_t first[GL_WORDS];   /* character positions a match can start with */
+    uint64_t last[GL_WORDS];    /* positions a match can end with, but $ */
+    uint64_t last_eol[GL_WORDS];
+    uint64_t bol[GL_WORDS];
+    uint64_t eol[GL_WORDS];
+    uint64_t begin[GL_WORDS];   /* ^ positions live at offset 0 */
+    uint64_t end[GL_WORDS];     /* $ positions live at the end from the start */
+};
+
+struct GluSets {
+    int nullable;
+    uint64_t first[GL_WORDS];
+    uint64_t last[GL_WORDS];
+};
+
+struct GluBuild {
+    const struct Ast *ast;
+    int npos;
+    struct CharSet set[GL_MAX_POS];
+    int type[GL_MAX_POS];       /* N_SET, N_BOL or N_EOL */
+    uint64_t follow[GL_MAX_POS][GL_WORDS];
+};
+
+void glu_cat(struct GluBuild *b, struct GluSets *x, const struct GluSets *y) {
+    for (int p = 0; p < b->npos; p++)
+        if (bit_test(x->last, p))
+            for (int w = 0; w < GL_WORDS; w++)
+                b->follow[p][w] |= y->first[w];
+    for (int w = 0; w < GL_WORDS; w++) {
+        if (x->nullable) x->first[w] |= y->first[w];
+        x->last[w] = y->last[w] | (y->nullable ? x->last[w] : 0);
+    }
+    x->nullable &= y->nullable;
+}
+
+void glu_star(struct GluBuild *b, struct GluSets *x) {
+    for (int p = 0; p < b->npos; p++)
+        if (bit_test(x->last, p))
+            for (int w = 0; w < GL_WORDS; w++)
+                b->follow[p][w] |= x->first[w];
+    x->nullable = 1;
+}
+
+int glu_walk(struct GluBuild *b, int idx, struct GluSets *out);
+
+/* (r(r(r)?)?)? with k copies, created left to right. */
+int glu_optional(struct GluBuild *b, int idx, int k, struct GluSets *out) {
+    struct GluSets rest;
+
+    memset(out, 0, sizeof(*out));
+    out->nullable = 1;
+    if (k == 0) return 0;
+    if (glu_walk(b, idx, out) || glu_optional(b, idx, k - 1, &rest)) return -1;
+    glu_cat(b, out, &rest);
+    out->nullable = 1;
+    return 0;
+}
+
+/* Fresh positions for every visit, so repeats unroll into copies. */
+int glu_walk(struct GluBuild *b, int idx, struct GluSets *out) {
+    const struct Node *nd = &b->ast->nodes[idx];
+    struct GluSets y;
+
+    memset(out, 0, sizeof(*out));
+    switch (nd->type) {
+    case N_EMPTY:
+        out->nullable = 1;
+        return 0;
+    case N_SET:
+    case N_BOL:
+    case N_EOL:
+        if (b->npos == GL_MAX_POS) return -1;
+        b->type[b->npos] = nd->type;
+        if (nd->type == N_SET) b->set[b->npos] = nd->set;
+        bit_set(out->first, b->npos);
+        bit_set(out->last, b->npos);
+        b->npos++;
+        return 0;
+    case N_GROUP:
+        return glu_walk(b, nd->left, out);
+    case N_CAT:
+        if (glu_walk(b, nd->left, out) || glu_walk(b, nd->right, &y)) return -1;
+        glu_cat(b, out, &y);
+        return 0;
+    case N_ALT:
+        if (glu_walk(b, nd->left, out) || glu_walk(b, nd->right, &y)) return -1;
+        for (int w = 0; w < GL_WORDS; w++) {
+            out->first[w] |= y.first[w];
+            out->last[w] |= y.last[w];
+        }
+        out->nullable |= y.nullable;
+        return 0;
+    case N_REPEAT:
+        out->nullable = 1;
+        for (int i = 0; i < nd->min; i++) {
+            if (glu_walk(b, nd->left, &y)) return -1;
+            if (nd->max < 0 && i == nd->min - 1) {
+                /* r{m,} loops on its last copy */
+                int nullable = y.nullable;
+                glu_star(b, &y);
+                y.nullable = nullable;
+            }
+            glu_cat(b, out, &y);
+        }
+        if (nd->max < 0 && nd->min == 0) {
+            if (glu_walk(b, nd->left, &y)) return -1;
+            glu_star(b, &y);
+            glu_cat(b, out, &y);
+        } else if (nd->max > nd->min) {
+            if (glu_optional(b, nd->left, nd->max - nd->min, &y)) return -1;
+            glu_cat(b, out, &y);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+static inline void glu_follow(const struct Glushkov *g, const uint64_t *d, uint64_t *out) {
+    uint64_t carry = 0;
+    for (int w = 0; w < g->nwords; w++) {
+        out[w] = (((d[w] << 1) | carry) & g->shift[w]) | (d[w] & g->loop[w]);
+        carry = d[w] >> 63;
+    }
+    for (int k = 0; k < g->nchunks; k++) {
+        int c = g->chunk[k];
+        const uint64_t *t = g->tab + ((size_t)k * 256 + ((d[c >> 3] >> ((c & 7) * 8)) & 0xff)) * g->nwords;
+        for (int w = 0; w < g->nwords; w++)
+            out[w] |= t[w];
+    }
+}
+
+/* Adds the positions in mask reachable from d through others in mask. */
+void glu_closure(const struct Glushkov *g, uint64_t *d, const uint64_t *mask) {
+    uint64_t f[GL_WORDS];
+    for (int changed = 1; changed;) {
+        changed = 0;
+        glu_follow(g, d, f);
+        for (int w = 0; w < g->nwords; w++) {
+            uint64_t v = d[w] | (f[w] & mask[w]);
+            changed |= v != d[w];
+            d[w] = v;
+        }
+    }
+}
+
+/* Returns -1 if the pattern has too many positions or irregular edges.
+ * The tables are allocated in a. */
+int compile_glushkov(const struct Ast *ast, struct Glushkov *g, struct Arena *a) {
+    struct GluBuild *b = NULL;
+    struct GluSets root;
+    uint64_t exc[GL_MAX_POS][GL_WORDS];
+
+    memset(g, 0, sizeof(*g));
+    if (ast->root < 0) return -1;
+    b = (struct GluBuild *)calloc(1, sizeof(struct GluBuild));
+    check_mem(b);
+    b->ast = ast;
+    if (glu_walk(b, ast->root, &root) || b->npos == 0) goto error;
+
+    g->nwords = (b->npos + 63) / 64;
+    g->always = root.nullable;
+    for (int p = 0; p < b->npos; p++) {
+        memcpy(exc[p], b->follow[p], sizeof(exc[p]));
+        if (p + 1 < b->npos && bit_test(b->follow[p], p + 1)) {
+            bit_set(g->shift, p + 1);
+            exc[p][(p + 1) >> 6] &= ~(1ULL << ((p + 1) & 63));
+        }
+        if (bit_test(b->follow[p], p)) {
+            bit_set(g->loop, p);
+            exc[p][p >> 6] &= ~(1ULL << (p & 63));
+        }
+        int any = 0;
+        for (int w = 0; w < GL_WORDS; w++)
+            any |= exc[p][w] != 0;
+        if (any && (g->nchunks == 0 || g->chunk[g->nchunks - 1] != p / 8)) {
+            if (g->nchunks == GL_MAX_CHUNKS) goto error;
+            g->chunk[g->nchunks++] = p / 8;
+        }
+        if (b->type[p] == N_BOL) bit_set(g->bol, p);
+        if (b->type[p] == N_EOL) bit_set(g->eol, p);
+        if (bit_test(root.last, p)) bit_set(b->type[p] == N_EOL ? g->last_eol : g->last, p);
+        if (bit_test(root.first, p) && b->type[p] == N_SET) bit_set(g->first, p);
+        if (bit_test(root.first, p) && b->type[p] == N_BOL) bit_set(g->begin, p);
+        if (bit_test(root.first, p) && b->type[p] == N_EOL) bit_set(g->end, p);
+    }
+
+    g->accept = (uint64_t *)arena_calloc(a, sizeof(uint64_t) * 256 * g->nwords);
+    g->tab = (uint64_t *)arena_calloc(a, sizeof(uint64_t) * (g->nchunks ? g->nchunks : 1) * 256 * g->nwords);
+    check_mem(g->accept && g->tab);
+    for (int p = 0; p < b->npos; p++)
+        if (b->type[p] == N_SET)
+            for (int c = 0; c < 256; c++)
+                if (cs_has(&b->set[p], c)) bit_set(g->accept + c * g->nwords, p);
+    for (int k = 0; k < g->nchunks; k++)
+        for (int byte = 1; byte < 256; byte++) {
+            uint64_t *t = g->tab + ((size_t)k * 256 + byte) * g->nwords;
+            for (int j = 0; j < 8; j++) {
+                int p = g->chunk[k] * 8 + j;
+                if (!(byte >> j & 1) || p >= b->npos) continue;
+                for (int w = 0; w < g->nwords; w++)
+                    t[w] |= exc[p][w];
+            }
+        }
+    g->npos = b->npos;
+
+    /* ^ chains live at offset 0, $ chains reachable before any input */
+    glu_closure(g, g->begin, g->bol);
+    glu_closure(g, g->end, g->eol);
+    free(b);
+    return 0;
+error:
+    free(b);
+    memset(g, 0, sizeof(*g));
+    return -1;
+}
+
+/* Runs the live set d over s[0..len) with nwords a constant once inlined,
+ * so the word loops unroll.  Returns 1 as soon as a match has ended. */
+static inline __attribute__((always_inline))
+int glu_scan(const struct Glushkov *g, uint64_t *d, const char *s, size_t len, int nwords) {
+    int any_first = 0;
+
+    for (int w = 0; w < nwords; w++)
+        any_first |= g->first[w] != 0;
+    for (size_t i = 0; i < len; i++) {
+        const uint64_t *acc = g->accept + (size_t)(unsigned char)s[i] * nwords;
+        uint64_t f[GL_WORDS], carry = 0, live = 0, hit = 0;
+        for (int w = 0; w < nwords; w++) {
+            f[w] = (((d[w] << 1) | carry) & g->shift[w]) | (d[w] & g->loop[w]);
+            carry = d[w] >> 63;
+        }
+        for (int k = 0; k < g->nchunks; k++) {
+            int c = g->chunk[k];
+            const uint64_t *t = g->tab + ((size_t)k * 256 + ((d[c >> 3] >> ((c & 7) * 8)) & 0xff)) * nwords;
+            for (int w = 0; w < nwords; w++)
+                f[w] |= t[w];
+        }
+        for (int w = 0; w < nwords; w++) {
+            d[w] = (f[w] | g->first[w]) & acc[w];
+            hit |= d[w] & g->last[w];
+            live |= d[w];
+        }
+        if (hit) return 1;
+        /* anchored and dead: only $ chains from the start are left */
+        if (!live && !any_first) return 0;
+    }
+    return 0;
+}
+
+/* Whether the pattern matches anywhere in s[0..len). */
+int glu_match(const struct Glushkov *g, const char *s, size_t len) {
+    uint64_t d[GL_WORDS], hit = 0;
+    int found;
+
+    if (g->always) return 1;
+    if (len == 0) {
+        /* offset 0 is also the end, so ^ and $ chains mix */
+        uint64_t anchors[GL_WORDS] = {0};
+        for (int w = 0; w < g->nwords; w++) {
+            d[w] = g->begin[w] | g->end[w];
+            anchors[w] = g->bol[w] | g->eol[w];
+        }
+        glu_closure(g, d, anchors);
+        for (int w = 0; w < g->nwords; w++)
+            hit |= d[w] & (g->last[w] | g->last_eol[w]);
+        return hit != 0;
+    }
+    for (int w = 0; w < g->nwords; w++) {
+        d[w] = g->begin[w];
+        hit |= d[w] & g->last[w];
+    }
+    if (hit) return 1;
+    if (g->nwords == 1)
+        found = glu_scan(g, d, s, len, 1);
+    else if (g->nwords == 2)
+        found = glu_scan(g, d, s, len, 2);
+    else
+        found = glu_scan(g, d, s, len, g->nwords);
+    if (found) return 1;
+
+    /* at the end, $ positions open up */
+    for (int w = 0; w < g->nwords; w++)
+        d[w] |= g->end[w];
+    glu_closure(g, d, g->eol);
+    for (int w = 0; w < g->nwords; w++)
+        hit |= d[w] & g->last_eol[w];
+    return hit != 0;
+}
+
+/* Submatch extraction --------------------------------------------------------
+ *
+ * A Pike VM over a per-pattern NFA with S_SAVE states around each group.
+ * Threads advance in lock step, at most one per NFA state, so a search is
+ * linear in the name whatever the pattern, and each thread carries its own
+ * capture slots.  The overall match is leftmost-longest as in POSIX.  When
+ * two threads meet in one state the one with the better POSIX submatches
+ * wins: for each subexpression in the order they open, the earlier start,
+ * then the longer end; otherwise the one a backtracker would have tried
+ * first.  POSIX counts every element of a concatenation as a subexpression,
+ * not just the parenthesized ones, so a repeat of variable length gets a
+ * hidden group of its own: in ^a-?(.*) the -? then takes the - before the
+ * group may.  This agrees with glibc except where a repeated group can
+ * match empty or repeats inside another repeat, where glibc itself strays
+ * from POSIX.  Patterns the parser rejects, or with too many states or
+ * groups, are handed to regexec with submatches.
+ */
+
+#define MAX_CAP_STATES 4096
+#define MAX_CAP_GROUPS 32
+#define MAX_CAP_TAGS 96         /* groups, hidden ones included */
+
+struct CapProg {
+    struct Nfa nfa;         /* nfa.npat == 0 if re is used instead */
+    int nslots;             /* 2 * (tags + 1); slots 0 and 1 are the whole match */
+    int nmatch;             /* groups + 1, as regexec reports them */
+    uint8_t tag_of[MAX_CAP_GROUPS + 1];     /* group -> its tag, numbered in slot order */
+    int anchored;           /* only matches at 0: no new threads after it */
+    regex_t re;             /* without REG_NOSUB, if the NFA is not used */
+    int has_re;
+};
+
+/* The states reached at one position; pos makes membership O(1).  run
+ * holds the states that consume input or match, in priority order. */
+struct PikeList {
+    int *dense;
+    int *pos;
+    int n;
+    int *slots;             /* nslots per NFA state */
+    int *run;
+    int nrun;
+    char *inrun;
+};
+
+struct PikeScratch {
+    struct PikeList list[2];
+    int *stack;
+    char *queued;           /* per state: on the stack to be expanded */
+    char *deferred;         /* per split: on the stack for its second branch */
+    int *tmp;
+    int *best;
+    int nstates, nslots;    /* capacity */
+};
+
+void free_capprog(struct CapProg *cp) {
+    free_nfa(&cp->nfa);
+    if (cp->has_re) regfree(&cp->re);
+    memset(cp, 0, sizeof(*cp));
+}
+
+/* Numbers the groups under node idx of t as tags in the order they open,
+ * from *ntags + 1, wrapping each repeat of variable length in a hidden
+ * group unless it is a group's whole body.  Returns the node that replaces
+ * idx, or -1 once there are too many tags. */
+int cap_tag(struct CapProg *cp, struct Ast *t, int idx, int body, int *ntags) {
+    int type = t->nodes[idx].type, g, k;
+
+    switch (type) {
+    case N_GROUP:
+        if (++*ntags > MAX_CAP_TAGS) return -1;
+        cp->tag_of[t->nodes[idx].group] = *ntags;
+        t->nodes[idx].group = *ntags;
+        if ((k = cap_tag(cp, t, t->nodes[idx].left, 1, ntags)) < 0) return -1;
+        t->nodes[idx].left = k;
+        return idx;
+    case N_REPEAT:
+        g = idx;
+        if (!body && t->nodes[idx].min != t->nodes[idx].max) {
+            if (++*ntags > MAX_CAP_TAGS || (g = ast_node(t, N_GROUP, idx, -1)) < 0) return -1;
+            t->nodes[g].group = *ntags;
+        }
+        if ((k = cap_tag(cp, t, t->nodes[idx].left, 0, ntags)) < 0) return -1;
+        t->nodes[idx].left = k;
+        return g;
+    case N_CAT:
+    case N_ALT:
+        if ((k = cap_tag(cp, t, t->nodes[idx].left, 0, ntags)) < 0) return -1;
+        t->nodes[idx].left = k;
+        if ((k = cap_tag(cp, t, t->nodes[idx].right, 0, ntags)) < 0) return -1;
+        t->nodes[idx].right = k;
+        return idx;
+    }
+    return idx;
+}
+
+/* Compiles pattern (parsed into ast, root < 0 if it could not be) for
+ * extraction.  Returns 0 on success. */
+int compile_capprog(const char *pattern, const struct Ast *ast, struct CapProg *cp) {
+    struct NfaScratch ns = {0};
+    struct Ast t = {NULL, 0, 0, -1, 0};
+    int ntags = 0;
+
+    memset(cp, 0, sizeof(*cp));
+    if (ast->root >= 0 && ast->ngroups <= MAX_CAP_GROUPS) {
+        t.nodes = (struct Node *)malloc(sizeof(struct Node) * ast->n);
+        check_mem(t.nodes);
+        memcpy(t.nodes, ast->nodes, sizeof(struct Node) * ast->n);
+        t.n = t.cap = ast->n;
+        t.root = cap_tag(cp, &t, ast->root, 0, &ntags);
+    }
+    if (t.root >= 0) {
+        cp->nfa.captures = 1;
+        cp->nfa.npat = 1;
+        cp->nfa.start = (int *)malloc(sizeof(int));
+        check_mem(cp->nfa.start);
+        if (nfa_add_pattern(&cp->nfa, &t, 0) == 0 && cp->nfa.n <= MAX_CAP_STATES) {
+            cp->nslots = 2 * (ntags + 1);
+            cp->nmatch = ast->ngroups + 1;
+            /* without crossing ^ nothing is reachable: anchored */
+            if (init_nfa_scratch(&ns, &cp->nfa)) goto error;
+            cp->anchored = nfa_closure(&cp->nfa, &ns, cp->nfa.start, 1, 0) == 0;
+            free_nfa_scratch(&ns);
+            free_ast(&t);
+            return 0;
+        }
+        free_nfa(&cp->nfa);
+    }
+    free_ast(&t);
+    if (regcomp(&cp->re, pattern, REG_EXTENDED)) return -1;
+    cp->has_re = 1;
+    cp->nmatch = cp->re.re_nsub + 1;
+    cp->nslots = 2 * cp->nmatch;
+    return 0;
+error:
+    free_ast(&t);
+    free_capprog(cp);
+    return -1;
+}
+
+void free_pike_scratch(struct PikeScratch *ps) {
+    for (int k = 0; k < 2; k++) {
+        free(ps->list[k].dense);
+        free(ps->list[k].pos);
+        free(ps->list[k].slots);
+        free(ps->list[k].run);
+        free(ps->list[k].inrun);
+    }
+    free(ps->stack);
+    free(ps->queued);
+    free(ps->deferred);
+    free(ps->tmp);
+    free(ps->best);
+    memset(ps, 0, sizeof(*ps));
+}
+
+int init_pike_scratch(struct PikeScratch *ps, int nstates, int nslots) {
+    memset(ps, 0, sizeof(*ps));
+    if (nstates < 1) nstates = 1;
+    if (nslots < 2) nslots = 2;
+    for (int k = 0; k < 2; k++) {
+        ps->list[k].dense = (int *)malloc(sizeof(int) * nstates);
+        ps->list[k].pos = (int *)calloc(nstates, sizeof(int));
+        ps->list[k].slots = (int *)malloc(sizeof(int) * nstates * nslots);
+        ps->list[k].run = (int *)malloc(sizeof(int) * nstates);
+        ps->list[k].inrun = (char *)calloc(nstates, 1);
+        check_mem(ps->list[k].dense && ps->list[k].pos && ps->list[k].slots &&
+                  ps->list[k].run && ps->list[k].inrun);
+    }
+    ps->stack = (int *)malloc(sizeof(int) * 2 * nstates);
+    ps->queued = (char *)calloc(nstates, 1);
+    ps->deferred = (char *)calloc(nstates, 1);
+    ps->tmp = (int *)malloc(sizeof(int) * nslots);
+    ps->best = (int *)malloc(sizeof(int) * nslots);
+    check_mem(ps->stack && ps->queued && ps->deferred && ps->tmp && ps->best);
+    ps->nstates = nstates;
+    ps->nslots = nslots;
+    return 0;
+error:
+    free_pike_scratch(ps);
+    return -1;
+}
+
+/* Whether slots a are preferred to b under POSIX rules: leftmost match,
+ * then per group an earlier start, then a longer end.  A group still open
+ * (end before start) will end at or after the current position, so it is
+ * preferred to a closed one with the same start.  A group set in one and
+ * not the other came from different alternatives, which priority decides. */
+static int caps_better(const int *a, const int *b, int nslots) {
+    if (a[0] != b[0]) return a[0] < b[0];
+    for (int k = 2; k < nslots; k += 2) {
+        if (a[k] != b[k]) {
+            if (a[k] < 0 || b[k] < 0) return 0;
+            return a[k] < b[k];
+        }
+        if (a[k] < 0) continue;
+        int aopen = a[k + 1] < a[k], bopen = b[k + 1] < b[k];
+        if (aopen != bopen) return aopen;
+        if (!aopen && a[k + 1] != b[k + 1]) return a[k + 1] > b[k + 1];
+    }
+    return 0;
+}
+
+/* Gives state id on list l the slots c, unless it holds better ones, and
+ * queues it so its epsilon successors see the change. */
+static inline void pike_arrive(struct PikeScratch *ps, struct PikeList *l, int id, const int *c,
+                               int nslots, int *sp) {
+    int *dst = l->slots + (size_t)id * nslots;
+    int p = l->pos[id];
+
+    if (p < l->n && l->dense[p] == id) {
+        if (!caps_better(c, dst, nslots)) return;
+    } else {
+        l->pos[id] = l->n;
+        l->dense[l->n++] = id;
+    }
+    memcpy(dst, c, sizeof(int) * nslots);
+    if (!ps->queued[id]) {
+        ps->queued[id] = 1;
+        ps->stack[(*sp)++] = id;
+    }
+}
+
+/* Adds state id with slots c to list l at position i and follows epsilon
+ * edges depth first, so l->run comes out in the order a backtracker would
+ * try the states.  Slots only ever improve, so revisiting a state
+ * terminates. */
+static void pike_add(const struct CapProg *cp, struct PikeScratch *ps, struct PikeList *l,
+                     int id, const int *c, size_t i, size_t len) {
+    int nslots = cp->nslots, sp = 0;
+
+    pike_arrive(ps, l, id, c, nslots, &sp);
+    while (sp > 0) {
+        id = ps->stack[--sp];
+        if (id < 0) {
+            /* second branch of a split, once the first is exhausted */
+            id = ~id;
+            ps->deferred[id] = 0;
+            pike_arrive(ps, l, cp->nfa.states[id].out1, l->slots + (size_t)id * nslots, nslots, &sp);
+            continue;
+        }
+        ps->queued[id] = 0;
+        const struct NState *s = &cp->nfa.states[id];
+        const int *cur = l->slots + (size_t)id * nslots;
+        switch (s->type) {
+        case S_SET:
+        case S_MATCH:
+            if (!l->inrun[id]) {
+                l->inrun[id] = 1;
+                l->run[l->nrun++] = id;
+            }
+            break;
+        case S_SPLIT:
+            if (!ps->deferred[id]) {
+                ps->deferred[id] = 1;
+                ps->stack[sp++] = ~id;
+            }
+            pike_arrive(ps, l, s->out, cur, nslots, &sp);
+            break;
+        case S_EPS:
+            pike_arrive(ps, l, s->out, cur, nslots, &sp);
+            break;
+        case S_BOL:
+            if (i == 0) pike_arrive(ps, l, s->out, cur, nslots, &sp);
+            break;
+        case S_EOL:
+            if (i == len) pike_arrive(ps, l, s->out, cur, nslots, &sp);
+            break;
+        case S_SAVE:
+            memcpy(ps->tmp, cur, sizeof(int) * nslots);
+            ps->tmp[s->arg] = (int)i;
+            pike_arrive(ps, l, s->out, ps->tmp, nslots, &sp);
+            break;
+        }
+    }
+}
+
+static inline void pike_clear(struct PikeList *l) {
+    for (int k = 0; k < l->nrun; k++)
+        l->inrun[l->run[k]] = 0;
+    l->nrun = 0;
+    l->n = 0;
+}
+
+/* Finds the leftmost-longest match of cp in s[0..len) and fills
+ * pm[0..nmatch) like regexec, offsets relative to s.  Returns 0 or
+ * REG_NOMATCH. */
+int pike_match(const struct CapProg *cp, struct PikeScratch *ps, const char *s, size_t len,
+               regmatch_t *pm, size_t nmatch) {
+    struct PikeList *cl = &ps->list[0], *nl = &ps->list[1], *t;
+    int nslots = cp->nslots, matched = 0;
+    int *best = ps->best;
+
+    pike_clear(cl);
+    for (size_t i = 0; ; i++) {
+        if (!matched && (i == 0 || !cp->anchored)) {
+            /* lowest priority: every live thread started further left */
+            int *c = ps->tmp;
+            for (int k = 0; k < nslots; k++)
+                c[k] = -1;
+            c[0] = (int)i;
+            pike_add(cp, ps, cl, cp->nfa.start[0], c, i, len);
+        } else if (cl->nrun == 1) {
+            /* a lone thread on a chain of character sets needs no
+             * bookkeeping until the chain forks or ends */
+            int id = cl->run[0];
+            const struct NState *st = &cp->nfa.states[id];
+            size_t j = i;
+            while (j < len && st->type == S_SET && cp->nfa.states[st->out].type == S_SET &&
+                   cs_has(&cp->nfa.sets[st->arg], (unsigned char)s[j])) {
+                id = st->out;
+                st = &cp->nfa.states[id];
+                j++;
+            }
+            if (j != i) {
+                memcpy(ps->tmp, cl->slots + (size_t)cl->run[0] * nslots, sizeof(int) * nslots);
+                pike_clear(cl);
+                pike_add(cp, ps, cl, id, ps->tmp, j, len);
+                i = j;
+            }
+        }
+        pike_clear(nl);
+        for (int k = 0; k < cl->nrun; k++) {
+            int id = cl->run[k];
+            int *c = cl->slots + (size_t)id * nslots;
+            const struct NState *st = &cp->nfa.states[id];
+            if (matched && c[0] > best[0]) continue;
+            if (st->type == S_MATCH) {
+                c[1] = (int)i;
+                if (!matched || c[0] < best[0] || (c[0] == best[0] && (int)i > best[1]) ||
+                    ((int)i == best[1] && caps_better(c, best, nslots))) {
+                    memcpy(best, c, sizeof(int) * nslots);
+                    matched = 1;
+                }
+            } else if (st->type == S_SET && i < len &&
+                       cs_has(&cp->nfa.sets[st->arg], (unsigned char)s[i])) {
+                pike_add(cp, ps, nl, st->out, c, i + 1, len);
+            }
+        }
+        if (i == len || (nl->nrun == 0 && (matched || cp->anchored))) break;
+        t = cl;
+        cl = nl;
+        nl = t;
+    }
+    if (!matched) return REG_NOMATCH;
+    for (size_t k = 0; k < nmatch; k++) {
+        int tag = k == 0 ? 0 : (int)k < cp->nmatch ? cp->tag_of[k] : -1;
+        int so = tag >= 0 ? best[2 * tag] : -1;
+        int eo = so >= 0 ? best[2 * tag + 1] : -1;
+        pm[k].rm_so = so;
+        pm[k].rm_eo = so >= 0 ? eo : -1;
+    }
+    return 0;
+}
+
+/* Built-in rules -------------------------------------------------------------
+ *
+ * Rules every deployment carries are listed once in BUILTIN_RULES, as a
+ * name and a pattern.  -b appends them to the rule set after the file's
+ * patterns.  `gen -b` lowers each pattern through its own DFA to a C
+ * function, written as builtins_gen.h.  Built with -DBUILTINS_GEN, each
+ * rule runs its function on every name, outside the combined automata,
+ * and nothing about it is parsed at startup.  Without the header, or with
+ * one generated from other patterns, they compile like the file's
+ * patterns.  selftest checks the generated functions against regexec.
+ */
+
+#define BUILTIN_RULES(X)                                                        \
+    X(icinga2, "^icinga2\\.")                                                   \
+    X(scribe_errors, "^stats\\.counters\\.dae\\._scribe\\.errors\\.[a-z0-9]{12}\\.")
+
+#define BUILTIN_ENUM(name, pattern) BUILTIN_##name,
+enum { BUILTIN_RULES(BUILTIN_ENUM) BUILTIN_COUNT };
+#undef BUILTIN_ENUM
+
+#define BUILTIN_NAME(name, pattern) #name,
+const char *const builtin_names[] = { BUILTIN_RULES(BUILTIN_NAME) };
+#undef BUILTIN_NAME
+
+#define BUILTIN_PATTERN(name, pattern) pattern,
+const char *const builtin_patterns[] = { BUILTIN_RULES(BUILTIN_PATTERN) };
+#undef BUILTIN_PATTERN
+
+#ifdef BUILTINS_GEN
+#include "builtins_gen.h"       /* written by `regex gen -b`; see Generated matchers */
+#else
+#define BUILTINS_GEN_COUNT 0
+static const char *const builtins_gen_patterns[1];
+static int builtins_gen_match(int k, const unsigned char *p, const unsigned char *end) {
+    (void)k;
+    (void)p;
+    (void)end;
+    return 0;
+}
+#endif
+
+/* Whether builtins_gen.h was generated from the current BUILTIN_RULES. */
+static int builtins_generated(void) {
+    if (BUILTINS_GEN_COUNT != BUILTIN_COUNT) return 0;
+    for (int k = 0; k < BUILTIN_COUNT; k++)
+        if (strcmp(builtins_gen_patterns[k], builtin_patterns[k])) return 0;
+    return 1;
+}
+
+/* Whether built-in rule k matches s[0..len), by its generated function. */
+static inline int builtin_match(int k, const char *s, size_t len) {
+    return builtins_gen_match(k, (const unsigned char *)s, (const unsigned char *)s + len);
+}
+
+/* Rule set ---------------------------------------------------------------- */
+
+enum Engine {
+    ENGINE_REGEXEC, ENGINE_PREFILTER, ENGINE_DFA, ENGINE_LAZY, ENGINE_JIT, ENGINE_GEN, ENGINE_COUNT
+};
+
+const char *engine_names[] = { "regexec", "prefilter", "dfa", "lazy", "jit", "gen" };
+
+/* What a lookup reports: every matching pattern, only the lowest one, or
+ * one of them, whichever an engine finds first.  The last two stop as soon
+ * as the answer is known. */
+enum Mode { MODE_ALL, MODE_FIRST, MODE_ANY, MODE_COUNT };
+
+const char *mode_names[] = { "all", "first", "any" };
+
+struct RuleSet {
+    int n;
+    int nwords;             /* uint64_t words per match set */
+    char **patterns;
+    regex_t *regexs;
+    int regcomp_cnt;
+    uint8_t *regex_ready;   /* per pattern, whether regexs has it; NULL if all of regcomp_cnt */
+    pthread_mutex_t regex_lock; /* with regex_ready, held to compile one on first use */
+    struct Ast *asts;
+    struct SegProg *segs;   /* per pattern; nstates == 0 if it stays on regexec */
+    struct Glushkov *glus;  /* per pattern; npos == 0 unless it is the engine */
+    char **prefixes;        /* literal prefix of each ^-anchored pattern */
+    int *prefix_lens;
+    struct PrefixTrie trie;
+    struct ReqFilter req;
+    struct Nfa nfa;
+    struct Dfa dfa;
+    int has_dfa;
+    struct DfaJit jit;      /* native code for dfa, if it could be built */
+    int32_t *first_live;    /* per dfa state, from dfa_first_live */
+    uint64_t *skip;         /* per mode, rules it need not evaluate; NULL if not analysed */
+    struct CapProg *caps;   /* per pattern, for submatch extraction */
+    int cap_states;         /* largest capture NFA */
+    int cap_slots;
+    uint64_t source_hash;   /* of the pattern lines compiled */
+    int builtin_from;       /* patterns from here on are built-in rules */
+    int builtin_gen;        /* which run their generated matchers */
+    struct Arena arena;     /* patterns, prefixes, syntax trees, Glushkov tables */
+    void *image;            /* mapping its tables are read from, or NULL */
+    size_t image_size;
+};
+
+/* Frees the first n of regexs, only those set in ready if there is one. */
+void free_regexes(regex_t *regexs, const uint8_t *ready, int n) {
+    for (int i = 0; i < n; i++)
+        if (!ready || ready[i]) regfree(&regexs[i]);
+    free(regexs);
+}
+
+void free_ruleset(struct RuleSet *rs) {
+    if (!rs) return;
+    free_jit(&rs->jit);
+    free(rs->first_live);
+    free(rs->skip);
+    if (rs->image) {
+        /* the tables live in the mapping; rs heads the copied structs */
+        if (rs->regexs) free_regexes(rs->regexs, rs->regex_ready, rs->regcomp_cnt);
+        free(rs->regex_ready);
+        pthread_mutex_destroy(&rs->regex_lock);
+        for (int i = 0; i < rs->n; i++)
+            if (rs->caps[i].has_re) regfree(&rs->caps[i].re);
+        munmap(rs->image, rs->image_size);
+        free(rs);
+        return;
+    }
+    if (rs->regexs) free_regexes(rs->regexs, NULL, rs->regcomp_cnt);
+    if (rs->segs) {
+        for (int i = 0; i < rs->n; i++)
+            free_segprog(&rs->segs[i]);
+        free(rs->segs);
+    }
+    free(rs->glus);
+    free(rs->prefix_lens);
+    free_trie(&rs->trie);
+    free_req_filter(&rs->req);
+    free_nfa(&rs->nfa);
+    if (rs->has_dfa) free_dfa(&rs->dfa);
+    if (rs->caps) {
+        for (int i = 0; i < rs->n; i++)
+            free_capprog(&rs->caps[i]);
+        free(rs->caps);
+    }
+    free_arena(&rs->arena);
+    free(rs);
+}
+
+struct RuleSet *compile_ruleset(const struct Line *lines, int n, int nbuiltin) {
+    size_t alloc_n = n > 0 ? n : 1;
+    struct Ast work = {NULL, 0, 0, -1, 0};
+    struct RuleSet *rs = (struct RuleSet *)calloc(1, sizeof(struct RuleSet));
+    check_mem(rs);
+    rs->n = n;
+    rs->nwords = (n + 63) / 64;
+    rs->builtin_from = n - nbuiltin;
+    rs->builtin_gen = nbuiltin && builtins_generated();
+
+    rs->patterns = (char **)arena_calloc(&rs->arena, sizeof(char *) * alloc_n);
+    check_mem(rs->patterns);
+    for (int i = 0; i < n; i++) {
+        rs->patterns[i] = arena_strndup(&rs->arena, lines[i].ptr, lines[i].len);
+        check_mem(rs->patterns[i]);
+    }
+
+    rs->regexs = (regex_t *)malloc(sizeof(regex_t) * alloc_n);
+    check_mem(rs->regexs);
+    for (int i = 0; i < n; i++) {
+        if (regcomp(&rs->regexs[i], rs->patterns[i], REG_EXTENDED | REG_NOSUB)) {
+            fprintf(stderr, "Could not compile regex: %s\n", rs->patterns[i]);
+            goto error;
+        }
+        rs->regcomp_cnt++;
+    }
+
+    rs->asts = (struct Ast *)arena_calloc(&rs->arena, sizeof(struct Ast) * alloc_n);
+    check_mem(rs->asts);
+    rs->nfa.npat = n;
+    rs->nfa.start = (int *)malloc(sizeof(int) * alloc_n);
+    check_mem(rs->nfa.start);
+    for (int i = 0; i < n; i++) {
+        rs->nfa.start[i] = -1;
+        if (rs->builtin_gen && i >= rs->builtin_from)
+            rs->asts[i].root = -1;      /* runs its generated matcher */
+        else if (parse_pattern_into(rs->patterns[i], &rs->asts[i], &work, &rs->arena) == 0)
+            nfa_add_pattern(&rs->nfa, &rs->asts[i], i);
+    }
+    free_ast(&work);
+
+    /* Pick a per-pattern engine: the bit-parallel matcher if the pattern
+     * fits, else the segment matcher where it applies, else regexec */
+    rs->segs = (struct SegProg *)calloc(n ? n : 1, sizeof(struct SegProg));
+    rs->glus = (struct Glushkov *)calloc(n ? n : 1, sizeof(struct Glushkov));
+    check_mem(rs->segs && rs->glus);
+    for (int i = 0; i < n; i++)
+        if (compile_glushkov(&rs->asts[i], &rs->glus[i], &rs->arena))
+            compile_segprog(&rs->asts[i], &rs->segs[i]);
+
+    rs->caps = (struct CapProg *)calloc(n ? n : 1, sizeof(struct CapProg));
+    check_mem(rs->caps);
+    for (int i = 0; i < n; i++) {
+        check(compile_capprog(rs->patterns[i], &rs->asts[i], &rs->caps[i]) == 0,
+              "Could not compile regex: %s", rs->patterns[i]);
+        if (rs->caps[i].nfa.n > rs->cap_states) rs->cap_states = rs->caps[i].nfa.n;
+        if (rs->caps[i].nslots > rs->cap_slots) rs->cap_slots = rs->caps[i].nslots;
+    }
+
+    /* Index literal prefixes for the per-pattern engines */
+    rs->prefixes = (char **)arena_calloc(&rs->arena, sizeof(char *) * alloc_n);
+    rs->prefix_lens = (int *)calloc(n ? n : 1, sizeof(int));
+    check_mem(rs->prefixes && rs->prefix_lens);
+    if (trie_init(&rs->trie, n)) goto error;
+    for (int i = 0; i < n; i++) {
+        char buf[MAX_PREFIX];
+        int len = ast_literal_prefix(&rs->asts[i], buf);
+        if (len == 0) {
+            bit_set(rs->trie.always, i);
+            continue;
+        }
+        rs->prefixes[i] = arena_strndup(&rs->arena, buf, len);
+        check_mem(rs->prefixes[i]);
+        rs->prefix_lens[i] = len;
+        if (trie_insert(&rs->trie, buf, len, i)) goto error;
+    }
+    if (req_build(&rs->req, rs->asts, n)) goto error;
+
+    if (dfa_build(&rs->dfa, &rs->nfa) == 0) {
+        rs->has_dfa = 1;
+        jit_dfa(&rs->jit, &rs->dfa);
+        rs->first_live = dfa_first_live(&rs->dfa);
+        check_mem(rs->first_live);
+    } else
+        fprintf(stderr, "Combined DFA exceeds %d states, using the lazy DFA\n", MAX_DFA_STATES);
+    return rs;
+
+error:
+    free_ast(&work);
+    free_ruleset(rs);
+    return NULL;
+}
+
+/* regexec on s[0..len), which need not be NUL-terminated. */
+static inline int regexec_len(const regex_t *re, const char *s, size_t len) {
+    regmatch_t pm[1];
+    pm[0].rm_so = 0;
+    pm[0].rm_eo = len;
+    return regexec(re, s, 1, pm, REG_STARTEND);
+}
+
+/* Result cache ---------------------------------------------------------------
+ *
+ * Maps a metric name to the set of patterns it matched, so a name seen
+ * before skips the engines.  Entries live in sets of CACHE_WAYS; a set is
+ * guarded by a try-lock and a lookup that finds it busy just matches
+ * without the cache, so threads never wait on each other.  Within a set a
+ * CLOCK hand evicts the first entry not hit since the hand last passed.
+ * A cache belongs to one rule-set generation: a reload starts an empty one
+ * and the old one goes with its generation once readers have left.  It
+ * holds the results of one evaluation mode; lookups in another skip it.
+ */
+
+#define CACHE_WAYS 8
+#define CACHE_KEY 120           /* longer names are matched but not cached */
+
+struct CacheEntry {
+    uint32_t len;
+    char key[CACHE_KEY];
+    /* followed by nwords result words */
+};
+
+/* The tags of a set share its lock's cache line, so a probe reads one
+ * line plus the entries whose tag matches. */
+struct CacheSet {
+    uint32_t lock;
+    uint8_t hand;
+    uint8_t ref;                /* way bits, hit since the hand last passed */
+    uint8_t used;               /* way bits */
+    uint8_t pad;
+    uint32_t tag[CACHE_WAYS];
+};
+
+struct ResultCache {
+    size_t nsets;               /* power of two */
+    size_t stride;              /* bytes per entry */
+    int nwords;
+    int mode;                   /* of the lookups whose results it holds */
+    unsigned char *slots;
+    struct CacheSet *sets;
+};
+
+/* Per-thread counters, kept in the scratch. */
+struct CacheCounters {
+    unsigned long long hits, misses, evictions, bypassed;
+};
+
+void free_result_cache(struct ResultCache *c) {
+    if (!c) return;
+    free(c->slots);
+    free(c->sets);
+    free(c);
+}
+
+/* A cache for results of nwords words in at most bytes of entries. */
+struct ResultCache *new_result_cache(int nwords, int mode, size_t bytes) {
+    struct ResultCache *c = (struct ResultCache *)calloc(1, sizeof(struct ResultCache));
+    check_mem(c);
+    c->nwords = nwords;
+    c->mode = mode;
+    c->stride = (sizeof(struct CacheEntry) + 7) / 8 * 8 + sizeof(uint64_t) * nwords;
+    c->nsets = 1;
+    while (c->nsets * 2 * CACHE_WAYS * c->stride <= bytes)
+        c->nsets *= 2;
+    c->slots = (unsigned char *)calloc(c->nsets * CACHE_WAYS, c->stride);
+    c->sets = (struct CacheSet *)calloc(c->nsets, sizeof(struct CacheSet));
+    check_mem(c->slots && c->sets);
+    return c;
+error:
+    free_result_cache(c);
+    return NULL;
+}
+
+void clear_result_cache(struct ResultCache *c) {
+    memset(c->slots, 0, c->nsets * CACHE_WAYS * c->stride);
+    memset(c->sets, 0, c->nsets * sizeof(struct CacheSet));
+}
+
+static inline uint64_t name_hash(const char *s, size_t len) {
+    uint64_t h = len * 0x9e3779b97f4a7c15ULL, w;
+    for (; len >= 8; s += 8, len -= 8) {
+        memcpy(&w, s, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, s, len);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 29);
+}
+
+static inline struct CacheEntry *cache_entry(const struct ResultCache *c, size_t set, int way) {
+    return (struct CacheEntry *)(c->slots + (set * CACHE_WAYS + way) * c->stride);
+}
+
+static inline uint64_t *cache_result(const struct ResultCache *c, struct CacheEntry *e) {
+    return (uint64_t *)((unsigned char *)e + c->stride - sizeof(uint64_t) * c->nwords);
+}
+
+static inline int cache_trylock(struct CacheSet *cs) {
+    return !__atomic_load_n(&cs->lock, __ATOMIC_RELAXED) &&
+           !__atomic_exchange_n(&cs->lock, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void cache_unlock(struct CacheSet *cs) {
+    __atomic_store_n(&cs->lock, 0, __ATOMIC_RELEASE);
+}
+
+/* The way of set holding s[0..len), or -1.  The set must be locked. */
+static inline int cache_find(const struct ResultCache *c, size_t set, uint32_t tag,
+                             const char *s, size_t len) {
+    const struct CacheSet *cs = &c->sets[set];
+    for (int w = 0; w < CACHE_WAYS; w++) {
+        if (!(cs->used >> w & 1) || cs->tag[w] != tag) continue;
+        const struct CacheEntry *e = cache_entry(c, set, w);
+        if (e->len == len && !memcmp(e->key, s, len)) return w;
+    }
+    return -1;
+}
+
+/* Copies the cached result for s[0..len) to out; returns 0 on a miss. */
+int cache_lookup(struct ResultCache *c, struct CacheCounters *k, uint64_t hash,
+                 const char *s, size_t len, uint64_t *out) {
+    size_t set = hash & (c->nsets - 1);
+    struct CacheSet *cs = &c->sets[set];
+    int w;
+
+    if (!cache_trylock(cs)) {
+        k->bypassed++;
+        return 0;
+    }
+    w = cache_find(c, set, hash >> 32, s, len);
+    if (w >= 0) {
+        cs->ref |= 1 << w;
+        memcpy(out, cache_result(c, cache_entry(c, set, w)), sizeof(uint64_t) * c->nwords);
+    }
+    cache_unlock(cs);
+    if (w < 0) k->misses++;
+    else k->hits++;
+    return w >= 0;
+}
+
+void cache_insert(struct ResultCache *c, struct CacheCounters *k, uint64_t hash,
+                  const char *s, size_t len, const uint64_t *out) {
+    size_t set = hash & (c->nsets - 1);
+    struct CacheSet *cs = &c->sets[set];
+    int w;
+
+    if (!cache_trylock(cs)) return;
+    /* another thread may have got here first */
+    if (cache_find(c, set, hash >> 32, s, len) < 0) {
+        for (;;) {
+            w = cs->hand;
+            cs->hand = (w + 1) % CACHE_WAYS;
+            if (!(cs->used >> w & 1) || !(cs->ref >> w & 1)) break;
+            cs->ref &= ~(1 << w);
+        }
+        if (cs->used >> w & 1) k->evictions++;
+        struct CacheEntry *e = cache_entry(c, set, w);
+        e->len = len;
+        memcpy(e->key, s, len);
+        memcpy(cache_result(c, e), out, sizeof(uint64_t) * c->nwords);
+        cs->used |= 1 << w;
+        cs->ref &= ~(1 << w);
+        cs->tag[w] = hash >> 32;
+    }
+    cache_unlock(cs);
+}
+
+/* Instrumentation ------------------------------------------------------------
+ *
+ * Per pattern: evaluations, matches and a log-linear (HDR-style) histogram
+ * of evaluation time.  Row n counts combined automaton scans.  Each thread
+ * counts into its scratch and folds the rows it touched into the shared
+ * totals every STATS_FLUSH_EVERY lookups, so the hot path takes no lock.
+ * Counts are exact; only one lookup in STATS_SAMPLE is timed, as reading
+ * the clock costs more than a DFA scan of a short name.
+ */
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)   /* linear sub-buckets per power of two */
+#define HIST_MAX_EXP 36                 /* about 69 s; slower samples share the last bucket */
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+#define STATS_FLUSH_EVERY 4096
+#define STATS_SAMPLE 16                 /* power of two */
+
+struct PatternStats {
+    uint64_t evals;
+    uint64_t matches;
+    uint64_t samples;       /* timed evaluations, the histogram's total */
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint32_t hist[HIST_BUCKETS];
+};
+
+struct Stats {
+    int n;                  /* patterns; rows[n] counts automaton scans */
+    struct PatternStats *rows;
+    pthread_mutex_t lock;
+};
+
+volatile sig_atomic_t stats_dump_requested;
+
+void on_stats_signal(int sig) {
+    (void)sig;
+    __atomic_store_n(&stats_dump_requested, 1, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Values below HIST_SUB are exact; above, each power of two is split into
+ * HIST_SUB equal buckets, so every bucket is within 1/HIST_SUB of its value. */
+static inline int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    if (e > HIST_MAX_EXP) return HIST_BUCKETS - 1;
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Largest value that lands in bucket b. */
+uint64_t hist_upper(int b) {
+    if (b < HIST_SUB) return b;
+    int e = b / HIST_SUB + HIST_SUB_BITS - 1;
+    return ((uint64_t)(HIST_SUB + b % HIST_SUB + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+static inline void stats_record(struct PatternStats *r, uint64_t ns) {
+    r->samples++;
+    r->total_ns += ns;
+    if (ns > r->max_ns) r->max_ns = ns;
+    r->hist[hist_bucket(ns)]++;
+}
+
+void stats_add(struct PatternStats *dst, const struct PatternStats *src) {
+    dst->evals += src->evals;
+    dst->matches += src->matches;
+    dst->samples += src->samples;
+    dst->total_ns += src->total_ns;
+    if (src->max_ns > dst->max_ns) dst->max_ns = src->max_ns;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        dst->hist[b] += src->hist[b];
+}
+
+struct Stats *new_stats(int n) {
+    struct Stats *st = (struct Stats *)calloc(1, sizeof(struct Stats));
+    check_mem(st);
+    st->n = n;
+    st->rows = (struct PatternStats *)calloc(n + 1, sizeof(struct PatternStats));
+    check_mem(st->rows);
+    pthread_mutex_init(&st->lock, NULL);
+    return st;
+error:
+    if (st) free(st->rows);
+    free(st);
+    return NULL;
+}
+
+void free_stats(struct Stats *st) {
+    if (!st) return;
+    pthread_mutex_destroy(&st->lock);
+    free(st->rows);
+    free(st);
+}
+
+uint64_t stats_percentile(const struct PatternStats *r, double q) {
+    uint64_t rank = (uint64_t)(q * r->samples), seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += r->hist[b];
+        if (seen > rank) {
+            uint64_t v = hist_upper(b);
+            return v < r->max_ns ? v : r->max_ns;
+        }
+    }
+    return r->max_ns;
+}
+
+void print_json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+void print_stats_row_json(FILE *f, const struct PatternStats *r) {
+    fprintf(f, "\"evals\": %llu, \"matches\": %llu, \"samples\": %llu, \"total_ns\": %llu, "
+            "\"max_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+            "\"histogram\": [",
+            (unsigned long long)r->evals, (unsigned long long)r->matches,
+            (unsigned long long)r->samples, (unsigned long long)r->total_ns, (unsigned long long)r->max_ns,
+            (unsigned long long)stats_percentile(r, 0.5),
+            (unsigned long long)stats_percentile(r, 0.9),
+            (unsigned long long)stats_percentile(r, 0.99));
+    for (int b = 0, first = 1; b < HIST_BUCKETS; b++) {
+        if (!r->hist[b]) continue;
+        fprintf(f, "%s[%llu, %u]", first ? "" : ", ", (unsigned long long)hist_upper(b), r->hist[b]);
+        first = 0;
+    }
+    fprintf(f, "]");
+}
+
+/* Prints the shared totals; histograms are given as [upper_ns, count] and
+ * latencies are over the sampled evaluations. */
+void print_stats(const struct RuleSet *rs, struct Stats *st, int json, FILE *f) {
+    pthread_mutex_lock(&st->lock);
+    if (json) {
+        fprintf(f, "{\"patterns\": [");
+        for (int i = 0; i < st->n; i++) {
+            fprintf(f, "%s\n  {\"index\": %d, \"pattern\": ", i ? "," : "", i);
+            print_json_string(f, rs->patterns[i]);
+            fprintf(f, ", ");
+            print_stats_row_json(f, &st->rows[i]);
+            fprintf(f, "}");
+        }
+        fprintf(f, "],\n \"scans\": {");
+        print_stats_row_json(f, &st->rows[st->n]);
+        fprintf(f, "}}\n");
+    } else {
+        fprintf(f, "%-8s %12s %12s %8s %8s %8s %8s %10s  %s\n", "index", "evals", "matches",
+                "mean ns", "p50 ns", "p90 ns", "p99 ns", "max ns", "pattern");
+        for (int i = 0; i <= st->n; i++) {
+            const struct PatternStats *r = &st->rows[i];
+            char idx[16];
+            snprintf(idx, sizeof(idx), i < st->n ? "%d" : "scan", i);
+            fprintf(f, "%-8s %12llu %12llu %8llu %8llu %8llu %8llu %10llu  %s\n", idx,
+                    (unsigned long long)r->evals, (unsigned long long)r->matches,
+                    (unsigned long long)(r->samples ? r->total_ns / r->samples : 0),
+                    (unsigned long long)stats_percentile(r, 0.5),
+                    (unsigned long long)stats_percentile(r, 0.9),
+                    (unsigned long long)stats_percentile(r, 0.99),
+                    (unsigned long long)r->max_ns, i < st->n ? rs->patterns[i] : "");
+        }
+    }
+    pthread_mutex_unlock(&st->lock);
+    fflush(f);
+}
+
+/* Per-thread matching state: everything a lookup writes besides its result. */
+struct Scratch {
+    struct LazyDfa lazy;
+    struct ReqScratch req;
+    struct PikeScratch pike;
+    regex_t *regexs;        /* private copies; glibc locks each regex_t in regexec */
+    int regcomp_cnt;
+    uint8_t *regex_ready;   /* as in RuleSet, for a mapped rule set */
+    struct Stats *shared;   /* NULL when not instrumented */
+    struct PatternStats *stats;
+    int *dirty;             /* rows of stats touched since the last flush */
+    int ndirty;
+    int record;             /* count lookups; off for reference passes */
+    unsigned pending;       /* lookups since the last flush */
+    struct ResultCache *cache;  /* shared with the other threads, or NULL */
+    struct CacheCounters cache_counts;
+};
+
+/* Folds this thread's counters into the shared totals. */
+void scratch_flush_stats(struct Scratch *sc) {
+    if (!sc->shared) return;
+    pthread_mutex_lock(&sc->shared->lock);
+    for (int k = 0; k < sc->ndirty; k++)
+        stats_add(&sc->shared->rows[sc->dirty[k]], &sc->stats[sc->dirty[k]]);
+    pthread_mutex_unlock(&sc->shared->lock);
+    for (int k = 0; k < sc->ndirty; k++)
+        memset(&sc->stats[sc->dirty[k]], 0, sizeof(struct PatternStats));
+    sc->ndirty = 0;
+    sc->pending = 0;
+}
+
+/* Turns counting on or off, for lookups that should not show up in the
+ * stats such as a regexec reference pass. */
+void scratch_record(struct Scratch **scs, int nthreads, int on) {
+    for (int t = 0; t < nthreads; t++)
+        scs[t]->record = on && scs[t]->shared;
+}
+
+static inline struct PatternStats *scratch_row(struct Scratch *sc, int i) {
+    struct PatternStats *r = &sc->stats[i];
+    if (!r->evals && !r->matches) sc->dirty[sc->ndirty++] = i;
+    return r;
+}
+
+void free_scratch(struct Scratch *sc) {
+    if (!sc) return;
+    free_lazy_dfa(&sc->lazy);
+    free_req_scratch(&sc->req);
+    free_pike_scratch(&sc->pike);
+    free(sc->stats);
+    free(sc->dirty);
+    if (sc->regexs) free_regexes(sc->regexs, sc->regex_ready, sc->regcomp_cnt);
+    free(sc->regex_ready);
+    free(sc);
+}
+
+/* private_regex gives the scratch its own compiled regexes, for threads
+ * that must not contend on the rule set's.  With stats, lookups are
+ * counted and flushed into it. */
+struct Scratch *new_scratch(const struct RuleSet *rs, int cache_states, int private_regex,
+                            struct Stats *stats) {
+    struct Scratch *sc = (struct Scratch *)calloc(1, sizeof(struct Scratch));
+    check_mem(sc);
+    if (init_lazy_dfa(&sc->lazy, &rs->nfa, cache_states)) goto error;
+    if (init_req_scratch(&sc->req, &rs->req, rs->n)) goto error;
+    if (init_pike_scratch(&sc->pike, rs->cap_states, rs->cap_slots)) goto error;
+    if (stats) {
+        sc->stats = (struct PatternStats *)calloc(rs->n + 1, sizeof(struct PatternStats));
+        sc->dirty = (int *)malloc(sizeof(int) * (rs->n + 1));
+        check_mem(sc->stats && sc->dirty);
+        sc->shared = stats;
+        sc->record = 1;
+    }
+    if (private_regex && rs->regex_ready) {
+        /* the same ones up front as the rule set, the rest on first use */
+        sc->regexs = (regex_t *)malloc(sizeof(regex_t) * (rs->n ? rs->n : 1));
+        sc->regex_ready = (uint8_t *)calloc(rs->n ? rs->n : 1, 1);
+        check_mem(sc->regexs && sc->regex_ready);
+        sc->regcomp_cnt = rs->n;
+        for (int i = 0; i < rs->n; i++) {
+            if (!__atomic_load_n(&rs->regex_ready[i], __ATOMIC_ACQUIRE)) continue;
+            if (regcomp(&sc->regexs[i], rs->patterns[i], REG_EXTENDED | REG_NOSUB)) goto error;
+            sc->regex_ready[i] = 1;
+        }
+    } else if (private_regex) {
+        sc->regexs = (regex_t *)malloc(sizeof(regex_t) * (rs->n ? rs->n : 1));
+        check_mem(sc->regexs);
+        for (; sc->regcomp_cnt < rs->n; sc->regcomp_cnt++)
+            if (regcomp(&sc->regexs[sc->regcomp_cnt], rs->patterns[sc->regcomp_cnt],
+                        REG_EXTENDED | REG_NOSUB)) goto error;
+    }
+    return sc;
+error:
+    free_scratch(sc);
+    return NULL;
+}
+
+/* Pattern i's regex_t, from sc's private copies if it has them.  A mapped
+ * rule set compiles most of its patterns on first use, the shared copies
+ * under regex_lock; NULL if that fails. */
+static const regex_t *rule_regex(const struct RuleSet *rs, struct Scratch *sc, int i) {
+    if (sc && sc->regexs) {
+        if (sc->regex_ready && !sc->regex_ready[i]) {
+            if (regcomp(&sc->regexs[i], rs->patterns[i], REG_EXTENDED | REG_NOSUB)) return NULL;
+            sc->regex_ready[i] = 1;
+        }
+        return &sc->regexs[i];
+    }
+    if (rs->regex_ready && !__atomic_load_n(&rs->regex_ready[i], __ATOMIC_ACQUIRE)) {
+        pthread_mutex_t *lock = (pthread_mutex_t *)&rs->regex_lock;
+        int failed = 0;
+        pthread_mutex_lock(lock);
+        if (!rs->regex_ready[i]) {
+            failed = regcomp(&rs->regexs[i], rs->patterns[i], REG_EXTENDED | REG_NOSUB) != 0;
+            if (!failed) __atomic_store_n(&rs->regex_ready[i], 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(lock);
+        if (failed) return NULL;
+    }
+    return &rs->regexs[i];
+}
+
+/* Whether regexec finds pattern i in s[0..len). */
+static inline int rule_regexec(const struct RuleSet *rs, struct Scratch *sc, int i,
+                               const char *s, size_t len) {
+    const regex_t *re = rule_regex(rs, sc, i);
+    return re && regexec_len(re, s, len) == 0;
+}
+
+#ifdef RULES_GEN
+#include "rules_gen.h"          /* written by `regex gen`; see Generated matchers */
+#else
+#define RULES_GEN_HASH 0
+#define RULES_GEN_PATTERNS -1
+static void rules_gen_match(const unsigned char *p, const unsigned char *end, uint64_t *out,
+                            int stop) {
+    (void)p;
+    (void)end;
+    (void)out;
+    (void)stop;
+}
+#endif
+
+/* Whether the generated matcher was built from rs's patterns. */
+static inline int gen_usable(const struct RuleSet *rs) {
+    return rs->has_dfa && rs->n == RULES_GEN_PATTERNS && rs->source_hash == RULES_GEN_HASH;
+}
+
+/* Keeps only the lowest pattern in the match set m. */
+static inline void keep_lowest(uint64_t *m, int nwords) {
+    int w = 0;
+    while (w < nwords && !m[w]) w++;
+    if (w == nwords) return;
+    m[w] &= -m[w];
+    for (w++; w < nwords; w++) m[w] = 0;
+}
+
+/* Whether got is a right answer in mode for a name whose full match set,
+ * from a MODE_ALL lookup, is all. */
+int mode_agrees(int mode, const uint64_t *got, const uint64_t *all, int nwords) {
+    uint64_t first[nwords ? nwords : 1];
+    int bits = 0, inside = 1, none = 1;
+
+    if (mode == MODE_ALL) return !memcmp(got, all, sizeof(uint64_t) * nwords);
+    if (mode == MODE_FIRST) {
+        memcpy(first, all, sizeof(uint64_t) * nwords);
+        keep_lowest(first, nwords);
+        return !memcmp(got, first, sizeof(uint64_t) * nwords);
+    }
+    for (int w = 0; w < nwords; w++) {
+        bits += __builtin_popcountll(got[w]);
+        inside &= !(got[w] & ~all[w]);
+        none &= !all[w];
+    }
+    return none ? bits == 0 : bits == 1 && inside;
+}
+
+/* Writes the set of patterns matching s[0..len) to out (rs->nwords words)
+ * and returns how many patterns went through a per-pattern engine.
+ * Patterns the automaton could not take are run through their per-pattern
+ * engine, after the prefix trie and the required literals have ruled out
+ * the ones the name cannot match.  A name found in the scratch's result
+ * cache runs nothing; regexec, the reference, never uses the cache.
+ *
+ * In MODE_FIRST out holds only the lowest matching pattern, and in
+ * MODE_ANY only one matching pattern.  Both stop the automaton early and
+ * run the per-pattern engines in index order until one matches, skipping
+ * the rules an analysis of the rule set found redundant in that mode. */
+int ruleset_match(const struct RuleSet *rs, int engine, int mode, struct Scratch *sc,
+                  const char *s, size_t len, uint64_t *out) {
+    uint64_t cand[rs->nwords ? rs->nwords : 1];
+    int record = sc && sc->record;
+    int timed = record && (sc->pending & (STATS_SAMPLE - 1)) == 0;
+    struct Segments sg;
+    int evals = 0, split = 0;
+    int cached = sc && sc->cache && sc->cache->mode == mode && engine != ENGINE_REGEXEC;
+    uint64_t t0 = 0, hash = 0;
+
+    if (cached) {
+        if (len > CACHE_KEY) {
+            sc->cache_counts.bypassed++;
+            cached = 0;
+        } else {
+            hash = name_hash(s, len);
+            if (cache_lookup(sc->cache, &sc->cache_counts, hash, s, len, out)) goto done;
+        }
+    }
+    memset(out, 0, sizeof(uint64_t) * rs->nwords);
+    if (engine == ENGINE_REGEXEC) {
+        for (int i = 0; i < rs->n; i++) {
+            if (timed) t0 = now_ns();
+            int hit = rule_regexec(rs, sc, i, s, len);
+            if (hit) bit_set(out, i);
+            if (record) scratch_row(sc, i)->evals++;
+            if (timed) stats_record(&sc->stats[i], now_ns() - t0);
+            evals++;
+            if (hit && mode != MODE_ALL) break;
+        }
+        goto done;
+    }
+
+    trie_candidates(&rs->trie, s, len, cand);
+    if (engine == ENGINE_GEN && !gen_usable(rs)) engine = ENGINE_DFA;
+    if (engine == ENGINE_JIT && !rs->jit.fn) engine = ENGINE_DFA;
+    if (engine == ENGINE_DFA && !rs->has_dfa) engine = ENGINE_LAZY;
+    if (engine != ENGINE_PREFILTER) {
+        int stop = mode == MODE_ANY;
+        if (timed) t0 = now_ns();
+        if (engine == ENGINE_GEN)
+            rules_gen_match((const unsigned char *)s, (const unsigned char *)s + len, out, stop);
+        else if (engine == ENGINE_JIT)
+            rs->jit.fn((const uint8_t *)s, (const uint8_t *)s + len, out, stop);
+        else if (engine == ENGINE_DFA && mode == MODE_FIRST)
+            dfa_match_first(&rs->dfa, rs->first_live, s, len, out);
+        else if (engine == ENGINE_DFA && stop)
+            dfa_match_any(&rs->dfa, s, len, out);
+        else if (engine == ENGINE_DFA)
+            dfa_match(&rs->dfa, s, len, out);
+        else
+            lazy_match(&sc->lazy, s, len, stop, out);
+        if (record) scratch_row(sc, rs->n)->evals++;
+        if (timed) stats_record(&sc->stats[rs->n], now_ns() - t0);
+        for (int i = 0; i < rs->n; i++)
+            if (rs->nfa.start[i] >= 0) cand[i >> 6] &= ~(1ULL << (i & 63));
+    }
+    if (mode != MODE_ALL) {
+        /* only a pattern below the lowest found can change the answer */
+        int w = 0;
+        while (w < rs->nwords && !out[w]) w++;
+        if (w < rs->nwords) {
+            if (mode == MODE_ANY) goto found;
+            cand[w] &= (out[w] & -out[w]) - 1;
+            for (w++; w < rs->nwords; w++) cand[w] = 0;
+        }
+        if (rs->skip)
+            for (w = 0; w < rs->nwords; w++) cand[w] &= ~rs->skip[(size_t)mode * rs->nwords + w];
+    }
+    if (sc) req_candidates(&rs->req, &sc->req, rs->n, s, len, cand);
+    for (int w = 0; w < rs->nwords; w++) {
+        for (uint64_t m = cand[w]; m; m &= m - 1) {
+            int i = w * 64 + __builtin_ctzll(m), hit;
+            evals++;
+            if (timed) t0 = now_ns();
+            if (rs->segs[i].nstates && !split)
+                split = split_segments(s, len, &sg) ? -1 : 1;
+            if (rs->builtin_gen && i >= rs->builtin_from)
+                hit = builtin_match(i - rs->builtin_from, s, len);
+            else if (rs->glus[i].npos)
+                hit = glu_match(&rs->glus[i], s, len);
+            else if (rs->segs[i].nstates && split > 0)
+                hit = seg_match(&rs->segs[i], s, &sg);
+            else
+                hit = rule_regexec(rs, sc, i, s, len);
+            if (hit) bit_set(out, i);
+            if (record) scratch_row(sc, i)->evals++;
+            if (timed) stats_record(&sc->stats[i], now_ns() - t0);
+            if (hit && mode != MODE_ALL) goto found;
+        }
+    }
+
+found:
+    if (mode != MODE_ALL) keep_lowest(out, rs->nwords);
+    if (cached) cache_insert(sc->cache, &sc->cache_counts, hash, s, len, out);
+
+done:
+    if (record) {
+        for (int w = 0; w < rs->nwords; w++)
+            for (uint64_t m = out[w]; m; m &= m - 1)
+                scratch_row(sc, w * 64 + __builtin_ctzll(m))->matches++;
+        if (++sc->pending >= STATS_FLUSH_EVERY) scratch_flush_stats(sc);
+    }
+    return evals;
+}
+
+/* Submatches of pattern pat in s[0..len), as regexec would report them with
+ * pm[0..nmatch) and offsets relative to s.  Returns 0 or REG_NOMATCH. */
+int capture_match(const struct RuleSet *rs, int pat, struct Scratch *sc,
+                  const char *s, size_t len, regmatch_t *pm, size_t nmatch) {
+    const struct CapProg *cp = &rs->caps[pat];
+    regmatch_t whole[1];
+
+    if (!cp->has_re) return pike_match(cp, &sc->pike, s, len, pm, nmatch);
+    if (nmatch == 0) {
+        pm = whole;
+        nmatch = 1;
+    }
+    pm[0].rm_so = 0;
+    pm[0].rm_eo = len;
+    return regexec(&cp->re, s, nmatch, pm, REG_STARTEND);
+}
+
+#define FNV_BASIS 0xcbf29ce484222325ULL
+
+uint64_t fnv1a(uint64_t h, const void *p, size_t n) {
+    const unsigned char *s = (const unsigned char *)p;
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ s[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+/* Identifies a pattern file for compiled images. */
+uint64_t source_hash(const struct Line *lines, size_t n) {
+    uint64_t h = FNV_BASIS;
+    for (size_t i = 0; i < n; i++) {
+        h = fnv1a(h, lines[i].ptr, lines[i].len);
+        h = fnv1a(h, "\n", 1);
+    }
+    return h;
+}
+
+/* The pattern lines of lf, followed by the built-in rules if builtins is
+ * set, in a new array of *n lines. */
+struct Line *pattern_lines(const struct LineFile *lf, int builtins, int *n) {
+    struct Line *lines = (struct Line *)malloc(sizeof(struct Line) * (lf->n + BUILTIN_COUNT + 1));
+    check_mem(lines);
+    memcpy(lines, lf->lines, sizeof(struct Line) * lf->n);
+    *n = lf->n;
+    for (int k = 0; builtins && k < BUILTIN_COUNT; k++) {
+        lines[*n].ptr = builtin_patterns[k];
+        lines[(*n)++].len = strlen(builtin_patterns[k]);
+    }
+    return lines;
+error:
+    return NULL;
+}
+
+struct RuleSet *load_ruleset(const char *filepath, int builtins) {
+    struct LineFile lf;
+    struct RuleSet *rs = NULL;
+    struct Line *lines;
+    int n;
+
+    if (map_lines(filepath, &lf)) return NULL;
+    lines = pattern_lines(&lf, builtins, &n);
+    if (lines) rs = compile_ruleset(lines, n, n - lf.n);
+    if (rs) rs->source_hash = source_hash(lines, n);
+    free(lines);
+    unmap_lines(&lf);
+    return rs;
+}
+
+/* Prints how the compiler handled each pattern. */
+void describe_ruleset(const struct RuleSet *rs, FILE *f) {
+    for (int i = 0; i < rs->n; i++) {
+        fprintf(f, "pattern %d: %s engine=%s dfa=%s prefix=", i, rs->patterns[i],
+                rs->builtin_gen && i >= rs->builtin_from ? "builtin"
+                : rs->glus[i].npos ? "glushkov" : rs->segs[i].nstates ? "segment" : "regexec",
+                rs->has_dfa && rs->nfa.start[i] >= 0 ? "yes" : "no");
+        if (rs->prefix_lens[i])
+            fprintf(f, "\"%.*s\"", rs->prefix_lens[i], rs->prefixes[i]);
+        else
+            fprintf(f, "none");
+        fprintf(f, " required=%s", rs->req.nreq[i] ? "" : "none");
+        for (int c = 0, any = 0; c < rs->req.nclauses; c++) {
+            if (rs->req.clause_pat[c] != i) continue;
+            int first = rs->req.clause_off[c], last = rs->req.clause_off[c + 1];
+            fprintf(f, "%s%s", any++ ? "&" : "", last - first > 1 ? "(" : "");
+            for (int k = first; k < last; k++)
+                fprintf(f, "%s\"%s\"", k > first ? "|" : "", rs->req.lit_str[rs->req.clause_lits[k]]);
+            fprintf(f, "%s", last - first > 1 ? ")" : "");
+        }
+        fprintf(f, "\n");
+    }
+    if (rs->has_dfa)
+        fprintf(f, "dfa: %d states, %d byte classes, %s\n", rs->dfa.nstates, rs->dfa.ncls,
+                rs->jit.fn ? "compiled to x86-64" : "interpreted only");
+    if (gen_usable(rs))
+        fprintf(f, "dfa: generated matcher compiled in\n");
+    if (rs->image)
+        fprintf(f, "mapped from a compiled image of %zu bytes\n", rs->image_size);
+    fprintf(f, "prefix trie: %d nodes\n", rs->trie.nnodes);
+    fprintf(f, "required literals: %d in %d clauses, %d states, %d byte classes\n",
+            rs->req.nlits, rs->req.nclauses, rs->req.nstates, rs->req.ncls);
+    fprintf(f, "literal kernels: %s, required literals by %s\n", simd_names[simd_level],
+            simd_level == SIMD_SCALAR ? "automaton"
+            : rs->req.nlits <= REQ_FIND_LITS ? "substring search"
+            : rs->req.teddy.nlits ? "teddy" : "automaton");
+    if (rs->skip) {
+        int skip[MODE_COUNT] = {0};
+        for (int md = 0; md < MODE_COUNT; md++)
+            for (int w = 0; w < rs->nwords; w++)
+                skip[md] += __builtin_popcountll(rs->skip[(size_t)md * rs->nwords + w]);
+        fprintf(f, "pruned: %d rules skipped in first-match mode, %d in any-match mode\n",
+                skip[MODE_FIRST], skip[MODE_ANY]);
+    }
+}
+
+/* Parallel batch matching --------------------------------------------------
+ *
+ * A batch is cut into one contiguous slice per thread.  Each thread has its
+ * own scratch and writes only its slice of the result array, so results
+ * come back in input order with nothing shared in the hot path.
+ */
+
+#define MAX_THREADS 256
+
+struct BatchWorker {
+    pthread_t tid;
+    const struct RuleSet *rs;
+    int engine, mode;
+    struct Scratch *sc;
+    const char *blob;
+    const size_t *off;
+    size_t begin, end;
+    uint64_t *results;      /* rs->nwords words per name, whole batch */
+    long evals;
+};
+
+void *batch_worker(void *arg) {
+    struct BatchWorker *w = (struct BatchWorker *)arg;
+    for (size_t i = w->begin; i < w->end; i++)
+        w->evals += ruleset_match(w->rs, w->engine, w->mode, w->sc, w->blob + w->off[i],
+                                  w->off[i + 1] - w->off[i], w->results + i * w->rs->nwords);
+    return NULL;
+}
+
+/* Matches the n names packed in blob, name i being blob[off[i], off[i + 1]),
+ * using one thread per scratch in scs[0..nthreads); the calling thread
+ * takes the first slice.  Returns the number of
+ * per-pattern evaluations, or -1 if a thread could not be started. */
+long batch_match(const struct RuleSet *rs, int engine, int mode, struct Scratch **scs,
+                 int nthreads, const char *blob, const size_t *off, size_t n, uint64_t *results) {
+    struct BatchWorker w[MAX_THREADS];
+    long evals = 0;
+    int started = 1, rc = 0;
+
+    if (nthreads > (int)n) nthreads = n ? n : 1;
+    for (int t = 0; t < nthreads; t++) {
+        w[t].rs = rs;
+        w[t].engine = engine;
+        w[t].mode = mode;
+        w[t].sc = scs[t];
+        w[t].blob = blob;
+        w[t].off = off;
+        w[t].begin = n * t / nthreads;
+        w[t].end = n * (t + 1) / nthreads;
+        w[t].results = results;
+        w[t].evals = 0;
+    }
+    for (; started < nthreads; started++) {
+        if ((rc = pthread_create(&w[started].tid, NULL, batch_worker, &w[started])) != 0) {
+            errno = rc;
+            log_err("Could not start worker thread");
+            break;
+        }
+    }
+    batch_worker(&w[0]);
+    for (int t = 1; t < started; t++)
+        pthread_join(w[t].tid, NULL);
+    for (int t = 0; t < started; t++)
+        evals += w[t].evals;
+    return rc ? -1 : evals;
+}
+
+/* Command line ------------------------------------------------------------ */
+
+struct Options {
+    int engine;
+    int verbose;
+    int cache_states;
+    int nthreads;
+    int drop;               /* stream: drop matching lines instead of passing them */
+    int stats;              /* 0 off, 1 text, 2 JSON */
+    struct Stats *shared_stats;
+    long result_cache_mb;   /* -C: result cache size, 0 for none */
+    struct ResultCache *shared_cache;
+    int annotate;           /* stream: pass every line with its match set */
+    int extract;            /* submatch offsets instead of pattern indices */
+    const char *pattern_path;
+    const char *test_path;
+    const char *input_path; /* stream input, "-" for stdin */
+    const char *kernel;     /* literal search level, NULL for the best */
+    const char *image_path; /* compiled rule set, or NULL */
+    int watch;              /* stream, serve: reload when the pattern file changes */
+    int listen_port;        /* serve, load */
+    int forward_port;       /* serve, statsd: upstream, 0 to only count */
+    int udp;                /* load: statsd datagrams instead of Graphite lines */
+    int builtins;           /* append the built-in rules to the file's */
+    int engine_mask;        /* bench: engines given with -e, 0 for all */
+    int mode;               /* -M: what a lookup reports, an enum Mode */
+    int mode_mask;          /* bench: modes given with -M, 0 for all */
+    int prune;              /* skip rules the analysis finds redundant in -M's mode */
+    long bench_names;
+    int bench_hosts;
+    int bench_services;
+    int bench_depth;
+    double hit_ratio;
+    unsigned long long seed;
+};
+
+void print_lazy_stats(struct Scratch **scs, int nthreads, FILE *f) {
+    unsigned long long hits = 0, misses = 0, flushes = 0, nfa_searches = 0;
+    for (int t = 0; t < nthreads; t++) {
+        hits += scs[t]->lazy.hits;
+        misses += scs[t]->lazy.misses;
+        flushes += scs[t]->lazy.flushes;
+        nfa_searches += scs[t]->lazy.nfa_searches;
+    }
+    fprintf(f, "lazy dfa: %d states per thread, %llu hits, %llu misses, "
+            "%llu flushes, %llu nfa searches\n",
+            scs[0]->lazy.d.max_states, hits, misses, flushes, nfa_searches);
+}
+
+void print_cache_stats(const struct ResultCache *c, struct Scratch **scs, int nthreads, FILE *f) {
+    struct CacheCounters k = {0};
+    for (int t = 0; t < nthreads; t++) {
+        k.hits += scs[t]->cache_counts.hits;
+        k.misses += scs[t]->cache_counts.misses;
+        k.evictions += scs[t]->cache_counts.evictions;
+        k.bypassed += scs[t]->cache_counts.bypassed;
+    }
+    unsigned long long lookups = k.hits + k.misses + k.bypassed;
+    fprintf(f, "result cache: %zu entries in %.1f MB, %llu hits, %llu misses, %llu bypassed, "
+            "%.1f%% hit ratio, %llu evictions\n",
+            c->nsets * CACHE_WAYS, c->nsets * CACHE_WAYS * c->stride / 1048576.0,
+            k.hits, k.misses, k.bypassed, lookups ? 100.0 * k.hits / lookups : 0.0, k.evictions);
+}
+
+/* Checks every engine result against test.txt and regexec. */
+int cmd_test(const struct RuleSet *rs, struct Scratch **scs, const struct Options *o) {
+    int reti;
+    int retcode = 1;
+    char msgbuf[100];
+
+    int t_size = 0;
+    long evals = 0;
+    struct LineFile test_file = {0};
+    struct Arena arena = {0};
+    struct TestBatch tb = {0};
+    uint64_t *got = NULL, *want = NULL;
+    regex_t *subs = NULL;   /* -x: regexec reference with submatches */
+    int nsubs = 0;
+    regmatch_t *pm = NULL, *ref = NULL;
+
+    /* Read test cases */
+    if (map_lines(o->test_path, &test_file)) goto error;
+    t_size = test_file.n;
+
+    if (parse_test_cases(test_file.lines, t_size, &tb, &arena)) goto error;
+    for (int i=0; i < t_size; i++)
+        check(tb.regex_idx[i] >= 0 && tb.regex_idx[i] < rs->n,
+              "Test case %d names unknown regex %d", i + 1, tb.regex_idx[i]);
+
+    got = (uint64_t *)malloc(sizeof(uint64_t) * rs->nwords * (t_size ? t_size : 1));
+    want = (uint64_t *)malloc(sizeof(uint64_t) * rs->nwords * (t_size ? t_size : 1));
+    check_mem(got && want);
+    if (o->extract) {
+        subs = (regex_t *)malloc(sizeof(regex_t) * (rs->n ? rs->n : 1));
+        pm = (regmatch_t *)malloc(sizeof(regmatch_t) * (rs->cap_slots / 2 + 1));
+        ref = (regmatch_t *)malloc(sizeof(regmatch_t) * (rs->cap_slots / 2 + 1));
+        check_mem(subs && pm && ref);
+        for (; nsubs < rs->n; nsubs++)
+            check(regcomp(&subs[nsubs], rs->patterns[nsubs], REG_EXTENDED) == 0,
+                  "Could not compile regex: %s", rs->patterns[nsubs]);
+    }
+
+    /* Execute regular expressions; every engine must agree with regexec on
+     * the full set of matching patterns, not just the one under test */
+    evals = batch_match(rs, o->engine, o->mode, scs, o->nthreads, tb.blob, tb.off, t_size, got);
+    scratch_record(scs, o->nthreads, 0);
+    check(evals >= 0 && batch_match(rs, ENGINE_REGEXEC, MODE_ALL, scs, o->nthreads, tb.blob,
+                                    tb.off, t_size, want) >= 0,
+          "Batch match failed");
+    scratch_record(scs, o->nthreads, 1);
+    for (int i=0; i < t_size; i++) {
+        int idx = tb.regex_idx[i], expect = bit_test(tb.expect, i);
+        const char *str = tb.blob + tb.off[i];
+        size_t len = tb.off[i + 1] - tb.off[i];
+        const uint64_t *g = got + (size_t)i * rs->nwords, *w = want + (size_t)i * rs->nwords;
+        char *state;
+        /* in first- and any-match modes the result need not name idx, so
+         * the expectation is checked on regexec's set and the result
+         * against that */
+        reti = bit_test(o->mode == MODE_ALL ? g : w, idx) ? 0 : REG_NOMATCH;
+        regerror(reti, rule_regex(rs, NULL, idx), msgbuf, sizeof(msgbuf));
+        if (((expect && reti == 0) || (!expect && reti)) &&
+            mode_agrees(o->mode, g, w, rs->nwords)) {
+            state = "Success";
+        } else {
+            state = "Failed";
+        }
+
+        /* submatches must agree with regexec's */
+        size_t nmatch = rs->caps[idx].nmatch;
+        if (o->extract && reti == 0) {
+            ref[0].rm_so = 0;
+            ref[0].rm_eo = len;
+            if (capture_match(rs, idx, scs[0], str, len, pm, nmatch) ||
+                regexec(&subs[idx], str, nmatch, ref, REG_STARTEND) ||
+                memcmp(pm, ref, sizeof(regmatch_t) * nmatch))
+                state = "Failed";
+        }
+        fprintf(stderr, "[%s] regex %d %.*s: %s\n",
+                state, idx, (int)len, str, msgbuf);
+        if (o->extract && reti == 0) {
+            fprintf(stderr, "    submatches:");
+            for (size_t k = 0; k < nmatch; k++)
+                fprintf(stderr, " %.*s", pm[k].rm_so < 0 ? 1 : (int)(pm[k].rm_eo - pm[k].rm_so),
+                        pm[k].rm_so < 0 ? "-" : str + pm[k].rm_so);
+            fprintf(stderr, "\n");
+        }
+    }
+    if (o->verbose) {
+        fprintf(stderr, "%ld of %ld per-pattern evaluations run\n",
+                evals, (long)t_size * rs->n);
+        print_lazy_stats(scs, o->nthreads, stderr);
+        if (o->shared_cache) print_cache_stats(o->shared_cache, scs, o->nthreads, stderr);
+    }
+    retcode = 0;
+
+error:
+    for (int i = 0; i < nsubs; i++)
+        regfree(&subs[i]);
+    free(subs);
+    free(pm);
+    free(ref);
+    free(got);
+    free(want);
+    free_arena(&arena);
+    unmap_lines(&test_file);
+    return retcode;
+}
+
+/* Compiled rule-set images ---------------------------------------------------
+ *
+ * `compile` writes the compiled rule set to one file in two regions, each
+ * block 64-byte aligned.  The data region holds the tables, which have no
+ * pointers in them: automata, Glushkov masks, strings.  The struct region
+ * holds the RuleSet and the per-pattern struct arrays, whose pointer fields
+ * are stored as offsets, listed in a relocation table; an offset with
+ * IMAGE_STRUCT set is into the struct region, else into the file.  Loading
+ * maps the file read-only and uses the tables in place, so their pages
+ * stay clean and shared.  Only the struct region, a small part of the
+ * file, is copied to the heap and has its offsets resolved against the
+ * copy or the mapping.  The header carries a hash of the pattern lines,
+ * and an image built from other patterns (or by a build with another
+ * struct layout) is rejected, so the caller compiles from source instead.
+ * regex_t is opaque to us and is still built with regcomp: at load for
+ * the rules no other per-pattern engine takes, on first use for the rest.
+ */
+
+#define IMAGE_MAGIC "RULESET"
+#define IMAGE_VERSION 2
+#define IMAGE_ALIGN 64
+#define IMAGE_STRUCT (1ULL << 63)   /* offset into the struct region */
+
+struct ImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+    uint64_t layout;        /* hash of the struct sizes this build writes */
+    uint64_t size;          /* of the whole file */
+    uint64_t source_hash;   /* of the pattern lines */
+    uint64_t structs;       /* offset of the struct region, which starts with the RuleSet */
+    uint64_t structs_size;
+    uint64_t relocs;        /* offset of the relocation table */
+    uint64_t nrelocs;
+};
+
+struct ImageBuf {
+    char *buf;
+    size_t len, cap;
+};
+
+struct ImageWriter {
+    struct ImageBuf data, structs;
+    uint64_t *relocs;       /* struct region offsets of pointer fields */
+    size_t nrelocs, reloccap;
+    int failed;
+};
+
+/* Also tells apart builds that run the built-in rules' generated matchers,
+ * since their images leave those rules out of the automata. */
+uint64_t image_layout(void) {
+    size_t sizes[] = {
+        (size_t)builtins_generated(),
+        sizeof(void *), sizeof(struct RuleSet), sizeof(struct Ast), sizeof(struct Node),
+        sizeof(struct SegProg), sizeof(struct SegState), sizeof(struct SegTest),
+        sizeof(struct SegRun), sizeof(struct Glushkov), sizeof(struct CapProg),
+        sizeof(struct Nfa), sizeof(struct NState), sizeof(struct Dfa),
+        sizeof(struct PrefixTrie), sizeof(struct ReqFilter), sizeof(struct Teddy),
+    };
+    return fnv1a(FNV_BASIS, sizes, sizeof(sizes));
+}
+
+/* Appends n bytes to b and returns their offset; -1 if out of memory. */
+int64_t img_append(struct ImageBuf *b, const void *p, size_t n) {
+    size_t off = (b->len + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+
+    if (off + n > b->cap) {
+        size_t new_cap = b->cap ? b->cap : 1 << 16;
+        while (new_cap < off + n)
+            new_cap *= 2;
+        char *tmp = (char *)realloc(b->buf, new_cap);
+        check_mem(tmp);
+        b->buf = tmp;
+        b->cap = new_cap;
+    }
+    memset(b->buf + b->len, 0, off - b->len);
+    memcpy(b->buf + off, p, n);
+    b->len = off + n;
+    return off;
+error:
+    return -1;
+}
+
+/* Appends a table of n bytes to the data region and returns its offset,
+ * or 0 for nothing. */
+uint64_t img_put(struct ImageWriter *w, const void *p, size_t n) {
+    if (!p || n == 0 || w->failed) return 0;
+    int64_t off = img_append(&w->data, p, n);
+    if (off < 0) w->failed = 1;
+    return off < 0 ? 0 : (uint64_t)off;
+}
+
+/* Appends n bytes holding pointer fields to the struct region and returns
+ * their tagged offset, or 0 for nothing. */
+uint64_t img_block(struct ImageWriter *w, const void *p, size_t n) {
+    if (!p || n == 0 || w->failed) return 0;
+    int64_t off = img_append(&w->structs, p, n);
+    if (off < 0) w->failed = 1;
+    return off < 0 ? 0 : IMAGE_STRUCT | (uint64_t)off;
+}
+
+/* Where the block at offset at was written. */
+char *img_at(struct ImageWriter *w, uint64_t at) {
+    return at & IMAGE_STRUCT ? w->structs.buf + (at & ~IMAGE_STRUCT) : w->data.buf + at;
+}
+
+/* Points the pointer field at offset at, in a block, to offset target
+ * (0 for NULL). */
+void img_link(struct ImageWriter *w, uint64_t at, uint64_t target) {
+    if (w->failed) return;
+    memcpy(img_at(w, at), &target, sizeof(target));
+    if (!target) return;
+    if (w->nrelocs == w->reloccap) {
+        size_t new_cap = w->reloccap ? w->reloccap * 2 : 1024;
+        uint64_t *tmp = (uint64_t *)realloc(w->relocs, sizeof(uint64_t) * new_cap);
+        check_mem(tmp);
+        w->relocs = tmp;
+        w->reloccap = new_cap;
+    }
+    w->relocs[w->nrelocs++] = at & ~IMAGE_STRUCT;
+    return;
+error:
+    w->failed = 1;
+}
+
+#define img_field(w, at, type, field, p, n) \
+    img_link((w), (at) + offsetof(type, field), img_put((w), (p), (n)))
+#define img_null(w, at, type, field) img_link((w), (at) + offsetof(type, field), 0)
+
+void img_strings(struct ImageWriter *w, uint64_t at, char *const *v, int n) {
+    uint64_t arr = img_block(w, v, sizeof(char *) * n);
+    img_link(w, at, arr);
+    for (int i = 0; arr && i < n; i++)
+        img_link(w, arr + sizeof(char *) * i, v[i] ? img_put(w, v[i], strlen(v[i]) + 1) : 0);
+}
+
+void img_nfa(struct ImageWriter *w, uint64_t at, const struct Nfa *nfa) {
+    img_field(w, at, struct Nfa, states, nfa->states, sizeof(struct NState) * nfa->n);
+    img_field(w, at, struct Nfa, sets, nfa->sets, sizeof(struct CharSet) * nfa->nsets);
+    img_field(w, at, struct Nfa, start, nfa->start, sizeof(int) * nfa->npat);
+}
+
+/* Only the tables dfa_match reads; construction state is dropped. */
+void img_dfa(struct ImageWriter *w, uint64_t at, const struct Dfa *d) {
+    img_field(w, at, struct Dfa, trans, d->trans, sizeof(int32_t) * d->nstates * d->ncls);
+    img_field(w, at, struct Dfa, acc, d->acc, sizeof(int32_t) * d->nstates);
+    img_field(w, at, struct Dfa, eoi, d->eoi, sizeof(int32_t) * d->nstates);
+    img_field(w, at, struct Dfa, accpool, d->accpool, sizeof(uint64_t) * d->naccpool);
+    img_null(w, at, struct Dfa, key_off);
+    img_null(w, at, struct Dfa, key_len);
+    img_null(w, at, struct Dfa, keys);
+    img_null(w, at, struct Dfa, htab);
+    img_null(w, at, struct Dfa, restart);
+    img_null(w, at, struct Dfa, start_key);
+    img_null(w, at, struct Dfa, ns.mark);
+    img_null(w, at, struct Dfa, ns.stack);
+    img_null(w, at, struct Dfa, ns.buf);
+}
+
+void img_trie(struct ImageWriter *w, uint64_t at, const struct PrefixTrie *t, int npat) {
+    img_field(w, at, struct PrefixTrie, child, t->child, sizeof(int32_t) * t->nnodes);
+    img_field(w, at, struct PrefixTrie, sibling, t->sibling, sizeof(int32_t) * t->nnodes);
+    img_field(w, at, struct PrefixTrie, byte, t->byte, t->nnodes);
+    img_field(w, at, struct PrefixTrie, term, t->term, sizeof(int32_t) * t->nnodes);
+    img_field(w, at, struct PrefixTrie, term_next, t->term_next, sizeof(int32_t) * npat);
+    img_field(w, at, struct PrefixTrie, always, t->always, sizeof(uint64_t) * t->nwords);
+}
+
+void img_req(struct ImageWriter *w, uint64_t at, const struct ReqFilter *f, int npat) {
+    img_field(w, at, struct ReqFilter, delta, f->delta, sizeof(int32_t) * f->nstates * f->ncls);
+    img_field(w, at, struct ReqFilter, lit, f->lit, sizeof(int32_t) * f->nstates);
+    img_field(w, at, struct ReqFilter, dict, f->dict, sizeof(int32_t) * f->nstates);
+    img_field(w, at, struct ReqFilter, out, f->out, sizeof(int32_t) * f->nstates);
+    img_null(w, at, struct ReqFilter, child);
+    img_null(w, at, struct ReqFilter, sibling);
+    img_null(w, at, struct ReqFilter, byte);
+    img_strings(w, at + offsetof(struct ReqFilter, lit_str), f->lit_str, f->nlits);
+    img_field(w, at, struct ReqFilter, lit_len, f->lit_len, sizeof(int) * f->nlits);
+    img_field(w, at, struct ReqFilter, lit_off, f->lit_off, sizeof(int32_t) * (f->nlits + 1));
+    img_field(w, at, struct ReqFilter, lit_clauses, f->lit_clauses,
+              sizeof(int32_t) * (f->lit_off ? f->lit_off[f->nlits] : 0));
+    img_field(w, at, struct ReqFilter, clause_pat, f->clause_pat, sizeof(int32_t) * f->nclauses);
+    img_field(w, at, struct ReqFilter, clause_off, f->clause_off, sizeof(int32_t) * (f->nclauses + 1));
+    img_field(w, at, struct ReqFilter, clause_lits, f->clause_lits,
+              sizeof(int32_t) * (f->clause_off ? f->clause_off[f->nclauses] : 0));
+    img_field(w, at, struct ReqFilter, nreq, f->nreq, sizeof(int) * npat);
+    img_field(w, at, struct ReqFilter, unfiltered, f->unfiltered, sizeof(uint64_t) * f->nwords);
+    /* Teddy borrows the literal arrays written above */
+    if (w->failed) return;
+    uint64_t lit_str, lit_len;
+    memcpy(&lit_str, img_at(w, at + offsetof(struct ReqFilter, lit_str)), sizeof(lit_str));
+    memcpy(&lit_len, img_at(w, at + offsetof(struct ReqFilter, lit_len)), sizeof(lit_len));
+    img_link(w, at + offsetof(struct ReqFilter, teddy.lit), f->teddy.nlits ? lit_str : 0);
+    img_link(w, at + offsetof(struct ReqFilter, teddy.len), f->teddy.nlits ? lit_len : 0);
+}
+
+/* Lays rs out in w, the RuleSet first in the struct region. */
+void img_ruleset(struct ImageWriter *w, const struct RuleSet *rs) {
+    uint64_t at = img_block(w, rs, sizeof(*rs)), arr;
+    int n = rs->n;
+
+    if (w->failed) return;
+    img_strings(w, at + offsetof(struct RuleSet, patterns), rs->patterns, n);
+    img_null(w, at, struct RuleSet, regexs);
+    img_null(w, at, struct RuleSet, regex_ready);
+    img_null(w, at, struct RuleSet, image);
+    img_null(w, at, struct RuleSet, first_live);
+    img_null(w, at, struct RuleSet, skip);
+    memset(img_at(w, at + offsetof(struct RuleSet, arena)), 0, sizeof(struct Arena));
+    memset(img_at(w, at + offsetof(struct RuleSet, jit)), 0, sizeof(struct DfaJit));
+    memset(img_at(w, at + offsetof(struct RuleSet, regex_lock)), 0, sizeof(pthread_mutex_t));
+    memset(img_at(w, at + offsetof(struct RuleSet, regcomp_cnt)), 0, sizeof(int));
+    memset(img_at(w, at + offsetof(struct RuleSet, image_size)), 0, sizeof(size_t));
+
+    arr = img_block(w, rs->asts, sizeof(struct Ast) * n);
+    img_link(w, at + offsetof(struct RuleSet, asts), arr);
+    for (int i = 0; arr && i < n; i++)
+        img_field(w, arr + sizeof(struct Ast) * i, struct Ast, nodes,
+                  rs->asts[i].nodes, sizeof(struct Node) * rs->asts[i].n);
+
+    arr = img_block(w, rs->segs, sizeof(struct SegProg) * n);
+    img_link(w, at + offsetof(struct RuleSet, segs), arr);
+    for (int i = 0; arr && i < n; i++) {
+        const struct SegProg *g = &rs->segs[i];
+        uint64_t gat = arr + sizeof(struct SegProg) * i;
+        img_field(w, gat, struct SegProg, states, g->states, sizeof(struct SegState) * g->nstates);
+        img_field(w, gat, struct SegProg, closure, g->closure, sizeof(uint64_t) * g->nstates * SEG_WORDS);
+        img_field(w, gat, struct SegProg, tests, g->tests, sizeof(struct SegTest) * g->ntests);
+        img_field(w, gat, struct SegProg, runs, g->runs, sizeof(struct SegRun) * g->nruns);
+    }
+
+    arr = img_block(w, rs->glus, sizeof(struct Glushkov) * n);
+    img_link(w, at + offsetof(struct RuleSet, glus), arr);
+    for (int i = 0; arr && i < n; i++) {
+        const struct Glushkov *g = &rs->glus[i];
+        uint64_t gat = arr + sizeof(struct Glushkov) * i;
+        img_field(w, gat, struct Glushkov, accept, g->npos ? g->accept : NULL,
+                  sizeof(uint64_t) * 256 * g->nwords);
+        img_field(w, gat, struct Glushkov, tab, g->npos && g->nchunks ? g->tab : NULL,
+                  sizeof(uint64_t) * 256 * g->nwords * g->nchunks);
+    }
+
+    img_strings(w, at + offsetof(struct RuleSet, prefixes), rs->prefixes, n);
+    img_field(w, at, struct RuleSet, prefix_lens, rs->prefix_lens, sizeof(int) * n);
+    img_trie(w, at + offsetof(struct RuleSet, trie), &rs->trie, n);
+    img_req(w, at + offsetof(struct RuleSet, req), &rs->req, n);
+    img_nfa(w, at + offsetof(struct RuleSet, nfa), &rs->nfa);
+    img_dfa(w, at + offsetof(struct RuleSet, dfa), &rs->dfa);
+
+    arr = img_block(w, rs->caps, sizeof(struct CapProg) * n);
+    img_link(w, at + offsetof(struct RuleSet, caps), arr);
+    for (int i = 0; arr && i < n; i++) {
+        uint64_t cat = arr + sizeof(struct CapProg) * i;
+        img_nfa(w, cat + offsetof(struct CapProg, nfa), &rs->caps[i].nfa);
+        if (!w->failed) memset(img_at(w, cat + offsetof(struct CapProg, re)), 0, sizeof(regex_t));
+    }
+}
+
+/* Writes rs to path through a temporary file, so readers never see half
+ * an image. */
+int save_ruleset(const struct RuleSet *rs, const char *path) {
+    struct ImageWriter w = {0};
+    struct ImageHeader h;
+    char tmp[4096];
+    int fd = -1;
+
+    memset(&h, 0, sizeof(h));
+    img_put(&w, &h, sizeof(h));
+    img_ruleset(&w, rs);
+    h.relocs = img_put(&w, w.relocs, sizeof(uint64_t) * w.nrelocs);
+    h.nrelocs = w.nrelocs;
+    h.structs = img_put(&w, w.structs.buf, w.structs.len);
+    h.structs_size = w.structs.len;
+    check(!w.failed, "Could not lay out the rule set");
+    memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+    h.version = IMAGE_VERSION;
+    h.layout = image_layout();
+    h.size = w.data.len;
+    h.source_hash = rs->source_hash;
+    memcpy(w.data.buf, &h, sizeof(h));
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    check(fd >= 0, "File open error: %s", tmp);
+    check(write_all(fd, w.data.buf, w.data.len) == 0, "File write error: %s", tmp);
+    check(close(fd) == 0, "File write error: %s", tmp);
+    fd = -1;
+    check(rename(tmp, path) == 0, "File rename error: %s", path);
+    free(w.data.buf);
+    free(w.structs.buf);
+    free(w.relocs);
+    return 0;
+error:
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmp);
+    }
+    free(w.data.buf);
+    free(w.structs.buf);
+    free(w.relocs);
+    return -1;
+}
+
+/* Whether pattern i goes to regexec on every engine but regexec's own. */
+static int falls_back_to_regexec(const struct RuleSet *rs, int i) {
+    return !(rs->builtin_gen && i >= rs->builtin_from) && rs->nfa.start[i] < 0 &&
+           !rs->glus[i].npos && !rs->segs[i].nstates;
+}
+
+/* Maps the image at path if it was compiled from the patterns in
+ * pattern_path by a build with this layout; NULL otherwise. */
+struct RuleSet *map_ruleset(const char *path, const char *pattern_path, int builtins) {
+    struct ImageHeader h;
+    struct LineFile lf = {0};
+    struct Line *lines = NULL;
+    int n;
+    struct RuleSet *rs = NULL;
+    struct stat st;
+    char *base = NULL, *structs = NULL;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    check(fd >= 0, "File open error: %s", path);
+    check(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(h), "File stat error: %s", path);
+    base = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) base = NULL;
+    check(base, "File map error: %s", path);
+    close(fd);
+    fd = -1;
+
+    memcpy(&h, base, sizeof(h));
+    if (memcmp(h.magic, IMAGE_MAGIC, sizeof(h.magic)) || h.version != IMAGE_VERSION ||
+        h.layout != image_layout() || h.size != (uint64_t)st.st_size ||
+        h.nrelocs > h.size / sizeof(uint64_t) || h.relocs + sizeof(uint64_t) * h.nrelocs > h.size ||
+        h.structs_size < sizeof(*rs) || h.structs_size > h.size || h.structs > h.size - h.structs_size) {
+        fprintf(stderr, "Compiled rule set %s is corrupt or from another build\n", path);
+        goto error;
+    }
+    if (map_lines(pattern_path, &lf)) goto error;
+    lines = pattern_lines(&lf, builtins, &n);
+    if (!lines) goto error;
+    if (h.source_hash != source_hash(lines, n)) {
+        fprintf(stderr, "Compiled rule set %s is stale for %s%s\n", path, pattern_path,
+                builtins ? " and the built-in rules" : "");
+        goto error;
+    }
+    free(lines);
+    lines = NULL;
+    unmap_lines(&lf);
+
+    /* Copy out the structs and point their fields at the copy or the mapping */
+    /* blocks in it are aligned as in the file, Teddy's masks for SIMD loads */
+    if (posix_memalign((void **)&structs, IMAGE_ALIGN, h.structs_size)) structs = NULL;
+    check_mem(structs);
+    memcpy(structs, base + h.structs, h.structs_size);
+    for (uint64_t i = 0; i < h.nrelocs; i++) {
+        uint64_t at, v;
+        memcpy(&at, base + h.relocs + sizeof(uint64_t) * i, sizeof(at));
+        check(at <= h.structs_size - sizeof(v), "Bad relocation in %s", path);
+        memcpy(&v, structs + at, sizeof(v));
+        if (v & IMAGE_STRUCT) {
+            check((v & ~IMAGE_STRUCT) < h.structs_size, "Bad relocation in %s", path);
+            v = (uintptr_t)structs + (v & ~IMAGE_STRUCT);
+        } else {
+            check(v < h.size, "Bad relocation in %s", path);
+            v += (uintptr_t)base;
+        }
+        memcpy(structs + at, &v, sizeof(v));
+    }
+    rs = (struct RuleSet *)structs;
+    structs = NULL;
+    rs->image = base;
+    rs->image_size = h.size;
+    base = NULL;
+
+    /* regcomp up front only what no other per-pattern engine takes */
+    pthread_mutex_init(&rs->regex_lock, NULL);
+    rs->regexs = (regex_t *)malloc(sizeof(regex_t) * (rs->n ? rs->n : 1));
+    rs->regex_ready = (uint8_t *)calloc(rs->n ? rs->n : 1, 1);
+    check_mem(rs->regexs && rs->regex_ready);
+    rs->regcomp_cnt = rs->n;
+    for (int i = 0; i < rs->n; i++) {
+        if (!falls_back_to_regexec(rs, i)) continue;
+        check(regcomp(&rs->regexs[i], rs->patterns[i], REG_EXTENDED | REG_NOSUB) == 0,
+              "Could not compile regex: %s", rs->patterns[i]);
+        rs->regex_ready[i] = 1;
+    }
+    for (int i = 0; i < rs->n; i++) {
+        struct CapProg *cp = &rs->caps[i];
+        if (cp->has_re && regcomp(&cp->re, rs->patterns[i], REG_EXTENDED)) {
+            /* only the ones compiled so far are freed */
+            for (int j = i; j < rs->n; j++)
+                rs->caps[j].has_re = 0;
+            log_err("Could not compile regex: %s", rs->patterns[i]);
+            goto error;
+        }
+    }
+    if (rs->has_dfa) {
+        jit_dfa(&rs->jit, &rs->dfa);
+        rs->first_live = dfa_first_live(&rs->dfa);
+        check_mem(rs->first_live);
+    }
+    return rs;
+
+error:
+    if (fd >= 0) close(fd);
+    free(lines);
+    unmap_lines(&lf);
+    free(structs);
+    if (base) munmap(base, st.st_size);
+    free_ruleset(rs);
+    return NULL;
+}
+
+/* Generated matchers ---------------------------------------------------------
+ *
+ * `gen` prints the combined DFA as a C function, one label per state and a
+ * switch on the next byte, with the hash of the pattern lines it was built
+ * from.  Compiled into this program with -DRULES_GEN it becomes the gen
+ * engine, used only for a rule set whose patterns hash the same; for any
+ * other gen runs the table-driven DFA.
+ */
+
+/* The bytes in [lo, hi] as a case label. */
+void gen_case(FILE *f, int lo, int hi) {
+    if (lo == hi)
+        fprintf(f, "    case 0x%02x:", lo);
+    else
+        fprintf(f, "    case 0x%02x ... 0x%02x:", lo, hi);
+}
+
+void gen_accept(FILE *f, const struct Dfa *d, int32_t off, const char *indent) {
+    for (int w = 0; w < d->nwords; w++)
+        if (d->accpool[off + w])
+            fprintf(f, "%sout[%d] |= 0x%llxULL;\n", indent, w,
+                    (unsigned long long)d->accpool[off + w]);
+}
+
+/* Prints d's states as labels of a function over [p, end).  A multi
+ * pattern function ORs the accepts into out and returns early with stop;
+ * a single pattern one returns 1 at its first accept and 0 once dead. */
+void gen_states(FILE *f, const struct Dfa *d, int single) {
+    fprintf(f, "    goto s%d;\n", d->start);
+    for (int st = 0; st < d->nstates; st++) {
+        const int32_t *row = d->trans + (size_t)st * d->ncls;
+        int best = 0, dflt = -1;
+
+        fprintf(f, "s%d:\n", st);
+        if (d->acc[st] >= 0) {
+            if (single) {
+                fprintf(f, "    return 1;\n");
+                continue;
+            }
+            gen_accept(f, d, d->acc[st], "    ");
+            fprintf(f, "    if (stop) return;\n");
+        }
+        if (st == d->dead) {
+            fprintf(f, single ? "    return 0;\n" : "    return;\n");
+            continue;
+        }
+        if (single) {
+            fprintf(f, "    if (p == end) return %d;\n", d->eoi[st] >= 0);
+        } else if (d->eoi[st] >= 0) {
+            fprintf(f, "    if (p == end) {\n");
+            gen_accept(f, d, d->eoi[st], "        ");
+            fprintf(f, "        return;\n    }\n");
+        } else {
+            fprintf(f, "    if (p == end) return;\n");
+        }
+        for (int c = 0; c < d->ncls; c++) {
+            int bytes = 0;
+            for (int b = 0; b < 256; b++)
+                bytes += row[d->cls[b]] == row[c];
+            if (bytes > best) {
+                best = bytes;
+                dflt = row[c];
+            }
+        }
+        fprintf(f, "    switch (*p++) {\n");
+        for (int b = 0; b < 256; ) {
+            int t = row[d->cls[b]], e = b;
+            while (e + 1 < 256 && row[d->cls[e + 1]] == t) e++;
+            if (t != dflt) {
+                gen_case(f, b, e);
+                fprintf(f, " goto s%d;\n", t);
+            }
+            b = e + 1;
+        }
+        fprintf(f, "    default: goto s%d;\n    }\n", dflt);
+    }
+}
+
+/* Prints pattern as a C string literal. */
+void gen_string(FILE *f, const char *pattern) {
+    fprintf(f, "\"");
+    for (const char *p = pattern; *p; p++)
+        fprintf(f, *p == '"' || *p == '\\' ? "\\%c" : "%c", *p);
+    fprintf(f, "\"");
+}
+
+/* `gen -b`: each built-in rule through a DFA of its own, as a function
+ * named after the rule, and the patterns they were generated from. */
+int gen_builtins(FILE *f) {
+    fprintf(f, "/* Generated by `regex gen -b` from BUILTIN_RULES; do not edit. */\n\n");
+    fprintf(f, "#define BUILTINS_GEN_COUNT %d\n\n", BUILTIN_COUNT);
+    fprintf(f, "static const char *const builtins_gen_patterns[] = {\n");
+    for (int k = 0; k < BUILTIN_COUNT; k++) {
+        fprintf(f, "    ");
+        gen_string(f, builtin_patterns[k]);
+        fprintf(f, ",\n");
+    }
+    fprintf(f, "};\n");
+    for (int k = 0; k < BUILTIN_COUNT; k++) {
+        struct Ast ast;
+        struct Nfa nfa = {0};
+        struct Dfa d = {0};
+        int ok = 0;
+
+        if (parse_pattern(builtin_patterns[k], &ast) == 0) {
+            nfa.npat = 1;
+            nfa.start = (int *)malloc(sizeof(int));
+            ok = nfa.start && nfa_add_pattern(&nfa, &ast, 0) == 0 && dfa_build(&d, &nfa) == 0;
+        }
+        if (ok) {
+            fprintf(f, "\n/* %s, pattern %d: %d states */\n", builtin_names[k], k, d.nstates);
+            fprintf(f, "static int builtin_gen_%s(const unsigned char *p, const unsigned char *end) {\n",
+                    builtin_names[k]);
+            gen_states(f, &d, 1);
+            fprintf(f, "}\n");
+        }
+        free_dfa(&d);
+        free_nfa(&nfa);
+        free_ast(&ast);
+        check(ok, "Could not build a DFA for built-in rule %s", builtin_patterns[k]);
+    }
+    fprintf(f, "\nstatic int builtins_gen_match(int k, const unsigned char *p, const unsigned char *end) {\n"
+               "    switch (k) {\n");
+    for (int k = 0; k < BUILTIN_COUNT; k++)
+        fprintf(f, "    case %d: return builtin_gen_%s(p, end);\n", k, builtin_names[k]);
+    fprintf(f, "    }\n    return 0;\n}\n");
+    return 0;
+error:
+    return -1;
+}
+
+int cmd_gen(const struct RuleSet *rs, const struct Options *o) {
+    const struct Dfa *d = &rs->dfa;
+    FILE *f = stdout;
+
+    if (o->builtins) {
+        check(gen_builtins(f) == 0, "Could not generate the built-in rules");
+        check(fflush(f) == 0 && !ferror(f), "Could not write the generated matchers");
+        return 0;
+    }
+    check(rs->has_dfa, "No combined DFA to generate from %s", o->pattern_path);
+    fprintf(f, "/* Generated by `regex gen` from %s; do not edit.\n", o->pattern_path);
+    for (int i = 0; i < rs->n; i++) {
+        /* a pattern could hold the comment's end */
+        fprintf(f, " * %d: ", i);
+        for (const char *p = rs->patterns[i]; *p; p++)
+            fprintf(f, *p == '/' && p > rs->patterns[i] && p[-1] == '*' ? "\\/" : "%c", *p);
+        fprintf(f, "\n");
+    }
+    fprintf(f, " */\n\n");
+    fprintf(f, "#define RULES_GEN_HASH 0x%llxULL\n", (unsigned long long)rs->source_hash);
+    fprintf(f, "#define RULES_GEN_PATTERNS %d\n\n", rs->n);
+    fprintf(f, "/* ORs the patterns matching [p, end) into out, like dfa_match, or\n"
+               " * with stop those at the first accepting state, like dfa_match_any. */\n");
+    fprintf(f, "static void rules_gen_match(const unsigned char *p, const unsigned char *end,\n"
+               "                            uint64_t *out, int stop) {\n");
+    gen_states(f, d, 0);
+    fprintf(f, "}\n");
+    check(fflush(f) == 0 && !ferror(f), "Could not write the generated matcher");
+    if (o->verbose)
+        fprintf(stderr, "Generated %d states for %d patterns\n", d->nstates, rs->n);
+    return 0;
+error:
+    return 1;
+}
+
+/* Hot reload -----------------------------------------------------------------
+ *
+ * A long-running command matches through a Live rule set.  A reloader
+ * thread waits for SIGHUP (or, with -w, inotify on the pattern file),
+ * compiles the new patterns on its own time and publishes them with one
+ * atomic pointer store.  Readers never block: around each batch a reader
+ * announces the global epoch in its own slot and loads the current
+ * generation.  The reloader retires the old generation at the epoch
+ * following the swap and frees it once every reader slot is idle or
+ * newer.  A generation carries one scratch per reader, built by the
+ * reloader, so readers switch over without allocating.
+ */
+
+#define RELOAD_POLL_MS 100
+
+volatile sig_atomic_t reload_requested;
+
+void on_reload_signal(int sig) {
+    (void)sig;
+    __atomic_store_n(&reload_requested, 1, __ATOMIC_RELAXED);
+}
+
+struct Generation {
+    struct RuleSet *rs;
+    struct Scratch *scs[MAX_THREADS];
+    struct Stats *stats;
+    struct ResultCache *cache;
+    unsigned long id;
+    uint64_t retired;           /* epoch of the swap that replaced it */
+    struct Generation *next;    /* retired list */
+};
+
+struct ReaderSlot {
+    uint64_t epoch;             /* announced while in a batch, 0 when idle */
+    char pad[64 - sizeof(uint64_t)];
+};
+
+struct Live {
+    struct Generation *current;
+    uint64_t epoch;
+    struct ReaderSlot readers[MAX_THREADS];
+    int nreaders;
+    struct Generation *retired;
+    const struct Options *o;
+    pthread_t thread;
+    int started;
+    int stop;
+    int inotify_fd;
+    unsigned long reloads, failures;
+};
+
+void free_generation(struct Generation *g) {
+    if (!g) return;
+    for (int t = 0; t < MAX_THREADS; t++)
+        free_scratch(g->scs[t]);
+    free_stats(g->stats);
+    free_result_cache(g->cache);
+    free_ruleset(g->rs);
+    free(g);
+}
+
+/* Takes ownership of rs; builds scratch for nreaders readers. */
+struct Generation *new_generation(struct RuleSet *rs, int nreaders, const struct Options *o) {
+    struct Generation *g = (struct Generation *)calloc(1, sizeof(struct Generation));
+    if (!g) {
+        free_ruleset(rs);
+        return NULL;
+    }
+    g->rs = rs;
+    if (o->stats) {
+        g->stats = new_stats(rs->n);
+        if (!g->stats) goto error;
+    }
+    if (o->result_cache_mb) {
+        g->cache = new_result_cache(rs->nwords, o->mode, o->result_cache_mb << 20);
+        if (!g->cache) goto error;
+    }
+    for (int t = 0; t < nreaders; t++) {
+        g->scs[t] = new_scratch(rs, o->cache_states, nreaders > 1, g->stats);
+        if (!g->scs[t]) goto error;
+        g->scs[t]->cache = g->cache;
+    }
+    return g;
+error:
+    free_generation(g);
+    return NULL;
+}
+
+/* Pins the current generation for reader t until live_exit. */
+static inline struct Generation *live_enter(struct Live *lv, int t) {
+    uint64_t e = __atomic_load_n(&lv->epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&lv->readers[t].epoch, e, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&lv->current, __ATOMIC_SEQ_CST);
+}
+
+static inline void live_exit(struct Live *lv, int t) {
+    __atomic_store_n(&lv->readers[t].epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Prints and frees the retired generations no reader can still hold. */
+void live_reclaim(struct Live *lv) {
+    uint64_t oldest = UINT64_MAX;
+    struct Generation **pp = &lv->retired;
+
+    for (int t = 0; t < lv->nreaders; t++) {
+        uint64_t e = __atomic_load_n(&lv->readers[t].epoch, __ATOMIC_SEQ_CST);
+        if (e && e < oldest) oldest = e;
+    }
+    while (*pp) {
+        struct Generation *g = *pp;
+        if (g->retired > oldest) {
+            pp = &g->next;
+            continue;
+        }
+        *pp = g->next;
+        if (lv->o->stats) {
+            for (int t = 0; t < lv->nreaders; t++)
+                scratch_flush_stats(g->scs[t]);
+            fprintf(stderr, "stats for rule set generation %lu:\n", g->id);
+            print_stats(g->rs, g->stats, lv->o->stats == 2, stderr);
+        }
+        if (g->cache && lv->o->verbose) {
+            fprintf(stderr, "rule set generation %lu ", g->id);
+            print_cache_stats(g->cache, g->scs, lv->nreaders, stderr);
+        }
+        free_generation(g);
+    }
+}
+
+int prune_ruleset(struct RuleSet *rs);
+
+/* Loads the patterns (through a current image if one is given), and swaps
+ * them in; on failure the old rule set stays. */
+int live_reload(struct Live *lv) {
+    const struct Options *o = lv->o;
+    struct RuleSet *rs = NULL;
+    struct Generation *g, *old;
+    uint64_t t0 = now_ns();
+
+    if (o->image_path) rs = map_ruleset(o->image_path, o->pattern_path, o->builtins);
+    if (!rs) rs = load_ruleset(o->pattern_path, o->builtins);
+    if (rs && o->prune) prune_ruleset(rs);
+    if (!rs || !(g = new_generation(rs, lv->nreaders, o))) {
+        lv->failures++;
+        fprintf(stderr, "Reload of %s failed, keeping rule set generation %lu\n",
+                o->pattern_path, lv->current->id);
+        return -1;
+    }
+    old = lv->current;
+    g->id = old->id + 1;
+    __atomic_store_n(&lv->current, g, __ATOMIC_SEQ_CST);
+    old->retired = __atomic_add_fetch(&lv->epoch, 1, __ATOMIC_SEQ_CST);
+    old->next = lv->retired;
+    lv->retired = old;
+    lv->reloads++;
+    fprintf(stderr, "Reloaded %s: %d patterns, generation %lu, %.1f ms\n",
+            o->pattern_path, rs->n, g->id, (now_ns() - t0) / 1e6);
+    if (o->verbose) describe_ruleset(rs, stderr);
+    return 0;
+}
+
+/* Whether the pattern file changed, judged by inotify events on its
+ * directory, since editors and deploys often replace it by rename. */
+int live_watch_event(struct Live *lv) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char *base = strrchr(lv->o->pattern_path, '/');
+    int changed = 0;
+    ssize_t k;
+
+    base = base ? base + 1 : lv->o->pattern_path;
+    while ((k = read(lv->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + k;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->len && !strcmp(ev->name, base)) changed = 1;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return changed;
+}
+
+void *live_main(void *arg) {
+    struct Live *lv = (struct Live *)arg;
+
+    while (!__atomic_load_n(&lv->stop, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd = {lv->inotify_fd, POLLIN, 0};
+        int changed = 0;
+        if (lv->inotify_fd >= 0) {
+            if (poll(&pfd, 1, RELOAD_POLL_MS) > 0) changed = live_watch_event(lv);
+        } else {
+            poll(NULL, 0, RELOAD_POLL_MS);
+        }
+        if (__atomic_exchange_n(&reload_requested, 0, __ATOMIC_RELAXED))
+            changed = 1;
+        if (changed) live_reload(lv);
+        live_reclaim(lv);
+    }
+    return NULL;
+}
+
+/* Starts serving g to nreaders readers; the Live owns g from then on. */
+int live_start(struct Live *lv, struct Generation *g, int nreaders, const struct Options *o) {
+    struct sigaction sa;
+    sigset_t all, old;
+
+    memset(lv, 0, sizeof(*lv));
+    lv->current = g;
+    lv->epoch = 1;
+    lv->nreaders = nreaders;
+    lv->o = o;
+    lv->inotify_fd = -1;
+    if (o->watch) {
+        char dir[4096] = ".";
+        const char *slash = strrchr(o->pattern_path, '/');
+        if (slash)
+            snprintf(dir, sizeof(dir), "%.*s", (int)(slash - o->pattern_path) + 1,
+                     o->pattern_path);
+        lv->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        check(lv->inotify_fd >= 0, "inotify error");
+        check(inotify_add_watch(lv->inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) >= 0,
+              "inotify error: %s", dir);
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_reload_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &sa, NULL);
+    /* signals go to the readers, whose blocking calls they should interrupt */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    lv->started = pthread_create(&lv->thread, NULL, live_main, lv) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    check(lv->started, "Thread create failed");
+    return 0;
+error:
+    if (lv->inotify_fd >= 0) close(lv->inotify_fd);
+    return -1;
+}
+
+/* Stops reloading and frees every generation but the current one, which
+ * is handed back. */
+struct Generation *live_stop(struct Live *lv) {
+    struct Generation *g;
+
+    if (lv->started) {
+        __atomic_store_n(&lv->stop, 1, __ATOMIC_RELEASE);
+        pthread_join(lv->thread, NULL);
+    }
+    g = lv->current;
+    live_reclaim(lv);
+    if (lv->inotify_fd >= 0) close(lv->inotify_fd);
+    if (lv->o->verbose && lv->started)
+        fprintf(stderr, "reload: %lu reloads, %lu failed, generation %lu\n",
+                lv->reloads, lv->failures, g->id);
+    lv->current = NULL;
+    return g;
+}
+
+/* Runs cmd over a Live rule set that starts from main's rule set, scratch
+ * and stats, and puts the last generation's back in their place. */
+int live_run(int (*cmd)(struct Live *, const struct Options *),
+             struct RuleSet **rs, struct Scratch **scs, struct Options *o) {
+    struct Live lv;
+    struct Generation *g = (struct Generation *)calloc(1, sizeof(struct Generation));
+    int retcode;
+
+    check_mem(g);
+    g->rs = *rs;
+    g->stats = o->shared_stats;
+    g->cache = o->shared_cache;
+    memcpy(g->scs, scs, sizeof(g->scs));
+    if (live_start(&lv, g, o->nthreads, o)) {
+        free(g);
+        return 1;
+    }
+    retcode = cmd(&lv, o);
+    g = live_stop(&lv);
+    *rs = g->rs;
+    o->shared_stats = g->stats;
+    o->shared_cache = g->cache;
+    memcpy(scs, g->scs, sizeof(g->scs));
+    free(g);
+    return retcode;
+error:
+    return 1;
+}
+
+/* Streaming filter ----------------------------------------------------------
+ *
+ * Reads lines from a pipe in large chunks and writes results as each chunk
+ * is processed, in constant memory.  The metric name is the first
+ * space-separated field, so both bare names and Graphite plaintext
+ * ("name value timestamp") work.  Lines longer than the buffer are dropped
+ * and counted.
+ */
+
+#define STREAM_BUF_SIZE (1 << 20)
+
+struct OutBuf {
+    int fd;
+    char *buf;
+    size_t len;
+};
+
+int out_flush(struct OutBuf *ob) {
+    int rc = write_all(ob->fd, ob->buf, ob->len);
+    ob->len = 0;
+    return rc;
+}
+
+int out_put(struct OutBuf *ob, const char *p, size_t n) {
+    if (ob->len + n > STREAM_BUF_SIZE && out_flush(ob)) return -1;
+    if (n > STREAM_BUF_SIZE) return write_all(ob->fd, p, n);
+    memcpy(ob->buf + ob->len, p, n);
+    ob->len += n;
+    return 0;
+}
+
+/* Appends "\t0,2" (or "\t-") for the patterns set in m. */
+int out_put_set(struct OutBuf *ob, const uint64_t *m, int n) {
+    char num[16];
+    int any = 0;
+    if (out_put(ob, "\t", 1)) return -1;
+    for (int i = 0; i < n; i++) {
+        if (!bit_test(m, i)) continue;
+        int k = snprintf(num, sizeof(num), any ? ",%d" : "%d", i);
+        if (out_put(ob, num, k)) return -1;
+        any = 1;
+    }
+    return any ? 0 : out_put(ob, "-", 1);
+}
+
+/* Writes a tab and, for each pattern in m, "index:so-eo,so-eo,..." with the
+ * whole match first and "-" for groups that did not participate. */
+int out_put_captures(struct OutBuf *ob, const struct RuleSet *rs, struct Scratch *sc,
+                     const char *s, size_t len, const uint64_t *m, regmatch_t *pm) {
+    char num[48];
+    int any = 0, k;
+    if (out_put(ob, "\t", 1)) return -1;
+    for (int i = 0; i < rs->n; i++) {
+        if (!bit_test(m, i)) continue;
+        size_t nmatch = rs->caps[i].nmatch;
+        if (capture_match(rs, i, sc, s, len, pm, nmatch)) continue;
+        k = snprintf(num, sizeof(num), any ? " %d:" : "%d:", i);
+        if (out_put(ob, num, k)) return -1;
+        for (size_t g = 0; g < nmatch; g++) {
+            if (pm[g].rm_so < 0)
+                k = snprintf(num, sizeof(num), g ? ",-" : "-");
+            else
+                k = snprintf(num, sizeof(num), g ? ",%d-%d" : "%d-%d",
+                             (int)pm[g].rm_so, (int)pm[g].rm_eo);
+            if (out_put(ob, num, k)) return -1;
+        }
+        any = 1;
+    }
+    return any ? 0 : out_put(ob, "-", 1);
+}
+
+int cmd_stream(struct Live *lv, const struct Options *o) {
+    int fd = 0, retcode = 1, skipping = 0, mwords = 0, mslots = 0;
+    size_t have = 0;
+    unsigned long long lines = 0, passed = 0, overlong = 0;
+    char *in = NULL;
+    struct OutBuf ob = {1, NULL, 0};
+    struct Generation *g;
+    uint64_t *m = NULL;
+    regmatch_t *pm = NULL;
+
+    in = (char *)malloc(STREAM_BUF_SIZE);
+    ob.buf = (char *)malloc(STREAM_BUF_SIZE);
+    check_mem(in && ob.buf);
+    if (strcmp(o->input_path, "-")) {
+        fd = open(o->input_path, O_RDONLY);
+        check(fd >= 0, "File open error: %s", o->input_path);
+    }
+
+    for (;;) {
+        if (__atomic_exchange_n(&stats_dump_requested, 0, __ATOMIC_RELAXED)) {
+            g = live_enter(lv, 0);
+            scratch_flush_stats(g->scs[0]);
+            print_stats(g->rs, g->stats, o->stats == 2, stderr);
+            live_exit(lv, 0);
+        }
+        ssize_t k = read(fd, in + have, STREAM_BUF_SIZE - have);
+        if (k < 0 && errno == EINTR) continue;
+        check(k >= 0, "Read error: %s", o->input_path);
+        if (k == 0 && have > 0 && !skipping) {
+            /* last line without a newline */
+            in[have] = '\n';
+            k = 1;
+        }
+        if (k == 0) break;
+        have += k;
+
+        /* the rule set can change between chunks, never within one */
+        g = live_enter(lv, 0);
+        const struct RuleSet *rs = g->rs;
+        struct Scratch *sc = g->scs[0];
+        if (rs->nwords > mwords || rs->cap_slots / 2 + 1 > mslots) {
+            free(m);
+            free(pm);
+            mwords = rs->nwords;
+            mslots = rs->cap_slots / 2 + 1;
+            m = (uint64_t *)malloc(sizeof(uint64_t) * mwords);
+            pm = (regmatch_t *)malloc(sizeof(regmatch_t) * mslots);
+            check_mem(m && pm);
+        }
+        char *p = in, *end = in + have, *nl;
+        while ((nl = (char *)memchr(p, '\n', end - p)) != NULL) {
+            if (skipping) {
+                skipping = 0;
+                p = nl + 1;
+                continue;
+            }
+            size_t n = 0;
+            while (p + n < nl && p[n] != ' ') n++;
+            lines++;
+            ruleset_match(rs, o->engine, o->mode, sc, p, n, m);
+            int hit = 0;
+            for (int w = 0; w < rs->nwords; w++)
+                hit |= m[w] != 0;
+            if (o->annotate || o->extract) {
+                if (!o->annotate && hit == o->drop) {
+                    p = nl + 1;
+                    continue;
+                }
+                passed += !o->annotate;
+                check(out_put(&ob, p, nl - p) == 0 &&
+                      (o->extract ? out_put_captures(&ob, rs, sc, p, n, m, pm)
+                                  : out_put_set(&ob, m, rs->n)) == 0 &&
+                      out_put(&ob, "\n", 1) == 0, "Write error");
+            } else if (hit != o->drop) {
+                passed++;
+                check(out_put(&ob, p, nl + 1 - p) == 0, "Write error");
+            }
+            p = nl + 1;
+        }
+        live_exit(lv, 0);
+        have = end - p;
+        if (have == STREAM_BUF_SIZE) {
+            /* no newline in a full buffer: drop the line */
+            overlong += !skipping;
+            skipping = 1;
+            have = 0;
+        } else if (have > 0 && skipping) {
+            have = 0;
+        } else if (have > 0) {
+            memmove(in, p, have);
+        }
+        check(out_flush(&ob) == 0, "Write error");
+    }
+    retcode = 0;
+
+error:
+    live_exit(lv, 0);
+    if (ob.buf && ob.len) out_flush(&ob);
+    if (o->verbose)
+        fprintf(stderr, "stream: %llu lines, %llu passed, %llu overlong dropped\n",
+                lines, passed, overlong);
+    if (fd > 0) close(fd);
+    free(in);
+    free(ob.buf);
+    free(m);
+    free(pm);
+    return retcode;
+}
+
+/* Benchmark ------------------------------------------------------------------
+ *
+ * Generates a reproducible set of Graphite/statsd names and times every
+ * engine over it.  Hits are sampled from the patterns themselves; misses
+ * come from common metric layouts and are redrawn if a rule matches them,
+ * so the hit ratio is exact.
+ */
+
+#define MAX_NAME 512
+
+struct Rng {
+    uint64_t s;
+};
+
+static inline uint64_t rng_next(struct Rng *r) {
+    r->s ^= r->s >> 12;
+    r->s ^= r->s << 25;
+    r->s ^= r->s >> 27;
+    return r->s * 2685821657736338717ULL;
+}
+
+static inline uint32_t rng_below(struct Rng *r, uint32_t n) {
+    return n ? (uint32_t)((rng_next(r) >> 32) % n) : 0;
+}
+
+const char *gen_host_prefixes[] = {
+    "sindar", "khand", "web", "db", "cache", "edge", "dae", "worker", "proxy", "kafka",
+};
+const char *gen_services[] = {
+    "http", "ldap", "load", "disk", "ping", "ssh", "mysql", "redis", "nginx", "kafka",
+    "check-dns", "ftp", "icinga", "cluster", "scribe", "memcached", "postgres", "ntp",
+};
+const char *gen_metrics[] = {
+    "value", "rate", "count", "mean", "p99", "sum", "time", "load5", "min_latency",
+    "errors", "bytes_in", "bytes_out", "rta", "pl", "slave_lag",
+};
+
+#define countof(A) ((int)(sizeof(A) / sizeof((A)[0])))
+
+struct NameGen {
+    struct Rng rng;
+    int hosts;              /* distinct host names */
+    int services;           /* distinct service names, at most countof(gen_services) */
+    int depth;              /* up to this many extra trailing segments */
+};
+
+void gen_put(char *buf, int *len, const char *s, int n) {
+    if (*len + n > MAX_NAME - 1) n = MAX_NAME - 1 - *len;
+    memcpy(buf + *len, s, n);
+    *len += n;
+}
+
+void gen_fmt(char *buf, int *len, const char *fmt, const char *s, int n) {
+    char tmp[64];
+    int k = snprintf(tmp, sizeof(tmp), fmt, s, n);
+    gen_put(buf, len, tmp, k < (int)sizeof(tmp) ? k : (int)sizeof(tmp) - 1);
+}
+
+void gen_host(struct NameGen *g, char *buf, int *len) {
+    int h = rng_below(&g->rng, g->hosts);
+    gen_fmt(buf, len, "%s%d", gen_host_prefixes[h % countof(gen_host_prefixes)],
+            h / countof(gen_host_prefixes));
+}
+
+void gen_service(struct NameGen *g, char *buf, int *len) {
+    const char *s = gen_services[rng_below(&g->rng, g->services)];
+    gen_put(buf, len, s, strlen(s));
+}
+
+void gen_tail(struct NameGen *g, char *buf, int *len) {
+    int extra = rng_below(&g->rng, g->depth + 1);
+    for (int i = 0; i < extra; i++) {
+        const char *m = gen_metrics[rng_below(&g->rng, countof(gen_metrics))];
+        if (i) gen_put(buf, len, ".", 1);
+        gen_put(buf, len, m, strlen(m));
+    }
+    if (!extra) gen_put(buf, len, "value", 5);
+}
+
+/* Picks a byte from cs, preferring ones that read like a metric name. */
+int gen_byte(struct NameGen *g, const struct CharSet *cs) {
+    int pick[256], n = 0;
+    if (cs_has(cs, '.') && rng_below(&g->rng, 2)) return '.';
+    for (int c = 0; c < 256; c++)
+        if (cs_has(cs, c) && (isalnum(c) || c == '_' || c == '-')) pick[n++] = c;
+    if (!n)
+        for (int c = 1; c < 256; c++)
+            if (cs_has(cs, c) && isgraph(c)) pick[n++] = c;
+    if (!n)
+        for (int c = 1; c < 256; c++)
+            if (cs_has(cs, c)) pick[n++] = c;
+    return n ? pick[rng_below(&g->rng, n)] : 'x';
+}
+
+/* Appends a random string matched by AST node idx.  `.*` becomes a host or
+ * service name so sampled hits look like real traffic.  Returns 1 if the
+ * sample ended with $. */
+int gen_sample(const struct Ast *ast, int idx, struct NameGen *g, char *buf, int *len) {
+    const struct Node *nd = &ast->nodes[idx];
+    const struct Node *child = nd->left >= 0 ? &ast->nodes[nd->left] : NULL;
+    int eol = 0, k;
+    char c;
+
+    switch (nd->type) {
+    case N_SET:
+        c = gen_byte(g, &nd->set);
+        gen_put(buf, len, &c, 1);
+        return 0;
+    case N_CAT:
+        eol = gen_sample(ast, nd->left, g, buf, len);
+        return gen_sample(ast, nd->right, g, buf, len) | eol;
+    case N_ALT:
+        return gen_sample(ast, rng_below(&g->rng, 2) ? nd->left : nd->right, g, buf, len);
+    case N_GROUP:
+        return gen_sample(ast, nd->left, g, buf, len);
+    case N_EOL:
+        return 1;
+    case N_REPEAT:
+        if (child->type == N_SET && cs_has(&child->set, '.') && nd->max < 0) {
+            if (rng_below(&g->rng, 2)) gen_host(g, buf, len);
+            else gen_service(g, buf, len);
+            return 0;
+        }
+        k = nd->min + rng_below(&g->rng, (nd->max < 0 ? 3 : nd->max - nd->min) + 1);
+        for (int i = 0; i < k; i++)
+            eol |= gen_sample(ast, nd->left, g, buf, len);
+        return eol;
+    }
+    return 0;
+}
+
+/* Common metric layouts that the rules may or may not cover. */
+void gen_miss(struct NameGen *g, char *buf, int *len) {
+    switch (rng_below(&g->rng, 6)) {
+    case 0:
+        gen_put(buf, len, "collectd.", 9);
+        gen_host(g, buf, len);
+        gen_put(buf, len, ".cpu-0.cpu-idle", 15);
+        return;
+    case 1:
+        gen_put(buf, len, "servers.", 8);
+        gen_host(g, buf, len);
+        gen_put(buf, len, ".", 1);
+        gen_service(g, buf, len);
+        break;
+    case 2:
+        gen_put(buf, len, "stats.timers.", 13);
+        gen_service(g, buf, len);
+        break;
+    case 3:
+        gen_put(buf, len, "stats.counters.", 15);
+        gen_service(g, buf, len);
+        gen_put(buf, len, "._scribe.errors.", 16);
+        gen_host(g, buf, len);
+        break;
+    case 4:
+        gen_put(buf, len, "carbon.agents.", 14);
+        gen_host(g, buf, len);
+        gen_put(buf, len, "-a", 2);
+        break;
+    default:
+        gen_put(buf, len, "icinga.", 7);
+        gen_host(g, buf, len);
+        gen_put(buf, len, ".services.", 10);
+        gen_service(g, buf, len);
+        break;
+    }
+    gen_put(buf, len, ".", 1);
+    gen_tail(g, buf, len);
+}
+
+/* Fills names[0..n) with views into *blob.  Returns the number of hits or
+ * -1 on failure. */
+long gen_names(const struct RuleSet *rs, struct Scratch *sc, struct NameGen *g, double hit_ratio,
+               size_t n, struct Line *names, char **blob) {
+    int *sampleable = (int *)malloc(sizeof(int) * (rs->n ? rs->n : 1));
+    uint64_t *m = (uint64_t *)malloc(sizeof(uint64_t) * (rs->nwords ? rs->nwords : 1));
+    char *b = (char *)malloc(n * MAX_NAME + 1);
+    size_t used = 0;
+    long hits = 0;
+    int ns = 0;
+
+    check_mem(sampleable && m && b);
+    for (int i = 0; i < rs->n; i++)
+        if (rs->asts[i].root >= 0) sampleable[ns++] = i;
+
+    for (size_t i = 0; i < n; i++) {
+        int want_hit = ns && rng_below(&g->rng, 1000000) < hit_ratio * 1000000;
+        int len, hit;
+        for (int tries = 0; ; tries++) {
+            len = 0;
+            if (want_hit) {
+                const struct Ast *ast = &rs->asts[sampleable[rng_below(&g->rng, ns)]];
+                if (!gen_sample(ast, ast->root, g, b + used, &len)) {
+                    gen_put(b + used, &len, ".", 1);
+                    gen_tail(g, b + used, &len);
+                }
+            } else {
+                gen_miss(g, b + used, &len);
+            }
+            ruleset_match(rs, ENGINE_REGEXEC, MODE_ALL, sc, b + used, len, m);
+            hit = 0;
+            for (int w = 0; w < rs->nwords; w++)
+                hit |= m[w] != 0;
+            /* the layouts above may hit a broad rule; redraw a few times */
+            if (hit == want_hit || tries == 16) break;
+        }
+        names[i].ptr = b + used;
+        names[i].len = len;
+        used += len;
+        hits += hit;
+    }
+    /* views were taken into b, which is not reallocated */
+    *blob = b;
+    free(sampleable);
+    free(m);
+    return hits;
+error:
+    free(sampleable);
+    free(m);
+    free(b);
+    return -1;
+}
+
+int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Times submatch extraction against regexec for every (name, matching
+ * pattern) pair.  Returns the number of disagreements or -1. */
+long bench_captures(const struct RuleSet *rs, struct Scratch *sc, const struct Line *names,
+                    size_t n, const uint64_t *want) {
+    regex_t *subs = (regex_t *)malloc(sizeof(regex_t) * (rs->n ? rs->n : 1));
+    regmatch_t *pm = (regmatch_t *)malloc(sizeof(regmatch_t) * (rs->cap_slots / 2 + 1));
+    regmatch_t *ref = (regmatch_t *)malloc(sizeof(regmatch_t) * (rs->cap_slots / 2 + 1));
+    uint64_t pike_ns = 0, regexec_ns = 0;
+    long pairs = 0, differ = -1;
+    int nsubs = 0;
+
+    check_mem(subs && pm && ref);
+    for (; nsubs < rs->n; nsubs++)
+        check(regcomp(&subs[nsubs], rs->patterns[nsubs], REG_EXTENDED) == 0,
+              "Could not compile regex: %s", rs->patterns[nsubs]);
+    differ = 0;
+    for (size_t i = 0; i < n; i++) {
+        const uint64_t *m = want + i * rs->nwords;
+        for (int p = 0; p < rs->n; p++) {
+            if (!bit_test(m, p)) continue;
+            size_t nmatch = rs->caps[p].nmatch;
+            uint64_t t0 = now_ns();
+            int r1 = capture_match(rs, p, sc, names[i].ptr, names[i].len, pm, nmatch);
+            uint64_t t1 = now_ns();
+            ref[0].rm_so = 0;
+            ref[0].rm_eo = names[i].len;
+            int r2 = regexec(&subs[p], names[i].ptr, nmatch, ref, REG_STARTEND);
+            uint64_t t2 = now_ns();
+            pike_ns += t1 - t0;
+            regexec_ns += t2 - t1;
+            pairs++;
+            differ += r1 != r2 || (!r1 && memcmp(pm, ref, sizeof(regmatch_t) * nmatch));
+        }
+    }
+    printf("submatches: %ld matches, %.0f ns each (regexec %.0f ns), %ld differ from regexec\n",
+           pairs, pairs ? (double)pike_ns / pairs : 0, pairs ? (double)regexec_ns / pairs : 0, differ);
+
+error:
+    for (int i = 0; i < nsubs; i++)
+        regfree(&subs[i]);
+    free(subs);
+    free(pm);
+    free(ref);
+    return differ;
+}
+
+/* Heap allocations so far, or -1 unless built with -DCOUNT_ALLOCS. */
+long heap_alloc_count(void) {
+#ifdef COUNT_ALLOCS
+    return (long)__atomic_load_n(&heap_allocs, __ATOMIC_RELAXED);
+#else
+    return -1;
+#endif
+}
+
+void print_load(const char *what, size_t n, uint64_t ns, const struct Arena *a, long allocs) {
+    printf("load: %zu %s in %.2f ms, %d arena block%s of %.1f KB", n, what, ns / 1e6,
+           a->blocks, a->blocks == 1 ? "" : "s", a->bytes / 1e3);
+    if (allocs >= 0)
+        printf(", %ld heap allocations\n", allocs);
+    else
+        printf(", heap allocations not counted (build with -DCOUNT_ALLOCS)\n");
+}
+
+/* Times a fresh load of the pattern and test files, the phases whose data
+ * lives in arenas. */
+int bench_load(const struct Options *o) {
+    struct LineFile lf = {0};
+    struct Arena arena = {0};
+    struct TestBatch tb;
+    struct RuleSet *rs;
+    long a0 = heap_alloc_count();
+    uint64_t t0 = now_ns();
+
+    rs = load_ruleset(o->pattern_path, o->builtins);
+    if (!rs) return -1;
+    print_load("patterns", rs->n, now_ns() - t0, &rs->arena,
+               a0 >= 0 ? heap_alloc_count() - a0 : -1);
+    free_ruleset(rs);
+    if (access(o->test_path, R_OK)) return 0;
+
+    a0 = heap_alloc_count();
+    t0 = now_ns();
+    if (map_lines(o->test_path, &lf)) return -1;
+    if (parse_test_cases(lf.lines, lf.n, &tb, &arena)) {
+        unmap_lines(&lf);
+        return -1;
+    }
+    print_load("test cases", lf.n, now_ns() - t0, &arena, a0 >= 0 ? heap_alloc_count() - a0 : -1);
+    free_arena(&arena);
+    unmap_lines(&lf);
+    return 0;
+}
+
+/* The generator the bench options describe. */
+struct NameGen name_gen(const struct Options *o) {
+    struct NameGen g = {{o->seed * 0x9E3779B97F4A7C15ULL + 1}, o->bench_hosts,
+                        o->bench_services, o->bench_depth};
+
+    if (g.services < 1 || g.services > countof(gen_services)) g.services = countof(gen_services);
+    if (g.hosts < 1) g.hosts = 1;
+    return g;
+}
+
+/* The -e engine behind the result cache: one pass over the names from an
+ * empty cache, then one that finds every name it kept. */
+int bench_cache(const struct RuleSet *rs, struct Scratch **scs, const struct Options *o,
+                const char *blob, const size_t *off, size_t n, const uint64_t *want,
+                uint64_t *got) {
+    clear_result_cache(o->shared_cache);
+    for (int t = 0; t < o->nthreads; t++) {
+        scs[t]->cache = o->shared_cache;
+        memset(&scs[t]->cache_counts, 0, sizeof(struct CacheCounters));
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t t0 = now_ns();
+        if (batch_match(rs, o->engine, o->mode, scs, o->nthreads, blob, off, n, got) < 0)
+            return -1;
+        double secs = (now_ns() - t0) / 1e9;
+        long mismatches = 0;
+        for (size_t i = 0; i < n; i++)
+            mismatches += !mode_agrees(o->mode, got + i * rs->nwords, want + i * rs->nwords,
+                                       rs->nwords);
+        printf("%s+cache, %s mode, %s pass: %.0f names/s, %.1f MB/s, %ld mismatches\n",
+               engine_names[o->engine], mode_names[o->mode], pass ? "second" : "first",
+               secs > 0 ? n / secs : 0,
+               secs > 0 ? off[n] / secs / 1e6 : 0, mismatches);
+    }
+    print_cache_stats(o->shared_cache, scs, o->nthreads, stdout);
+    return 0;
+}
+
+int cmd_bench(const struct RuleSet *rs, struct Scratch **scs, const struct Options *o) {
+    int retcode = 1;
+    size_t n = o->bench_names, bytes = 0;
+    struct Line *names = NULL;
+    char *blob = NULL;
+    size_t *off = NULL;
+    uint64_t *want = NULL, *got = NULL;
+    uint32_t *lat = NULL;
+    struct NameGen g = name_gen(o);
+
+    names = (struct Line *)malloc(sizeof(struct Line) * (n ? n : 1));
+    off = (size_t *)malloc(sizeof(size_t) * (n + 1));
+    want = (uint64_t *)malloc(sizeof(uint64_t) * rs->nwords * (n ? n : 1));
+    got = (uint64_t *)malloc(sizeof(uint64_t) * rs->nwords * (n ? n : 1));
+    lat = (uint32_t *)malloc(sizeof(uint32_t) * (n ? n : 1));
+    check_mem(names && off && want && got && lat);
+    if (bench_load(o)) goto error;
+    /* engines are timed without the result cache; it gets its own passes */
+    for (int t = 0; t < o->nthreads; t++)
+        scs[t]->cache = NULL;
+
+    scratch_record(scs, o->nthreads, 0);
+    long hits = gen_names(rs, scs[0], &g, o->hit_ratio, n, names, &blob);
+    if (hits < 0) goto error;
+    /* gen_names packs the names end to end in blob */
+    for (size_t i = 0; i < n; i++) {
+        off[i] = names[i].ptr - blob;
+        bytes += names[i].len;
+    }
+    off[n] = bytes;
+    check(batch_match(rs, ENGINE_REGEXEC, MODE_ALL, scs, o->nthreads, blob, off, n, want) >= 0,
+          "Batch match failed");
+    scratch_record(scs, o->nthreads, 1);
+
+    /* clock_gettime's own cost, subtracted from every latency sample */
+    uint64_t overhead = UINT64_MAX;
+    for (int i = 0; i < 1000; i++) {
+        uint64_t t0 = now_ns(), t1 = now_ns();
+        if (t1 - t0 < overhead) overhead = t1 - t0;
+    }
+
+    printf("bench: %zu names, %.2f MB, hit ratio %.3f (target %.3f), seed %llu, %d thread%s\n",
+           n, bytes / 1e6, n ? (double)hits / n : 0.0, o->hit_ratio,
+           (unsigned long long)o->seed, o->nthreads, o->nthreads > 1 ? "s" : "");
+    printf("%-10s %-6s %12s %9s %8s %8s %8s %9s %10s %10s\n", "engine", "mode", "names/s",
+           "MB/s", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "evals/name", "mismatches");
+
+    for (int e = 0; e < ENGINE_COUNT; e++) {
+        if (o->engine_mask && !(o->engine_mask & (1 << e))) continue;
+        for (int md = 0; md < MODE_COUNT; md++) {
+            if (o->mode_mask && !(o->mode_mask & (1 << md))) continue;
+
+            /* warm caches, then time the whole batch */
+            batch_match(rs, e, md, scs, o->nthreads, blob, off, n < 1000 ? n : 1000, got);
+            uint64_t t0 = now_ns();
+            long evals = batch_match(rs, e, md, scs, o->nthreads, blob, off, n, got);
+            uint64_t elapsed = now_ns() - t0;
+            check(evals >= 0, "Batch match failed");
+
+            long mismatches = 0;
+            for (size_t i = 0; i < n; i++)
+                mismatches += !mode_agrees(md, got + i * rs->nwords, want + i * rs->nwords,
+                                           rs->nwords);
+
+            /* per-name latency on one thread */
+            for (size_t i = 0; i < n; i++) {
+                uint64_t a = now_ns();
+                ruleset_match(rs, e, md, scs[0], names[i].ptr, names[i].len, got);
+                uint64_t d = now_ns() - a;
+                lat[i] = d > overhead ? d - overhead : 0;
+            }
+            qsort(lat, n, sizeof(uint32_t), cmp_u32);
+
+            double secs = elapsed / 1e9;
+            printf("%-10s %-6s %12.0f %9.1f %8u %8u %8u %9u %10.2f %10ld\n", engine_names[e],
+                   mode_names[md], secs > 0 ? n / secs : 0, secs > 0 ? bytes / secs / 1e6 : 0,
+                   n ? lat[n / 2] : 0, n ? lat[n * 9 / 10] : 0, n ? lat[n * 99 / 100] : 0,
+                   n ? lat[n * 999 / 1000] : 0, n ? (double)evals / n : 0, mismatches);
+        }
+    }
+    if (o->shared_cache && bench_cache(rs, scs, o, blob, off, n, want, got) < 0) goto error;
+    if (o->extract && bench_captures(rs, scs[0], names, n, want) < 0) goto error;
+    retcode = 0;
+
+error:
+    free(names);
+    free(blob);
+    free(off);
+    free(want);
+    free(got);
+    free(lat);
+    return retcode;
+}
+
+/* Graphite relay -------------------------------------------------------------
+ *
+ * serve listens for Graphite plaintext ("name value timestamp") on
+ * 127.0.0.1 and forwards the lines the rule set passes to another local
+ * port, or only counts them.  Each of the -j event loops has its own epoll
+ * set, scratch and upstream connection and waits on the one listener with
+ * EPOLLEXCLUSIVE, so the loops share nothing but the listener and the Live
+ * rule set.  Names are matched in place in
+ * the connection's receive buffer.
+ */
+
+#define RELAY_BUF_SIZE (64 << 10)
+#define RELAY_EVENTS 64
+#define RELAY_READS 16          /* reads per ready connection per wakeup */
+#define DEFAULT_PORT 2003
+
+volatile sig_atomic_t serve_stop;
+
+void on_stop_signal(int sig) {
+    (void)sig;
+    __atomic_store_n(&serve_stop, 1, __ATOMIC_RELAXED);
+}
+
+struct RelayConn {
+    int fd;
+    int skipping;           /* inside a line longer than the buffer */
+    size_t have;
+    struct RelayConn *prev, *next;
+    char buf[RELAY_BUF_SIZE];
+};
+
+/* Totals over all loops.  A busy period runs from the first connection
+ * opened to the last one closed. */
+struct RelayTotals {
+    int open;
+    uint64_t start_ns;
+    unsigned long long lines, passed, bytes, overlong;
+    unsigned long long mark;    /* lines before the current period */
+};
+
+struct RelayLoop {
+    struct Live *lv;
+    const struct Options *o;
+    struct RelayTotals *tot;
+    int t, lfd, epfd;
+    struct OutBuf ob;           /* to the upstream; fd -1 without one */
+    struct RelayConn *conns;
+    uint64_t *m;
+    int mwords;
+    unsigned long long lines, passed, bytes, overlong;
+    pthread_t thread;
+    int failed;
+};
+
+/* A socket of type (SOCK_STREAM or SOCK_DGRAM) listening on 127.0.0.1:port,
+ * or connected to it. */
+int relay_socket(int type, int port, int listening) {
+    struct sockaddr_in sa;
+    int one = 1, fd = socket(AF_INET, type | SOCK_CLOEXEC, 0);
+
+    check(fd >= 0, "Socket error");
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listening && type == SOCK_DGRAM) {
+        check(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0, "Bind error: port %d", port);
+    } else if (listening) {
+        check(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == 0, "Socket error");
+        check(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0, "Bind error: port %d", port);
+        check(listen(fd, 1024) == 0, "Listen error: port %d", port);
+        check(fcntl(fd, F_SETFL, O_NONBLOCK) == 0, "Socket error");
+    } else {
+        check(connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0, "Connect error: port %d", port);
+    }
+    return fd;
+error:
+    if (fd >= 0) close(fd);
+    return -1;
+}
+
+/* Folds the loop's counters into the totals. */
+void relay_count(struct RelayLoop *w) {
+    __atomic_add_fetch(&w->tot->lines, w->lines, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&w->tot->passed, w->passed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&w->tot->bytes, w->bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&w->tot->overlong, w->overlong, __ATOMIC_RELAXED);
+    w->lines = w->passed = w->bytes = w->overlong = 0;
+}
+
+void relay_accept(struct RelayLoop *w) {
+    for (;;) {
+        int fd = accept(w->lfd, NULL, NULL);
+        if (fd < 0) return;
+        struct RelayConn *c = (struct RelayConn *)malloc(sizeof(struct RelayConn));
+        struct epoll_event ev = {EPOLLIN, {c}};
+        if (!c || fcntl(fd, F_SETFL, O_NONBLOCK) || epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        c->fd = fd;
+        c->skipping = 0;
+        c->have = 0;
+        c->prev = NULL;
+        c->next = w->conns;
+        if (w->conns) w->conns->prev = c;
+        w->conns = c;
+        if (__atomic_fetch_add(&w->tot->open, 1, __ATOMIC_SEQ_CST) == 0)
+            __atomic_store_n(&w->tot->start_ns, now_ns(), __ATOMIC_SEQ_CST);
+    }
+}
+
+void relay_close(struct RelayLoop *w, struct RelayConn *c) {
+    struct RelayTotals *tot = w->tot;
+
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->prev) c->prev->next = c->next;
+    else w->conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    free(c);
+    relay_count(w);
+    if (__atomic_sub_fetch(&tot->open, 1, __ATOMIC_SEQ_CST) == 0 && w->o->verbose) {
+        unsigned long long lines = __atomic_load_n(&tot->lines, __ATOMIC_SEQ_CST);
+        double secs = (now_ns() - __atomic_load_n(&tot->start_ns, __ATOMIC_SEQ_CST)) / 1e9;
+        unsigned long long n = lines - __atomic_exchange_n(&tot->mark, lines, __ATOMIC_SEQ_CST);
+        fprintf(stderr, "serve: %llu lines in %.2f s, %.0f lines/s\n", n, secs,
+                secs > 0 ? n / secs : 0);
+    }
+}
+
+/* Matches and forwards the complete lines in c's buffer and keeps the
+ * partial last one. */
+int relay_lines(struct RelayLoop *w, struct RelayConn *c, const struct RuleSet *rs,
+                struct Scratch *sc) {
+    char *p = c->buf, *end = c->buf + c->have, *nl;
+
+    while ((nl = (char *)memchr(p, '\n', end - p)) != NULL) {
+        if (c->skipping) {
+            c->skipping = 0;
+            p = nl + 1;
+            continue;
+        }
+        size_t n = 0;
+        while (p + n < nl && p[n] != ' ') n++;
+        ruleset_match(rs, w->o->engine, w->o->mode, sc, p, n, w->m);
+        int hit = 0;
+        for (int k = 0; k < rs->nwords; k++)
+            hit |= w->m[k] != 0;
+        w->lines++;
+        if (hit != w->o->drop) {
+            w->passed++;
+            if (w->ob.fd >= 0 && out_put(&w->ob, p, nl + 1 - p)) return -1;
+        }
+        p = nl + 1;
+    }
+    c->have = end - p;
+    if (c->have == RELAY_BUF_SIZE) {
+        w->overlong += !c->skipping;
+        c->skipping = 1;
+        c->have = 0;
+    } else if (c->have > 0 && c->skipping) {
+        c->have = 0;
+    } else if (c->have > 0) {
+        memmove(c->buf, p, c->have);
+    }
+    return 0;
+}
+
+/* Reads what c has pending.  Returns 1 once the peer is gone, -1 if the
+ * upstream failed. */
+int relay_read(struct RelayLoop *w, struct RelayConn *c, const struct RuleSet *rs,
+               struct Scratch *sc) {
+    for (int r = 0; r < RELAY_READS; r++) {
+        ssize_t k = read(c->fd, c->buf + c->have, RELAY_BUF_SIZE - c->have);
+        if (k < 0 && errno == EINTR) continue;
+        if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (k <= 0) return 1;
+        w->bytes += k;
+        c->have += k;
+        if (relay_lines(w, c, rs, sc)) return -1;
+    }
+    return 0;
+}
+
+void *relay_main(void *arg) {
+    struct RelayLoop *w = (struct RelayLoop *)arg;
+    struct epoll_event ev[RELAY_EVENTS];
+    struct Generation *g;
+
+    while (!__atomic_load_n(&serve_stop, __ATOMIC_RELAXED)) {
+        int k = epoll_wait(w->epfd, ev, RELAY_EVENTS, RELOAD_POLL_MS);
+        if (k < 0 && errno == EINTR) k = 0;
+        check(k >= 0, "Epoll error");
+        if (w->t == 0 && __atomic_exchange_n(&stats_dump_requested, 0, __ATOMIC_RELAXED)) {
+            g = live_enter(w->lv, w->t);
+            scratch_flush_stats(g->scs[w->t]);
+            print_stats(g->rs, g->stats, w->o->stats == 2, stderr);
+            live_exit(w->lv, w->t);
+        }
+        if (k == 0) continue;
+
+        g = live_enter(w->lv, w->t);
+        if (g->rs->nwords > w->mwords) {
+            free(w->m);
+            w->mwords = g->rs->nwords;
+            w->m = (uint64_t *)malloc(sizeof(uint64_t) * w->mwords);
+            check_mem(w->m);
+        }
+        for (int i = 0; i < k; i++) {
+            struct RelayConn *c = (struct RelayConn *)ev[i].data.ptr;
+            if (!c) {
+                relay_accept(w);
+                continue;
+            }
+            int rc = relay_read(w, c, g->rs, g->scs[w->t]);
+            check(rc >= 0, "Write error: upstream port %d", w->o->forward_port);
+            if (rc) relay_close(w, c);
+        }
+        live_exit(w->lv, w->t);
+        check(w->ob.fd < 0 || out_flush(&w->ob) == 0, "Write error: upstream port %d",
+              w->o->forward_port);
+        relay_count(w);
+    }
+    return NULL;
+error:
+    live_exit(w->lv, w->t);
+    w->failed = 1;
+    __atomic_store_n(&serve_stop, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+int cmd_serve(struct Live *lv, const struct Options *o) {
+    int retcode = 1, started = 0, lfd = -1;
+    struct RelayTotals tot;
+    struct RelayLoop *loops = (struct RelayLoop *)calloc(o->nthreads, sizeof(struct RelayLoop));
+    struct sigaction sa;
+
+    check_mem(loops);
+    memset(&tot, 0, sizeof(tot));
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int t = 0; t < o->nthreads; t++)
+        loops[t].epfd = loops[t].ob.fd = -1;
+    lfd = relay_socket(SOCK_STREAM, o->listen_port, 1);
+    check(lfd >= 0, "Could not listen on port %d", o->listen_port);
+    for (int t = 0; t < o->nthreads; t++) {
+        struct RelayLoop *w = &loops[t];
+        struct epoll_event ev = {EPOLLIN | EPOLLEXCLUSIVE, {NULL}};
+        w->lv = lv;
+        w->o = o;
+        w->tot = &tot;
+        w->t = t;
+        w->lfd = lfd;
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        check(w->epfd >= 0 && epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->lfd, &ev) == 0, "Epoll error");
+        if (o->forward_port) {
+            w->ob.fd = relay_socket(SOCK_STREAM, o->forward_port, 0);
+            check(w->ob.fd >= 0, "Could not reach upstream port %d", o->forward_port);
+            w->ob.buf = (char *)malloc(STREAM_BUF_SIZE);
+            check_mem(w->ob.buf);
+        }
+    }
+    if (o->verbose)
+        fprintf(stderr, "Listening on 127.0.0.1:%d with %d event loop%s\n", o->listen_port,
+                o->nthreads, o->nthreads > 1 ? "s" : "");
+    for (; started < o->nthreads; started++)
+        check(pthread_create(&loops[started].thread, NULL, relay_main, &loops[started]) == 0,
+              "Thread create failed");
+    retcode = 0;
+
+error:
+    if (retcode) __atomic_store_n(&serve_stop, 1, __ATOMIC_RELAXED);
+    for (int t = 0; t < started; t++) {
+        pthread_join(loops[t].thread, NULL);
+        retcode |= loops[t].failed;
+    }
+    for (int t = 0; loops && t < o->nthreads; t++) {
+        struct RelayLoop *w = &loops[t];
+        while (w->conns) {
+            struct RelayConn *c = w->conns;
+            w->conns = c->next;
+            close(c->fd);
+            free(c);
+        }
+        if (w->epfd >= 0) close(w->epfd);
+        if (w->ob.fd >= 0) close(w->ob.fd);
+        free(w->ob.buf);
+        free(w->m);
+    }
+    if (lfd >= 0) close(lfd);
+    if (o->verbose)
+        fprintf(stderr, "serve: %llu lines, %llu passed, %.2f MB, %llu overlong dropped\n",
+                tot.lines, tot.passed, tot.bytes / 1e6, tot.overlong);
+    free(loops);
+    return retcode;
+}
+
+/* statsd ingest --------------------------------------------------------------
+ *
+ * statsd reads statsd datagrams ("name:value|type", one metric per line,
+ * several per datagram) on 127.0.0.1 with recvmmsg, up to STATSD_BATCH
+ * datagrams per call, on -j threads sharing one socket.  Names are matched
+ * where they lie in the receive buffers.  With -F the metrics the rule set
+ * passes go on to another local UDP port with sendmmsg, one datagram per
+ * datagram received.  Each datagram carries the socket's drop count
+ * (SO_RXQ_OVFL), so the kernel's drops are reported beside the throughput.
+ */
+
+#define STATSD_BATCH 64
+#define STATSD_DATAGRAM 8192    /* larger datagrams are dropped and counted */
+#define STATSD_MTU 1432         /* load -u fills datagrams up to this */
+#define STATSD_RCVBUF (8 << 20)
+#define STATSD_TICK_MS 10       /* rate report resolution */
+#define STATSD_IDLE_MS 1000     /* quiet time that ends a burst */
+#define DEFAULT_STATSD_PORT 8125
+
+struct StatsdTotals {
+    unsigned long long datagrams, lines, passed, bytes, truncated, unsent;
+};
+
+struct StatsdWorker {
+    struct Live *lv;
+    const struct Options *o;
+    struct StatsdTotals *tot;
+    int t, fd, upfd;
+    char *in;                   /* STATSD_BATCH receive buffers */
+    char *out;                  /* and as many forward buffers, one byte longer */
+    struct mmsghdr msgs[STATSD_BATCH], fwd[STATSD_BATCH];
+    struct iovec iov[STATSD_BATCH], fiov[STATSD_BATCH];
+    char ctl[STATSD_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+    uint32_t drops;             /* the socket's count, as last seen */
+    uint64_t *m;
+    int mwords;
+    unsigned long long lines, passed;
+    pthread_t thread;
+    int failed;
+};
+
+/* Matches each metric of a datagram and copies the passed ones to out.
+ * Returns their length. */
+size_t statsd_datagram(struct StatsdWorker *w, const struct RuleSet *rs, struct Scratch *sc,
+                       const char *p, size_t len, char *out) {
+    const char *end = p + len, *nl;
+    size_t olen = 0;
+
+    for (; p < end; p = nl + 1) {
+        nl = (const char *)memchr(p, '\n', end - p);
+        if (!nl) nl = end;
+        if (nl == p) continue;
+        size_t n = 0;
+        while (p + n < nl && p[n] != ':') n++;
+        ruleset_match(rs, w->o->engine, w->o->mode, sc, p, n, w->m);
+        int hit = 0;
+        for (int k = 0; k < rs->nwords; k++)
+            hit |= w->m[k] != 0;
+        w->lines++;
+        if (hit != w->o->drop) {
+            w->passed++;
+            memcpy(out + olen, p, nl - p);
+            olen += nl - p;
+            out[olen++] = '\n';
+        }
+    }
+    return olen ? olen - 1 : 0;
+}
+
+void *statsd_main(void *arg) {
+    struct StatsdWorker *w = (struct StatsdWorker *)arg;
+    struct Generation *g;
+
+    while (!__atomic_load_n(&serve_stop, __ATOMIC_RELAXED)) {
+        for (int i = 0; i < STATSD_BATCH; i++) {
+            struct msghdr *h = &w->msgs[i].msg_hdr;
+            w->iov[i].iov_base = w->in + (size_t)i * STATSD_DATAGRAM;
+            w->iov[i].iov_len = STATSD_DATAGRAM;
+            memset(h, 0, sizeof(*h));
+            h->msg_iov = &w->iov[i];
+            h->msg_iovlen = 1;
+            h->msg_control = w->ctl[i];
+            h->msg_controllen = sizeof(w->ctl[i]);
+        }
+        /* blocks for the first datagram, at most SO_RCVTIMEO */
+        int k = recvmmsg(w->fd, w->msgs, STATSD_BATCH, MSG_WAITFORONE, NULL);
+        if (k < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) k = 0;
+        check(k >= 0, "Receive error");
+        if (w->t == 0 && __atomic_exchange_n(&stats_dump_requested, 0, __ATOMIC_RELAXED)) {
+            g = live_enter(w->lv, w->t);
+            scratch_flush_stats(g->scs[w->t]);
+            print_stats(g->rs, g->stats, w->o->stats == 2, stderr);
+            live_exit(w->lv, w->t);
+        }
+        if (k == 0) continue;
+
+        unsigned long long bytes = 0, truncated = 0;
+        int nfwd = 0;
+        g = live_enter(w->lv, w->t);
+        if (g->rs->nwords > w->mwords) {
+            free(w->m);
+            w->mwords = g->rs->nwords;
+            w->m = (uint64_t *)malloc(sizeof(uint64_t) * w->mwords);
+            check_mem(w->m);
+        }
+        for (int i = 0; i < k; i++) {
+            struct msghdr *h = &w->msgs[i].msg_hdr;
+            struct cmsghdr *cm = CMSG_FIRSTHDR(h);
+            if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+                uint32_t drops;
+                memcpy(&drops, CMSG_DATA(cm), sizeof(drops));
+                __atomic_store_n(&w->drops, drops, __ATOMIC_RELAXED);
+            }
+            bytes += w->msgs[i].msg_len;
+            if (h->msg_flags & MSG_TRUNC) {
+                truncated++;
+                continue;
+            }
+            char *out = w->out + (size_t)nfwd * (STATSD_DATAGRAM + 1);
+            size_t olen = statsd_datagram(w, g->rs, g->scs[w->t], (const char *)w->iov[i].iov_base,
+                                          w->msgs[i].msg_len, out);
+            if (w->upfd < 0 || !olen) continue;
+            w->fiov[nfwd].iov_base = out;
+            w->fiov[nfwd].iov_len = olen;
+            memset(&w->fwd[nfwd].msg_hdr, 0, sizeof(struct msghdr));
+            w->fwd[nfwd].msg_hdr.msg_iov = &w->fiov[nfwd];
+            w->fwd[nfwd].msg_hdr.msg_iovlen = 1;
+            nfwd++;
+        }
+        live_exit(w->lv, w->t);
+
+        /* forwarding is as lossy as statsd itself: count, do not stop */
+        int sent = 0;
+        while (sent < nfwd) {
+            int r = sendmmsg(w->upfd, w->fwd + sent, nfwd - sent, 0);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            sent += r;
+        }
+        __atomic_add_fetch(&w->tot->datagrams, k, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&w->tot->lines, w->lines, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&w->tot->passed, w->passed, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&w->tot->bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&w->tot->truncated, truncated, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&w->tot->unsent, nfwd - sent, __ATOMIC_RELAXED);
+        w->lines = w->passed = 0;
+    }
+    return NULL;
+error:
+    live_exit(w->lv, w->t);
+    w->failed = 1;
+    __atomic_store_n(&serve_stop, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* The kernel's drops so far, the largest count any worker has seen. */
+uint32_t statsd_drops(struct StatsdWorker *ws, int n) {
+    uint32_t d = 0;
+    for (int t = 0; t < n; t++) {
+        uint32_t x = __atomic_load_n(&ws[t].drops, __ATOMIC_RELAXED);
+        if (x > d) d = x;
+    }
+    return d;
+}
+
+void print_statsd_rate(const char *what, unsigned long long lines, unsigned long long datagrams,
+                       unsigned long long drops, double secs) {
+    fprintf(stderr, "statsd: %s%llu lines in %llu datagrams, %.2f s, %.0f lines/s, "
+            "%llu datagrams dropped by the kernel (%.2f%%)\n", what, lines, datagrams, secs,
+            secs > 0 ? lines / secs : 0, drops,
+            datagrams + drops ? 100.0 * drops / (datagrams + drops) : 0);
+}
+
+int cmd_statsd(struct Live *lv, const struct Options *o) {
+    int retcode = 1, started = 0, fd = -1, one = 1, rcvbuf = STATSD_RCVBUF;
+    struct StatsdTotals tot;
+    struct StatsdWorker *ws = (struct StatsdWorker *)calloc(o->nthreads, sizeof(struct StatsdWorker));
+    struct timeval tv = {0, RELOAD_POLL_MS * 1000};
+    struct sigaction sa;
+    uint64_t t0 = now_ns();
+
+    check_mem(ws);
+    memset(&tot, 0, sizeof(tot));
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    for (int t = 0; t < o->nthreads; t++)
+        ws[t].upfd = -1;
+    fd = relay_socket(SOCK_DGRAM, o->listen_port, 1);
+    check(fd >= 0, "Could not listen on port %d", o->listen_port);
+    check(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == 0 &&
+          setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) == 0 &&
+          setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0, "Socket error");
+    for (int t = 0; t < o->nthreads; t++) {
+        struct StatsdWorker *w = &ws[t];
+        w->lv = lv;
+        w->o = o;
+        w->tot = &tot;
+        w->t = t;
+        w->fd = fd;
+        w->in = (char *)malloc((size_t)STATSD_BATCH * STATSD_DATAGRAM);
+        w->out = (char *)malloc((size_t)STATSD_BATCH * (STATSD_DATAGRAM + 1));
+        check_mem(w->in && w->out);
+        if (o->forward_port) {
+            w->upfd = relay_socket(SOCK_DGRAM, o->forward_port, 0);
+            check(w->upfd >= 0, "Could not reach upstream port %d", o->forward_port);
+        }
+    }
+    if (o->verbose)
+        fprintf(stderr, "Listening on udp 127.0.0.1:%d with %d thread%s\n", o->listen_port,
+                o->nthreads, o->nthreads > 1 ? "s" : "");
+    for (; started < o->nthreads; started++)
+        check(pthread_create(&ws[started].thread, NULL, statsd_main, &ws[started]) == 0,
+              "Thread create failed");
+
+    /* with -v, report each burst of traffic once it has been quiet a while */
+    unsigned long long mark_lines = 0, mark_dgrams = 0, seen = 0;
+    uint32_t mark_drops = 0;
+    uint64_t first = 0, last = 0;
+    while (!__atomic_load_n(&serve_stop, __ATOMIC_RELAXED)) {
+        poll(NULL, 0, STATSD_TICK_MS);
+        unsigned long long dgrams = __atomic_load_n(&tot.datagrams, __ATOMIC_RELAXED);
+        uint32_t drops = statsd_drops(ws, o->nthreads);
+        uint64_t now = now_ns();
+        if (dgrams + drops != seen) {
+            if (!first) first = now - STATSD_TICK_MS * 1000000ULL;
+            last = now;
+            seen = dgrams + drops;
+        } else if (first && now - last > STATSD_IDLE_MS * 1000000ULL) {
+            unsigned long long lines = __atomic_load_n(&tot.lines, __ATOMIC_RELAXED);
+            if (o->verbose)
+                print_statsd_rate("", lines - mark_lines, dgrams - mark_dgrams,
+                                  drops - mark_drops, (last - first) / 1e9);
+            mark_lines = lines;
+            mark_dgrams = dgrams;
+            mark_drops = drops;
+            first = 0;
+        }
+    }
+    retcode = 0;
+
+error:
+    if (retcode) __atomic_store_n(&serve_stop, 1, __ATOMIC_RELAXED);
+    for (int t = 0; t < started; t++) {
+        pthread_join(ws[t].thread, NULL);
+        retcode |= ws[t].failed;
+    }
+    if (o->verbose) {
+        print_statsd_rate("total ", tot.lines, tot.datagrams, ws ? statsd_drops(ws, o->nthreads) : 0,
+                          (now_ns() - t0) / 1e9);
+        fprintf(stderr, "statsd: %llu passed, %.2f MB, %llu truncated, %llu not forwarded\n",
+                tot.passed, tot.bytes / 1e6, tot.truncated, tot.unsent);
+    }
+    if (fd >= 0) close(fd);
+    for (int t = 0; ws && t < o->nthreads; t++) {
+        if (ws[t].upfd >= 0) close(ws[t].upfd);
+        free(ws[t].in);
+        free(ws[t].out);
+        free(ws[t].m);
+    }
+    free(ws);
+    return retcode;
+}
+
+/* Load generator -------------------------------------------------------------
+ *
+ * load sends -n generated names to a local serve as Graphite lines over
+ * each of -j TCP connections, or with -u to a local statsd as counters
+ * packed into datagrams of up to STATSD_MTU bytes, sent STATSD_BATCH at a
+ * time by each of -j threads.  The receiver reports what arrived.
+ */
+
+struct LoadConn {
+    int port;
+    int udp;
+    const char *data;
+    size_t len;
+    const struct Line *datagrams;   /* udp: views into data */
+    size_t ndatagrams;
+    pthread_t thread;
+    int failed;
+};
+
+int load_udp(int fd, const struct Line *d, size_t n) {
+    struct mmsghdr msgs[STATSD_BATCH];
+    struct iovec iov[STATSD_BATCH];
+
+    for (size_t i = 0; i < n;) {
+        int k = n - i < STATSD_BATCH ? (int)(n - i) : STATSD_BATCH;
+        for (int j = 0; j < k; j++) {
+            iov[j].iov_base = (void *)d[i + j].ptr;
+            iov[j].iov_len = d[i + j].len;
+            memset(&msgs[j].msg_hdr, 0, sizeof(struct msghdr));
+            msgs[j].msg_hdr.msg_iov = &iov[j];
+            msgs[j].msg_hdr.msg_iovlen = 1;
+        }
+        int r = sendmmsg(fd, msgs, k, 0);
+        if (r < 0 && (errno == EINTR || errno == ENOBUFS)) continue;
+        if (r <= 0) return -1;
+        i += r;
+    }
+    return 0;
+}
+
+void *load_main(void *arg) {
+    struct LoadConn *lc = (struct LoadConn *)arg;
+    int fd = relay_socket(lc->udp ? SOCK_DGRAM : SOCK_STREAM, lc->port, 0);
+
+    lc->failed = fd < 0 || (lc->udp ? load_udp(fd, lc->datagrams, lc->ndatagrams)
+                                    : write_all(fd, lc->data, lc->len)) != 0;
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+int cmd_load(const struct RuleSet *rs, struct Scratch **scs, const struct Options *o) {
+    int retcode = 1, started = 0;
+    size_t n = o->bench_names, len = 0, ndgrams = 0;
+    struct Line *names = (struct Line *)malloc(sizeof(struct Line) * (n ? n : 1));
+    struct Line *dgrams = NULL;
+    struct LoadConn *lcs = (struct LoadConn *)calloc(o->nthreads, sizeof(struct LoadConn));
+    char *blob = NULL, *data = NULL;
+    struct NameGen g = name_gen(o);
+    long now = (long)time(NULL);
+    uint64_t t0 = 0;
+
+    check_mem(names && lcs);
+    signal(SIGPIPE, SIG_IGN);
+    long hits = gen_names(rs, scs[0], &g, o->hit_ratio, n, names, &blob);
+    if (hits < 0) goto error;
+    data = (char *)malloc(n * (MAX_NAME + 32) + 1);
+    dgrams = (struct Line *)malloc(sizeof(struct Line) * (n ? n : 1));
+    check_mem(data && dgrams);
+    for (size_t i = 0, start = 0; i < n; i++) {
+        char tail[32];
+        int k = o->udp ? snprintf(tail, sizeof(tail), ":%u|c", rng_below(&g.rng, 1000))
+                       : snprintf(tail, sizeof(tail), " %u %ld", rng_below(&g.rng, 1000), now);
+        if (o->udp && len > start && len + names[i].len + k + 1 > start + STATSD_MTU) {
+            dgrams[ndgrams].ptr = data + start;
+            dgrams[ndgrams++].len = len - start - 1;
+            start = len;
+        }
+        memcpy(data + len, names[i].ptr, names[i].len);
+        len += names[i].len;
+        memcpy(data + len, tail, k);
+        len += k;
+        data[len++] = '\n';
+        if (o->udp && i == n - 1) {
+            dgrams[ndgrams].ptr = data + start;
+            dgrams[ndgrams++].len = len - start - 1;
+        }
+    }
+
+    t0 = now_ns();
+    for (; started < o->nthreads; started++) {
+        struct LoadConn *lc = &lcs[started];
+        lc->port = o->listen_port;
+        lc->udp = o->udp;
+        lc->data = data;
+        lc->len = len;
+        lc->datagrams = dgrams;
+        lc->ndatagrams = ndgrams;
+        check(pthread_create(&lc->thread, NULL, load_main, lc) == 0, "Thread create failed");
+    }
+    retcode = 0;
+
+error:
+    for (int t = 0; t < started; t++) {
+        pthread_join(lcs[t].thread, NULL);
+        retcode |= lcs[t].failed;
+    }
+    if (started && !retcode) {
+        double secs = (now_ns() - t0) / 1e9;
+        size_t lines = n * started;
+        printf("load: %zu lines (%.3f hit ratio)", lines, n ? (double)hits / n : 0.0);
+        if (o->udp)
+            printf(" in %zu datagrams to udp port %d from %d thread%s", ndgrams * started,
+                   o->listen_port, started, started > 1 ? "s" : "");
+        else
+            printf(" to port %d over %d connection%s", o->listen_port, started,
+                   started > 1 ? "s" : "");
+        printf(", %.2f s, %.0f lines/s, %.1f MB/s\n", secs, secs > 0 ? lines / secs : 0,
+               secs > 0 ? len * started / secs / 1e6 : 0);
+    } else if (started) {
+        fprintf(stderr, "Could not send to port %d\n", o->listen_port);
+    }
+    free(names);
+    free(blob);
+    free(data);
+    free(dgrams);
+    free(lcs);
+    return retcode;
+}
+
+/* Rule-set analysis ----------------------------------------------------------
+ *
+ * Compares what the patterns in the combined DFA match.  For a rule a the
+ * DFA is explored over configurations (state, whether a has matched yet),
+ * and each configuration keeps the set of rules matched on every path that
+ * reaches it: the intersection over paths, narrowed until nothing changes.
+ * A rule in that set wherever a's match is complete matches every name a
+ * does; if no configuration completes a, a matches nothing.  The search
+ * stops early once a is known to match and no other rule is left in the
+ * running intersection.  Rules outside the DFA are not analysed.
+ *
+ * Any-match mode can skip a rule contained in another rule it keeps;
+ * first-match mode only one contained in an earlier rule, which always
+ * matches first.  Of rules matching the same names the first is kept, and
+ * rules matching nothing are skipped in both.
+ */
+
+struct Analysis {
+    int n, nwords;
+    uint64_t *supersets;    /* row i: the other rules matching every name rule i does */
+    uint64_t *unsat;        /* rules matching nothing */
+    uint64_t *analysed;     /* rules in the DFA */
+    uint64_t *prune_any;
+    uint64_t *prune_first;
+};
+
+void free_analysis(struct Analysis *an) {
+    free(an->supersets);
+    free(an->unsat);
+    free(an->analysed);
+    free(an->prune_any);
+    free(an->prune_first);
+    memset(an, 0, sizeof(*an));
+}
+
+/* Fills sup with the rules matched wherever rule a's match is complete, a
+ * included; returns 0 if a matches nothing.  m, seen, inq and queue have
+ * room for two configurations per DFA state. */
+int analyze_rule(const struct RuleSet *rs, int a, uint64_t *sup,
+                 uint64_t *m, uint8_t *seen, uint8_t *inq, int *queue) {
+    const struct Dfa *d = &rs->dfa;
+    int nw = rs->nwords, nconf = 2 * d->nstates, head = 0, count = 0, sat = 0;
+    uint64_t next[nw];
+
+    memset(seen, 0, nconf);
+    memset(inq, 0, nconf);
+    memset(sup, 0xff, sizeof(uint64_t) * nw);
+    for (int w = 0; w < nw; w++)
+        next[w] = d->acc[d->start] >= 0 ? d->accpool[d->acc[d->start] + w] : 0;
+    int c = d->start * 2 + bit_test(next, a);
+    memcpy(m + (size_t)c * nw, next, sizeof(next));
+    seen[c] = inq[c] = 1;
+    queue[count++] = c;
+
+    while (count) {
+        c = queue[head];
+        head = (head + 1) % nconf;
+        count--;
+        inq[c] = 0;
+        int st = c / 2, ma = c & 1;
+        /* dfa_match stops at the dead state without looking at eoi */
+        int32_t eoi = st != d->dead ? d->eoi[st] : -1;
+        const uint64_t *mc = m + (size_t)c * nw;
+
+        if (ma || (eoi >= 0 && bit_test(d->accpool + eoi, a))) {
+            uint64_t others = 0;
+            sat = 1;
+            for (int w = 0; w < nw; w++) {
+                sup[w] &= mc[w] | (eoi >= 0 ? d->accpool[eoi + w] : 0);
+                others |= sup[w] & ~(a >> 6 == w ? 1ULL << (a & 63) : 0);
+            }
+            if (!others) break;
+        }
+        if (st == d->dead) continue;
+        for (int cl = 0; cl < d->ncls; cl++) {
+            int t = d->trans[(size_t)st * d->ncls + cl];
+            int32_t acc = d->acc[t];
+            for (int w = 0; w < nw; w++)
+                next[w] = mc[w] | (acc >= 0 ? d->accpool[acc + w] : 0);
+            int c2 = t * 2 + (ma | (int)bit_test(next, a));
+            uint64_t *m2 = m + (size_t)c2 * nw, changed = 0;
+            if (!seen[c2]) {
+                seen[c2] = 1;
+                memcpy(m2, next, sizeof(next));
+                changed = 1;
+            } else {
+                for (int w = 0; w < nw; w++) {
+                    changed |= m2[w] & ~next[w];
+                    m2[w] &= next[w];
+                }
+            }
+            if (changed && !inq[c2]) {
+                inq[c2] = 1;
+                queue[(head + count++) % nconf] = c2;
+            }
+        }
+    }
+    return sat;
+}
+
+int analyze_ruleset(const struct RuleSet *rs, struct Analysis *an) {
+    int n = rs->n, nw = rs->nwords ? rs->nwords : 1;
+    size_t nconf = rs->has_dfa ? 2 * (size_t)rs->dfa.nstates : 1;
+    uint64_t *m = NULL;
+    uint8_t *seen = NULL, *inq = NULL;
+    int *queue = NULL;
+
+    memset(an, 0, sizeof(*an));
+    check(rs->has_dfa, "Analysis needs the combined DFA, which was not built");
+    an->n = n;
+    an->nwords = nw;
+    an->supersets = (uint64_t *)calloc((size_t)(n ? n : 1) * nw, sizeof(uint64_t));
+    an->unsat = (uint64_t *)calloc(nw, sizeof(uint64_t));
+    an->analysed = (uint64_t *)calloc(nw, sizeof(uint64_t));
+    an->prune_any = (uint64_t *)calloc(nw, sizeof(uint64_t));
+    an->prune_first = (uint64_t *)calloc(nw, sizeof(uint64_t));
+    m = (uint64_t *)malloc(sizeof(uint64_t) * nconf * nw);
+    seen = (uint8_t *)malloc(nconf);
+    inq = (uint8_t *)malloc(nconf);
+    queue = (int *)malloc(sizeof(int) * nconf);
+    check_mem(an->supersets && an->unsat && an->analysed && an->prune_any &&
+              an->prune_first && m && seen && inq && queue);
+
+    for (int a = 0; a < n; a++) {
+        uint64_t *sup = an->supersets + (size_t)a * nw;
+        if (rs->nfa.start[a] < 0) continue;
+        bit_set(an->analysed, a);
+        if (!analyze_rule(rs, a, sup, m, seen, inq, queue)) {
+            bit_set(an->unsat, a);
+            memset(sup, 0, sizeof(uint64_t) * nw);
+            continue;
+        }
+        sup[a >> 6] &= ~(1ULL << (a & 63));
+    }
+    for (int a = 0; a < n; a++) {
+        const uint64_t *sup = an->supersets + (size_t)a * nw;
+        if (bit_test(an->unsat, a)) {
+            bit_set(an->prune_any, a);
+            bit_set(an->prune_first, a);
+            continue;
+        }
+        for (int b = 0; b < n; b++) {
+            if (!bit_test(sup, b)) continue;
+            /* contained in b, strictly or with the earlier of equal rules kept */
+            if (!bit_test(an->supersets + (size_t)b * nw, a) || b < a)
+                bit_set(an->prune_any, a);
+            if (b < a)
+                bit_set(an->prune_first, a);
+        }
+    }
+    free(m);
+    free(seen);
+    free(inq);
+    free(queue);
+    return 0;
+error:
+    free(m);
+    free(seen);
+    free(inq);
+    free(queue);
+    free_analysis(an);
+    return -1;
+}
+
+/* Keeps the rules the analysis lets each mode skip in rs->skip, for
+ * ruleset_match. */
+int prune_ruleset(struct RuleSet *rs) {
+    struct Analysis an;
+    int nw = rs->nwords ? rs->nwords : 1;
+
+    if (analyze_ruleset(rs, &an)) return -1;
+    free(rs->skip);
+    rs->skip = (uint64_t *)calloc((size_t)MODE_COUNT * nw, sizeof(uint64_t));
+    check_mem(rs->skip);
+    memcpy(rs->skip + (size_t)MODE_FIRST * rs->nwords, an.prune_first,
+           sizeof(uint64_t) * rs->nwords);
+    memcpy(rs->skip + (size_t)MODE_ANY * rs->nwords, an.prune_any,
+           sizeof(uint64_t) * rs->nwords);
+    free_analysis(&an);
+    return 0;
+error:
+    free_analysis(&an);
+    return -1;
+}
+
+/* Prints rules as a list of indices, or "none". */
+void print_rule_list(FILE *f, const uint64_t *set, int n) {
+    int any = 0;
+    for (int i = 0; i < n; i++)
+        if (bit_test(set, i)) fprintf(f, "%s%d", any++ ? ", " : "", i);
+    if (!any) fprintf(f, "none");
+}
+
+/* DFA states of rs without the rules in skip. */
+int pruned_dfa_states(const struct RuleSet *rs, const uint64_t *skip) {
+    struct Line *lines = (struct Line *)malloc(sizeof(struct Line) * (rs->n ? rs->n : 1));
+    struct RuleSet *sub = NULL;
+    int n = 0, nbuiltin = 0, states = -1;
+
+    if (!lines) return -1;
+    for (int i = 0; i < rs->n; i++) {
+        if (bit_test(skip, i)) continue;
+        lines[n].ptr = rs->patterns[i];
+        lines[n++].len = strlen(rs->patterns[i]);
+        nbuiltin += i >= rs->builtin_from;
+    }
+    sub = compile_ruleset(lines, n, nbuiltin);
+    if (sub && sub->has_dfa) states = sub->dfa.nstates;
+    free_ruleset(sub);
+    free(lines);
+    return states;
+}
+
+/* Reports subsumed, duplicate and unsatisfiable rules, and what skipping
+ * them saves on generated names. */
+int cmd_analyze(const struct RuleSet *rs, struct Scratch **scs, const struct Options *o) {
+    struct Analysis an;
+    struct Line *names = NULL;
+    char *blob = NULL;
+    struct NameGen g = name_gen(o);
+    size_t n = o->bench_names;
+    int retcode = 1;
+    uint64_t t0 = now_ns();
+
+    if (analyze_ruleset(rs, &an)) return 1;
+    int analysed = 0;
+    for (int w = 0; w < an.nwords; w++)
+        analysed += __builtin_popcountll(an.analysed[w]);
+    printf("analysis: %d rules, %d in the DFA of %d states, %.1f ms\n", rs->n,
+           analysed, rs->dfa.nstates, (now_ns() - t0) / 1e6);
+    for (int a = 0; a < rs->n; a++) {
+        const uint64_t *sup = an.supersets + (size_t)a * an.nwords;
+        printf("rule %d %s: ", a, rs->patterns[a]);
+        if (!bit_test(an.analysed, a)) {
+            printf("not analysed, outside the DFA\n");
+            continue;
+        }
+        if (bit_test(an.unsat, a)) {
+            printf("matches nothing\n");
+            continue;
+        }
+        uint64_t same[an.nwords], within[an.nwords];
+        for (int w = 0; w < an.nwords; w++)
+            same[w] = within[w] = 0;
+        for (int b = 0; b < rs->n; b++) {
+            if (!bit_test(sup, b)) continue;
+            if (bit_test(an.supersets + (size_t)b * an.nwords, a))
+                bit_set(same, b);
+            else
+                bit_set(within, b);
+        }
+        int nsame = 0, nwithin = 0;
+        for (int w = 0; w < an.nwords; w++) {
+            nsame += __builtin_popcountll(same[w]);
+            nwithin += __builtin_popcountll(within[w]);
+        }
+        if (nsame) {
+            printf("same as ");
+            print_rule_list(stdout, same, rs->n);
+        }
+        if (nwithin) {
+            printf("%scontained in ", nsame ? "; " : "");
+            print_rule_list(stdout, within, rs->n);
+        }
+        printf("%s\n", nsame || nwithin ? "" : "not covered by another rule");
+    }
+    printf("any-match skips ");
+    print_rule_list(stdout, an.prune_any, rs->n);
+    printf("; first-match skips ");
+    print_rule_list(stdout, an.prune_first, rs->n);
+    printf("\n");
+
+    /* per-pattern evaluations the prefilter engine would run, with and
+     * without the skipped rules */
+    names = (struct Line *)malloc(sizeof(struct Line) * (n ? n : 1));
+    check_mem(names);
+    scratch_record(scs, o->nthreads, 0);
+    if (gen_names(rs, scs[0], &g, o->hit_ratio, n, names, &blob) < 0) goto error;
+    unsigned long long evals[3] = {0, 0, 0};
+    for (size_t i = 0; i < n; i++) {
+        uint64_t cand[an.nwords];
+        trie_candidates(&rs->trie, names[i].ptr, names[i].len, cand);
+        req_candidates(&rs->req, &scs[0]->req, rs->n, names[i].ptr, names[i].len, cand);
+        for (int w = 0; w < rs->nwords; w++) {
+            evals[0] += __builtin_popcountll(cand[w]);
+            evals[1] += __builtin_popcountll(cand[w] & ~an.prune_any[w]);
+            evals[2] += __builtin_popcountll(cand[w] & ~an.prune_first[w]);
+        }
+    }
+    printf("prefilter evaluations per name on %zu generated names: all %.3f, "
+           "any-match %.3f (%.1f%% fewer), first-match %.3f (%.1f%% fewer)\n", n,
+           n ? (double)evals[0] / n : 0, n ? (double)evals[1] / n : 0,
+           evals[0] ? 100.0 * (evals[0] - evals[1]) / evals[0] : 0,
+           n ? (double)evals[2] / n : 0,
+           evals[0] ? 100.0 * (evals[0] - evals[2]) / evals[0] : 0);
+    printf("combined DFA states: all %d, any-match %d, first-match %d\n", rs->dfa.nstates,
+           pruned_dfa_states(rs, an.prune_any), pruned_dfa_states(rs, an.prune_first));
+    retcode = 0;
+
+error:
+    scratch_record(scs, o->nthreads, 1);
+    free(names);
+    free(blob);
+    free_analysis(&an);
+    return retcode;
+}
+
+/* Self test ------------------------------------------------------------------
+ *
+ * The literal kernels against strstr on random strings at every level the
+ * CPU supports, and the required-literal filter at each level against the
+ * scalar automaton on generated names.  Then the DFA compiled by jit and
+ * by gen, the built-in rules, and the first- and any-match modes, against
+ * regexec on those names and mutations of them, and submatches on a fixed
+ * set of cases.  Small alphabets make partial matches, and so the
+ * verification paths, common.
+ */
+
+#define SELFTEST_CASES 20000
+
+void rand_str(struct Rng *r, char *s, int len, const char *alpha) {
+    int n = strlen(alpha);
+    for (int i = 0; i < len; i++)
+        s[i] = alpha[rng_below(r, n)];
+    s[len] = '\0';
+}
+
+int selftest_find(struct Rng *r) {
+    char hay[320], lit[20];
+    long bad = 0;
+
+    for (int i = 0; i < SELFTEST_CASES; i++) {
+        const char *alpha = i & 1 ? "ab." : "abcdefghij.-_";
+        int n = rng_below(r, 300), m = 1 + rng_below(r, 16);
+        rand_str(r, hay, n, alpha);
+        if (n >= m && rng_below(r, 2)) {
+            memcpy(lit, hay + rng_below(r, n - m + 1), m);
+            lit[m] = '\0';
+        } else {
+            rand_str(r, lit, m, alpha);
+        }
+        const char *p = strstr(hay, lit);
+        long want = p ? p - hay : -1, got = lit_find(hay, n, lit, m);
+        if (got != want && !bad++)
+            fprintf(stderr, "    \"%s\" in \"%s\": %ld, strstr %ld\n", lit, hay, got, want);
+    }
+    fprintf(stderr, "[%s] %s substring search: %d cases, %ld differ from strstr\n",
+            bad ? "Failed" : "Success", simd_names[simd_level], SELFTEST_CASES, bad);
+    return bad != 0;
+}
+
+void count_hit(void *ctx, int l) {
+    ((int *)ctx)[l]++;
+}
+
+/* Every occurrence of every literal must be reported exactly once. */
+int selftest_teddy(struct Rng *r) {
+    char hay[320], buf[TEDDY_MAX_LITS][12];
+    const char *lits[TEDDY_MAX_LITS];
+    int lens[TEDDY_MAX_LITS], got[TEDDY_MAX_LITS];
+    struct Teddy t;
+    long bad = 0;
+    int cases = SELFTEST_CASES / 4;
+
+    for (int i = 0; i < cases; i++) {
+        const char *alpha = i & 1 ? "ab." : "abcdefghij.-_";
+        int n = rng_below(r, 300), nlits = 1 + rng_below(r, TEDDY_MAX_LITS);
+        rand_str(r, hay, n, alpha);
+        for (int l = 0; l < nlits; l++) {
+            lens[l] = 1 + rng_below(r, 10);
+            if (n >= lens[l] && rng_below(r, 2)) {
+                memcpy(buf[l], hay + rng_below(r, n - lens[l] + 1), lens[l]);
+                buf[l][lens[l]] = '\0';
+            } else {
+                rand_str(r, buf[l], lens[l], alpha);
+            }
+            lits[l] = buf[l];
+            got[l] = 0;
+        }
+        teddy_build(&t, lits, lens, nlits);
+        teddy_scan(&t, hay, n, count_hit, got);
+        for (int l = 0; l < nlits; l++) {
+            int want = 0;
+            for (const char *p = hay; (p = strstr(p, lits[l])) != NULL; p++)
+                want++;
+            if (got[l] != want && !bad++)
+                fprintf(stderr, "    \"%s\" in \"%s\": %d hits, strstr %d\n", lits[l], hay, got[l], want);
+        }
+    }
+    fprintf(stderr, "[%s] %s teddy: %d literal sets, %ld counts differ from strstr\n",
+            bad ? "Failed" : "Success", simd_names[simd_level], cases, bad);
+    return bad != 0;
+}
+
+/* The literal filter's candidates must not depend on the kernel. */
+int selftest_filter(const struct RuleSet *rs, struct Scratch *sc, const struct Line *names, size_t n) {
+    uint64_t want[rs->nwords ? rs->nwords : 1], got[rs->nwords ? rs->nwords : 1];
+    int level = simd_level;
+    long bad = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        memset(want, 0xff, sizeof(want));
+        memset(got, 0xff, sizeof(got));
+        simd_level = SIMD_SCALAR;
+        req_candidates(&rs->req, &sc->req, rs->n, names[i].ptr, names[i].len, want);
+        simd_level = level;
+        req_candidates(&rs->req, &sc->req, rs->n, names[i].ptr, names[i].len, got);
+        if (memcmp(want, got, sizeof(uint64_t) * rs->nwords) && !bad++)
+            fprintf(stderr, "    %.*s\n", (int)names[i].len, names[i].ptr);
+    }
+    fprintf(stderr, "[%s] %s required literals: %zu names, %ld differ from the automaton\n",
+            bad ? "Failed" : "Success", simd_names[simd_level], n, bad);
+    return bad != 0;
+}
+
+/* A DFA compiled to code, by jit or by gen, against regexec on the
+ * generated names and on mutations of them: bytes replaced by any non-NUL
+ * byte, cut short, or spliced together, so the scan leaves the paths the
+ * names take. */
+int selftest_compiled(const struct RuleSet *rs, struct Scratch *sc, int engine, struct Rng *r,
+                      const struct Line *names, size_t n) {
+    uint64_t want[rs->nwords ? rs->nwords : 1], got[rs->nwords ? rs->nwords : 1];
+    char buf[2 * MAX_NAME];
+    long bad = 0, cases = 0;
+
+    if (engine == ENGINE_JIT ? !rs->jit.fn : !gen_usable(rs)) {
+        fprintf(stderr, "[Skipped] %s: not built for these patterns\n", engine_names[engine]);
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        for (int k = 0; k < 4; k++) {
+            const struct Line *a = &names[i], *b = &names[rng_below(r, n)];
+            size_t len = a->len < MAX_NAME ? a->len : MAX_NAME;
+            memcpy(buf, a->ptr, len);
+            if (k == 1) {
+                for (int m = 1 + rng_below(r, 3); m > 0 && len; m--)
+                    buf[rng_below(r, len)] = 1 + rng_below(r, 255);
+            } else if (k == 2) {
+                len = rng_below(r, len + 1);
+            } else if (k == 3) {
+                size_t cut = rng_below(r, len + 1), from = rng_below(r, b->len + 1);
+                size_t tail = b->len - from < MAX_NAME ? b->len - from : MAX_NAME;
+                memcpy(buf + cut, b->ptr + from, tail);
+                len = cut + tail;
+            }
+            ruleset_match(rs, ENGINE_REGEXEC, MODE_ALL, sc, buf, len, want);
+            ruleset_match(rs, engine, MODE_ALL, sc, buf, len, got);
+            cases++;
+            if (memcmp(want, got, sizeof(uint64_t) * rs->nwords) && !bad++)
+                fprintf(stderr, "    %.*s\n", (int)len, buf);
+        }
+    }
+    fprintf(stderr, "[%s] %s: %ld names, %ld differ from regexec\n",
+            bad ? "Failed" : "Success", engine_names[engine], cases, bad);
+    return bad != 0;
+}
+
+/* First- and any-match lookups of every engine, with whatever rules -R
+ * skips, against regexec's full match set on the generated names and on
+ * prefixes of them, which stop inside partial matches. */
+int selftest_modes(const struct RuleSet *rs, struct Scratch *sc, struct Rng *r,
+                   const struct Line *names, size_t n) {
+    uint64_t want[rs->nwords ? rs->nwords : 1], got[rs->nwords ? rs->nwords : 1];
+    long bad = 0, cases = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        for (int k = 0; k < 2; k++) {
+            size_t len = k ? rng_below(r, names[i].len + 1) : names[i].len;
+            ruleset_match(rs, ENGINE_REGEXEC, MODE_ALL, sc, names[i].ptr, len, want);
+            for (int md = MODE_FIRST; md < MODE_COUNT; md++) {
+                for (int e = 0; e < ENGINE_COUNT; e++) {
+                    ruleset_match(rs, e, md, sc, names[i].ptr, len, got);
+                    cases++;
+                    if (!mode_agrees(md, got, want, rs->nwords) && !bad++)
+                        fprintf(stderr, "    %s, %s-match: %.*s\n", engine_names[e],
+                                mode_names[md], (int)len, names[i].ptr);
+                }
+            }
+        }
+    }
+    fprintf(stderr, "[%s] first- and any-match%s: %ld lookups, %ld differ from regexec\n",
+            bad ? "Failed" : "Success", rs->skip ? ", pruned" : "", cases, bad);
+    return bad != 0;
+}
+
+/* Patterns where an unparenthesized optional or repeated element before
+ * or inside a group decides the submatches, with names that make it. */
+const char *const capture_cases[][2] = {
+    {"^servers\\.web-?(.*)\\.cpu", "servers.web-01.cpu"},
+    {"^b?(.*b*b)", "ba.b"},
+    {"^a*(a*)b", "aaab"},
+    {"^stats\\.c?(.*)\\.rate", "stats.counters.rate"},
+    {"^(x-?(.*))\\.", "x-1.y"},
+    {"^a[0-9]{1,3}([0-9]*)$", "a12345"},
+};
+
+/* The extraction NFA against regexec on capture_cases. */
+int selftest_captures(void) {
+    long bad = 0;
+    int n = countof(capture_cases);
+
+    for (int i = 0; i < n; i++) {
+        const char *pattern = capture_cases[i][0], *name = capture_cases[i][1];
+        struct Ast ast;
+        struct CapProg cp;
+        struct PikeScratch ps;
+        regex_t re;
+        regmatch_t got[MAX_CAP_GROUPS + 1], want[MAX_CAP_GROUPS + 1];
+        int diff = 1;
+
+        if (parse_pattern(pattern, &ast)) ast.root = -1;
+        if (compile_capprog(pattern, &ast, &cp) == 0) {
+            if (cp.has_re) {
+                fprintf(stderr, "    %s left to regexec\n", pattern);
+            } else if (init_pike_scratch(&ps, cp.nfa.n, cp.nslots) == 0) {
+                if (regcomp(&re, pattern, REG_EXTENDED) == 0) {
+                    size_t len = strlen(name);
+                    want[0].rm_so = 0;
+                    want[0].rm_eo = len;
+                    int r1 = pike_match(&cp, &ps, name, len, got, cp.nmatch);
+                    int r2 = regexec(&re, name, cp.nmatch, want, REG_STARTEND);
+                    diff = r1 != r2 || (!r1 && memcmp(got, want, sizeof(regmatch_t) * cp.nmatch));
+                    regfree(&re);
+                }
+                free_pike_scratch(&ps);
+            }
+            free_capprog(&cp);
+        }
+        free_ast(&ast);
+        if (diff && !bad++)
+            fprintf(stderr, "    %s on %s\n", pattern, name);
+    }
+    fprintf(stderr, "[%s] submatches: %d cases, %ld differ from regexec\n",
+            bad ? "Failed" : "Success", n, bad);
+    return bad != 0;
+}
+
+/* The segment matcher on ^ a* ... a* b\. beside a literal that keeps the
+ * pattern out of the bit-parallel matcher, over a 180-byte segment of a's
+ * that almost matches.  Trying every split of the a's between the runs
+ * took seconds at ten runs, so the whole case has a time limit. */
+int selftest_segments(void) {
+    char pattern[1024], name[512];
+    long bad = 0, cases = 0;
+    uint64_t spent = 0;
+
+    memset(name, 'a', 180);
+    memcpy(name + 180, "b.", 2);
+    memset(name + 182, 'd', 120);
+    for (int k = 6; k <= 24; k += 2) {
+        struct Ast ast;
+        struct SegProg g;
+        regex_t re;
+        memset(&g, 0, sizeof(g));
+        int n = snprintf(pattern, sizeof(pattern), "^(");
+        for (int i = 0; i < k; i++) n += snprintf(pattern + n, sizeof(pattern) - n, "a*");
+        n += snprintf(pattern + n, sizeof(pattern) - n, "b\\.%.120s|%.150s)", name + 182, name);
+
+        if (parse_pattern(pattern, &ast) || compile_segprog(&ast, &g) ||
+            regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB)) {
+            fprintf(stderr, "    no segment program for %d runs\n", k);
+            free_segprog(&g);
+            free_ast(&ast);
+            bad++;
+            continue;
+        }
+        /* the a's alone, then the whole name */
+        for (int len = 180; len <= 302; len += 122) {
+            struct Segments sg;
+            split_segments(name, len, &sg);
+            uint64_t t0 = now_ns();
+            int got = seg_match(&g, name, &sg);
+            spent += now_ns() - t0;
+            cases++;
+            if (got != (regexec_len(&re, name, len) == 0) && !bad++)
+                fprintf(stderr, "    %d runs on %.*s\n", k, len, name);
+        }
+        regfree(&re);
+        free_segprog(&g);
+        free_ast(&ast);
+    }
+    int slow = spent > 200000000;
+    fprintf(stderr, "[%s] segment runs: %ld names in %.1f ms, %ld differ from regexec\n",
+            bad || slow ? "Failed" : "Success", cases, spent / 1e6, bad);
+    return bad || slow;
+}
+
+/* Each generated built-in matcher against regexec on its pattern, over
+ * the generated names cut short or with a byte changed. */
+int selftest_builtins(struct Rng *r, const struct Line *names, size_t n) {
+    char buf[MAX_NAME];
+    long bad = 0, cases = 0;
+
+    if (!builtins_generated()) {
+        fprintf(stderr, "[Skipped] built-in rules: no builtins_gen.h for these rules\n");
+        return 0;
+    }
+    for (int k = 0; k < BUILTIN_COUNT; k++) {
+        regex_t re;
+        if (regcomp(&re, builtin_patterns[k], REG_EXTENDED | REG_NOSUB)) {
+            fprintf(stderr, "    could not compile %s\n", builtin_patterns[k]);
+            bad++;
+            continue;
+        }
+        for (size_t i = 0; i < n; i++) {
+            for (int m = 0; m < 3; m++) {
+                size_t len = names[i].len < MAX_NAME ? names[i].len : MAX_NAME;
+                memcpy(buf, names[i].ptr, len);
+                if (m == 1) len = rng_below(r, len + 1);
+                if (m == 2 && len) buf[rng_below(r, len)] = 1 + rng_below(r, 255);
+                int want = regexec_len(&re, buf, len) == 0;
+                cases++;
+                if (builtin_match(k, buf, len) != want && !bad++)
+                    fprintf(stderr, "    %s on %.*s\n", builtin_patterns[k], (int)len, buf);
+            }
+        }
+        regfree(&re);
+    }
+    fprintf(stderr, "[%s] built-in rules: %d rules, %ld names, %ld differ from regexec\n",
+            bad ? "Failed" : "Success", BUILTIN_COUNT, cases, bad);
+    return bad != 0;
+}
+
+int cmd_selftest(const struct RuleSet *rs, struct Scratch **scs, const struct Options *o) {
+    int retcode = 1, failed = 0, level = simd_level;
+    size_t n = o->bench_names < 20000 ? o->bench_names : 20000;
+    struct Line *names = NULL;
+    char *blob = NULL;
+    struct Rng rng = {o->seed * 0x9E3779B97F4A7C15ULL + 1};
+    struct NameGen g = {{o->seed * 0x9E3779B97F4A7C15ULL + 2}, o->bench_hosts,
+                        o->bench_services, o->bench_depth};
+
+    if (g.services < 1 || g.services > countof(gen_services)) g.services = countof(gen_services);
+    if (g.hosts < 1) g.hosts = 1;
+    names = (struct Line *)malloc(sizeof(struct Line) * (n ? n : 1));
+    check_mem(names);
+    scratch_record(scs, o->nthreads, 0);
+    if (gen_names(rs, scs[0], &g, o->hit_ratio, n, names, &blob) < 0) goto error;
+
+    for (int l = 0; l < SIMD_COUNT; l++) {
+        if (!simd_supported(l)) {
+            fprintf(stderr, "[Skipped] %s: not supported by this CPU\n", simd_names[l]);
+            continue;
+        }
+        simd_level = l;
+        failed |= selftest_find(&rng);
+        failed |= selftest_teddy(&rng);
+        failed |= selftest_filter(rs, scs[0], names, n);
+    }
+    simd_level = level;
+    failed |= selftest_compiled(rs, scs[0], ENGINE_JIT, &rng, names, n);
+    failed |= selftest_compiled(rs, scs[0], ENGINE_GEN, &rng, names, n);
+    failed |= selftest_builtins(&rng, names, n);
+    failed |= selftest_captures();
+    failed |= selftest_segments();
+    failed |= selftest_modes(rs, scs[0], &rng, names, n);
+    retcode = failed;
+
+error:
+    simd_level = level;
+    scratch_record(scs, o->nthreads, 1);
+    free(names);
+    free(blob);
+    return retcode;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [command] [options]\n"
+            "commands:\n"
+            "  test      check test cases against the rule set (default)\n"
+            "  stream    filter metric lines from stdin to stdout; SIGHUP reloads\n"
+            "            the patterns without stopping\n"
+            "  bench     time every engine on generated metric names\n"
+            "  selftest  check the literal search kernels against strstr, and jit, gen,\n"
+            "            the built-in rules, submatches, the segment matcher and the\n"
+            "            first- and any-match modes against regexec\n"
+            "  compile   write the compiled rule set to the -I file\n"
+            "  gen       print the DFA as C, to build in as rules_gen.h with -DRULES_GEN;\n"
+            "            with -b the built-in rules, as builtins_gen.h with -DBUILTINS_GEN\n"
+            "  analyze   find rules contained in others, duplicated, or matching nothing\n"
+            "  serve     relay Graphite plaintext on 127.0.0.1; SIGHUP reloads, SIGINT stops\n"
+            "  statsd    filter statsd datagrams on 127.0.0.1; SIGHUP reloads, SIGINT stops\n"
+            "  load      send generated Graphite lines to a serve, or statsd with -u\n"
+            "options:\n"
+            "  -e engine   regexec, prefilter, dfa (default), lazy, jit, or gen with a\n"
+            "              matcher built in from `gen` output\n"
+            "  -M mode     all: report every matching pattern (default); first: only\n"
+            "              the first in file order; any: any one, stopping once found;\n"
+            "              bench: time the modes given, else all three\n"
+            "  -R          with -M first or any, skip rules the analysis finds redundant\n"
+            "  -c states   lazy DFA cache size (%d)\n"
+            "  -C MB       cache match results by name in this much memory (off)\n"
+            "  -j threads  test: match the batch on this many threads; serve: event\n"
+            "              loops; statsd: receivers; load: senders (1)\n"
+            "  -p file     patterns (pattern.txt)\n"
+            "  -b          add the built-in rules after the patterns\n"
+            "  -t file     test cases (test.txt)\n"
+            "  -I file     compiled rule set, used if built from the current patterns\n"
+            "  -i file     stream input, - for stdin (-)\n"
+            "  -d          stream, serve, statsd: drop matching lines instead of passing them\n"
+            "  -w          stream, serve, statsd: also reload when the pattern file changes\n"
+            "  -P port     serve, statsd: listen, load: send to this port (%d, statsd %d)\n"
+            "  -F port     serve, statsd: forward passed lines to this port, else count them\n"
+            "  -u          load: send statsd over UDP\n"
+            "  -a          stream: pass every line with its matching pattern indices\n"
+            "  -x          submatch offsets; test: check them against regexec\n"
+            "  -k kernel   literal search: scalar, ssse3 or avx2 (best supported)\n"
+            "  -v          print compiler diagnostics and counters\n"
+            "  -m format   per-pattern counters and latency, text or json, printed\n"
+            "              to stderr at exit and on SIGUSR1 while streaming or serving\n"
+            "  -n names    bench, load, analyze: number of names (100000)\n"
+            "  -H hosts    bench: distinct hosts (500)\n"
+            "  -S count    bench: distinct services (%d)\n"
+            "  -D depth    bench: up to this many trailing segments (3)\n"
+            "  -r ratio    bench: fraction of names matching some rule (0.5)\n"
+            "  -s seed     bench: generator seed (1)\n",
+            prog, DEFAULT_CACHE_STATES, DEFAULT_PORT, DEFAULT_STATSD_PORT,
+            countof(gen_services));
+}
+
+int main(int argc, char **argv) {
+    int retcode = 1;
+    const char *cmd = "test";
+    struct RuleSet *rs = NULL;
+    struct Scratch *scs[MAX_THREADS] = {NULL};
+    struct Options o = {
+        .engine = ENGINE_DFA,
+        .cache_states = DEFAULT_CACHE_STATES,
+        .nthreads = 1,
+        .pattern_path = "pattern.txt",
+        .test_path = "test.txt",
+        .input_path = "-",
+        .bench_names = 100000,
+        .bench_hosts = 500,
+        .bench_services = countof(gen_services),
+        .bench_depth = 3,
+        .hit_ratio = 0.5,
+        .seed = 1,
+    };
+
+    if (argc > 1 && argv[1][0] != '-') {
+        cmd = argv[1];
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+
+    int opt;
+    while ((opt = getopt(argc, argv, "abc:de:i:j:k:m:p:t:uvwxC:F:I:M:P:Rn:H:S:D:r:s:")) != -1) {
+        switch (opt) {
+        case 'a': o.annotate = 1; break;
+        case 'b': o.builtins = 1; break;
+        case 'c': o.cache_states = atoi(optarg); break;
+        case 'd': o.drop = 1; break;
+        case 'e':
+            for (o.engine = 0; o.engine < ENGINE_COUNT; o.engine++)
+                if (!strcmp(optarg, engine_names[o.engine])) break;
+            if (o.engine == ENGINE_COUNT) {
+                usage(argv[0]);
+                return 1;
+            }
+            o.engine_mask |= 1 << o.engine;
+            break;
+        case 'i': o.input_path = optarg; break;
+        case 'j':
+            o.nthreads = atoi(optarg);
+            if (o.nthreads < 1 || o.nthreads > MAX_THREADS) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'k': o.kernel = optarg; break;
+        case 'm':
+            o.stats = !strcmp(optarg, "text") ? 1 : !strcmp(optarg, "json") ? 2 : 0;
+            if (!o.stats) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'p': o.pattern_path = optarg; break;
+        case 't': o.test_path = optarg; break;
+        case 'u': o.udp = 1; break;
+        case 'v': o.verbose = 1; break;
+        case 'w': o.watch = 1; break;
+        case 'x': o.extract = 1; break;
+        case 'C': o.result_cache_mb = atol(optarg); break;
+        case 'F': o.forward_port = atoi(optarg); break;
+        case 'I': o.image_path = optarg; break;
+        case 'M':
+            for (o.mode = 0; o.mode < MODE_COUNT; o.mode++)
+                if (!strcmp(optarg, mode_names[o.mode])) break;
+            if (o.mode == MODE_COUNT) {
+                usage(argv[0]);
+                return 1;
+            }
+            o.mode_mask |= 1 << o.mode;
+            break;
+        case 'P': o.listen_port = atoi(optarg); break;
+        case 'R': o.prune = 1; break;
+        case 'n': o.bench_names = atol(optarg); break;
+        case 'H': o.bench_hosts = atoi(optarg); break;
+        case 'S': o.bench_services = atoi(optarg); break;
+        case 'D': o.bench_depth = atoi(optarg); break;
+        case 'r': o.hit_ratio = atof(optarg); break;
+        case 's': o.seed = strtoull(optarg, NULL, 10); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (strcmp(cmd, "test") && strcmp(cmd, "stream") && strcmp(cmd, "bench") &&
+        strcmp(cmd, "selftest") && strcmp(cmd, "compile") && strcmp(cmd, "serve") &&
+        strcmp(cmd, "statsd") && strcmp(cmd, "load") && strcmp(cmd, "gen") &&
+        strcmp(cmd, "analyze")) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!o.listen_port)
+        o.listen_port = !strcmp(cmd, "statsd") || o.udp ? DEFAULT_STATSD_PORT : DEFAULT_PORT;
+    if (simd_select(o.kernel)) {
+        fprintf(stderr, "Literal search kernel not supported here: %s\n", o.kernel);
+        return 1;
+    }
+
+    /* Read patterns and compile them into one rule set, unless a compiled
+     * image of the same patterns can be mapped */
+    if (!strcmp(cmd, "compile")) {
+        if (!o.image_path) {
+            usage(argv[0]);
+            return 1;
+        }
+        rs = load_ruleset(o.pattern_path, o.builtins);
+        if (!rs || save_ruleset(rs, o.image_path)) goto error;
+        if (o.verbose) describe_ruleset(rs, stderr);
+        retcode = 0;
+        goto error;
+    }
+    if (o.image_path && !(rs = map_ruleset(o.image_path, o.pattern_path, o.builtins)))
+        fprintf(stderr, "Compiling %s instead\n", o.pattern_path);
+    if (!rs) rs = load_ruleset(o.pattern_path, o.builtins);
+    if (!rs) goto error;
+    if (o.prune) prune_ruleset(rs);
+    if (o.verbose) describe_ruleset(rs, stderr);
+    if (!strcmp(cmd, "gen")) {
+        retcode = cmd_gen(rs, &o);
+        goto error;
+    }
+    if (o.engine_mask & (1 << ENGINE_GEN) && !gen_usable(rs))
+        fprintf(stderr, "No matcher generated from %s is built in, gen runs the DFA\n",
+                o.pattern_path);
+    if (o.stats) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_stats_signal;
+        sigemptyset(&sa.sa_mask);
+        /* no SA_RESTART: a blocked stream read returns to print the dump */
+        sigaction(SIGUSR1, &sa, NULL);
+        o.shared_stats = new_stats(rs->n);
+        if (!o.shared_stats) goto error;
+    }
+    if (o.result_cache_mb > 0) {
+        o.shared_cache = new_result_cache(rs->nwords, o.mode, o.result_cache_mb << 20);
+        if (!o.shared_cache) goto error;
+    }
+    for (int t = 0; t < o.nthreads; t++) {
+        scs[t] = new_scratch(rs, o.cache_states, o.nthreads > 1, o.shared_stats);
+        if (!scs[t]) goto error;
+        scs[t]->cache = o.shared_cache;
+    }
+
+    if (!strcmp(cmd, "test"))
+        retcode = cmd_test(rs, scs, &o);
+    else if (!strcmp(cmd, "stream"))
+        retcode = live_run(cmd_stream, &rs, scs, &o);
+    else if (!strcmp(cmd, "serve"))
+        retcode = live_run(cmd_serve, &rs, scs, &o);
+    else if (!strcmp(cmd, "statsd"))
+        retcode = live_run(cmd_statsd, &rs, scs, &o);
+    else if (!strcmp(cmd, "load"))
+        retcode = cmd_load(rs, scs, &o);
+    else if (!strcmp(cmd, "bench"))
+        retcode = cmd_bench(rs, scs, &o);
+    else if (!strcmp(cmd, "analyze"))
+        retcode = cmd_analyze(rs, scs, &o);
+    else
+        retcode = cmd_selftest(rs, scs, &o);
+    if (o.stats) {
+        for (int t = 0; t < o.nthreads; t++)
+            scratch_flush_stats(scs[t]);
+        print_stats(rs, o.shared_stats, o.stats == 2, stderr);
+    }
+    if (o.shared_cache && o.verbose && strcmp(cmd, "test"))
+        print_cache_stats(o.shared_cache, scs, o.nthreads, stderr);
+
+error:
+    for (int t = 0; t < o.nthreads; t++)
+        free_scratch(scs[t]);
+    free_stats(o.shared_stats);
+    free_result_cache(o.shared_cache);
+    free_ruleset(rs);
     return retcode;
 }